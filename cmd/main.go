@@ -6,26 +6,45 @@ import (
 	"log"
 	"log/slog"
 	"ndb-server/internal/api"
+	"ndb-server/internal/ndb"
 	"net/http"
+	"runtime"
+	"strings"
 	"time"
 )
 
 type config struct {
-	leader             bool
-	port               int
-	s3Bucket           string
-	s3Region           string
-	maxCheckpoints     int
-	localCheckpointDir string
-	checkpointInterval time.Duration
-	useTls             bool
-	tlsCertFile        string
-	tlsKeyFile         string
+	leader              bool
+	port                int
+	s3Bucket            string
+	s3Region            string
+	maxCheckpoints      int
+	localCheckpointDir  string
+	checkpointInterval  time.Duration
+	useTls              bool
+	tlsCertFile         string
+	tlsKeyFile          string
+	leaderUrl           string
+	replicationInterval time.Duration
+	queryCacheMb        int
+	insertThreads       int
+	maxEmbeddingMb      int
+	warmupQueries       int
+	warmupBudget        time.Duration
+	pruneInterval       time.Duration
+	pruneThreshold      float64
+	maxSearches         int
+	maxQueuedSearches   int
+	searchTimeout       time.Duration
 }
 
 func parseFlags() config {
 	var cfg config
 	var checkpointIntervalStr string
+	var replicationIntervalStr string
+	var warmupBudgetStr string
+	var pruneIntervalStr string
+	var searchTimeoutStr string
 
 	flag.BoolVar(&cfg.leader, "leader", false, "Run as leader")
 	flag.IntVar(&cfg.port, "port", -1, "Port to run the server on")
@@ -37,6 +56,18 @@ func parseFlags() config {
 	flag.BoolVar(&cfg.useTls, "tls", false, "Enable TLS for the server")
 	flag.StringVar(&cfg.tlsCertFile, "tls-crt", "/certs/server.crt", "Path to TLS certificate file")
 	flag.StringVar(&cfg.tlsKeyFile, "tls-key", "/certs/server.key", "Path to TLS key file")
+	flag.StringVar(&cfg.leaderUrl, "leader-url", "", "Url of the leader (e.g., http://leader:80), optional, if specified followers will replicate writes from the leader between checkpoints")
+	flag.IntVar(&cfg.queryCacheMb, "query-cache-mb", 64, "Maximum memory in MB used to cache search results, 0 disables the cache")
+	flag.IntVar(&cfg.insertThreads, "insert-threads", 0, "Number of threads used to index the chunks of each insert, 0 uses all cores")
+	flag.IntVar(&cfg.maxEmbeddingMb, "max-embedding-mb", 0, "Maximum memory in MB used by the embeddings of chunks for hybrid search, inserts exceeding it fail, 0 disables the limit")
+	flag.IntVar(&cfg.warmupQueries, "warmup-queries", 1000, "Number of recent searches followers replay on a new checkpoint before serving queries from it, 0 disables warmup")
+	flag.StringVar(&warmupBudgetStr, "warmup-budget", "5s", "Maximum time followers spend replaying searches on a new checkpoint (e.g., 5s, 500ms)")
+	flag.StringVar(&pruneIntervalStr, "prune-interval", "1m", "Interval for the leader to check if the index should be pruned (e.g., 1m, 30s)")
+	flag.Float64Var(&cfg.pruneThreshold, "prune-threshold", 0.1, "Fraction of document versions deleted since the last prune at which the leader prunes the index, 0 disables pruning")
+	flag.IntVar(&cfg.maxSearches, "max-concurrent-searches", 2*runtime.NumCPU(), "Maximum number of searches run concurrently, 0 disables admission control")
+	flag.IntVar(&cfg.maxQueuedSearches, "max-queued-searches", 1000, "Maximum number of searches waiting to run, further searches are rejected with a 429 status")
+	flag.StringVar(&searchTimeoutStr, "search-timeout", "10s", "Maximum time a search waits to run before it fails with a 503 status (e.g., 10s, 500ms), 0 disables the timeout")
+	flag.StringVar(&replicationIntervalStr, "replication-interval", "1s", "Interval for followers to pull writes from the leader (e.g., 1s, 500ms)")
 
 	flag.Parse()
 
@@ -44,6 +75,30 @@ func parseFlags() config {
 		log.Fatalf("s3-region must be specified")
 	}
 
+	if cfg.queryCacheMb < 0 {
+		log.Fatalf("query-cache-mb must be non-negative")
+	}
+
+	if cfg.insertThreads < 0 {
+		log.Fatalf("insert-threads must be non-negative")
+	}
+
+	if cfg.maxEmbeddingMb < 0 {
+		log.Fatalf("max-embedding-mb must be non-negative")
+	}
+
+	if cfg.warmupQueries < 0 {
+		log.Fatalf("warmup-queries must be non-negative")
+	}
+
+	if cfg.pruneThreshold < 0 || cfg.pruneThreshold > 1 {
+		log.Fatalf("prune-threshold must be between 0 and 1")
+	}
+
+	if cfg.maxSearches < 0 || cfg.maxQueuedSearches < 0 {
+		log.Fatalf("max-concurrent-searches and max-queued-searches must be non-negative")
+	}
+
 	if cfg.port == -1 {
 		if cfg.useTls {
 			cfg.port = 443
@@ -58,6 +113,30 @@ func parseFlags() config {
 	}
 	cfg.checkpointInterval = checkpointInterval
 
+	replicationInterval, err := time.ParseDuration(replicationIntervalStr)
+	if err != nil {
+		log.Fatalf("Invalid replication interval: %v", err)
+	}
+	cfg.replicationInterval = replicationInterval
+
+	warmupBudget, err := time.ParseDuration(warmupBudgetStr)
+	if err != nil {
+		log.Fatalf("Invalid warmup budget: %v", err)
+	}
+	cfg.warmupBudget = warmupBudget
+
+	pruneInterval, err := time.ParseDuration(pruneIntervalStr)
+	if err != nil {
+		log.Fatalf("Invalid prune interval: %v", err)
+	}
+	cfg.pruneInterval = pruneInterval
+
+	searchTimeout, err := time.ParseDuration(searchTimeoutStr)
+	if err != nil {
+		log.Fatalf("Invalid search timeout: %v", err)
+	}
+	cfg.searchTimeout = searchTimeout
+
 	return cfg
 }
 
@@ -71,6 +150,13 @@ func main() {
 		"maxCheckpoints", cfg.maxCheckpoints, "localCheckpointDir", cfg.localCheckpointDir,
 		"checkpointInterval", cfg.checkpointInterval.String(), "useTls", cfg.useTls,
 		"tlsCertFile", cfg.tlsCertFile, "tlsKeyFile", cfg.tlsKeyFile,
+		"leaderUrl", cfg.leaderUrl, "replicationInterval", cfg.replicationInterval.String(),
+		"queryCacheMb", cfg.queryCacheMb, "insertThreads", cfg.insertThreads,
+		"maxEmbeddingMb", cfg.maxEmbeddingMb,
+		"warmupQueries", cfg.warmupQueries, "warmupBudget", cfg.warmupBudget.String(),
+		"pruneInterval", cfg.pruneInterval.String(), "pruneThreshold", cfg.pruneThreshold,
+		"maxSearches", cfg.maxSearches, "maxQueuedSearches", cfg.maxQueuedSearches,
+		"searchTimeout", cfg.searchTimeout.String(),
 	)
 
 	var checkpointer api.Checkpointer
@@ -84,15 +170,33 @@ func main() {
 		slog.Info("no s3 bucket specified, no checkpoints will be saved")
 	}
 
-	server, err := api.NewServer(checkpointer, cfg.leader, cfg.localCheckpointDir)
+	ndbOptions := ndb.DefaultOptions()
+	ndbOptions.QueryCacheSize = uint64(cfg.queryCacheMb) * 1024 * 1024
+	ndbOptions.InsertThreads = cfg.insertThreads
+	ndbOptions.MaxEmbeddingBytes = uint64(cfg.maxEmbeddingMb) * 1024 * 1024
+	// Followers only modify the ndb when replaying ops from the leader, otherwise
+	// checkpoints are opened read only.
+	ndbOptions.ReadOnly = !cfg.leader && cfg.leaderUrl == ""
+
+	server, err := api.NewServerWithOptions(checkpointer, cfg.leader, cfg.localCheckpointDir, ndbOptions)
 	if err != nil {
 		log.Fatalf("Failed to create server: %v", err)
 	}
 
+	server.EnableAdmissionControl(cfg.maxSearches, cfg.maxQueuedSearches)
+	server.SetSearchTimeout(cfg.searchTimeout)
+
 	if cfg.leader {
 		go server.PushCheckpoints(cfg.checkpointInterval)
+		if cfg.pruneThreshold > 0 {
+			go server.PruneDeleted(cfg.pruneInterval, cfg.pruneThreshold)
+		}
 	} else {
+		server.EnableWarmup(cfg.warmupQueries, cfg.warmupBudget)
 		go server.PullCheckpoints(cfg.checkpointInterval)
+		if cfg.leaderUrl != "" {
+			go server.ReplicateFromLeader(strings.TrimSuffix(cfg.leaderUrl, "/"), cfg.replicationInterval)
+		}
 	}
 
 	router := server.Router()
@@ -0,0 +1,224 @@
+package api
+
+import (
+	"context"
+	"errors"
+	"net/http"
+	"sync"
+)
+
+type searchPriority int
+
+const (
+	priorityHigh searchPriority = iota
+	priorityLow
+	nSearchPriorities
+)
+
+// priorityHeader sets the priority of a search, it is either "high", which is
+// the default, or "low".
+const priorityHeader = "X-Priority"
+
+func parseSearchPriority(r *http.Request) (searchPriority, error) {
+	switch r.Header.Get(priorityHeader) {
+	case "", "high":
+		return priorityHigh, nil
+	case "low":
+		return priorityLow, nil
+	default:
+		return 0, CodedErrorf(http.StatusUnprocessableEntity, "invalid %s header %q: must be 'high' or 'low'", priorityHeader, r.Header.Get(priorityHeader))
+	}
+}
+
+var (
+	errSearchQueueFull = errors.New("too many searches are queued")
+	errSearchShed      = errors.New("search was displaced from the queue by a higher priority search")
+)
+
+type admissionWaiter struct {
+	// admitted receives nil once the search holds a slot, or an error if it is
+	// shed from the queue.
+	admitted chan error
+}
+
+// admissionQueue bounds the number of searches which run concurrently, so that
+// bursts of searches wait in a bounded queue instead of piling up on the ndb
+// lock. Queued searches are admitted in priority order, and in arrival order for
+// the same priority. When the queue is full a search is rejected, unless it can
+// displace the most recent search of a lower priority.
+type admissionQueue struct {
+	lock sync.Mutex
+
+	running       int
+	maxConcurrent int
+	maxQueued     int
+	queues        [nSearchPriorities][]*admissionWaiter
+	nQueued       int
+
+	nAdmitted uint64
+	nRejected uint64
+	nShed     uint64
+	nTimedOut uint64
+}
+
+func newAdmissionQueue(maxConcurrent, maxQueued int) *admissionQueue {
+	return &admissionQueue{maxConcurrent: maxConcurrent, maxQueued: maxQueued}
+}
+
+// acquire waits for a slot to run a search until the context is done, release
+// must be called once the search completes if it returns nil.
+func (q *admissionQueue) acquire(ctx context.Context, priority searchPriority) error {
+	q.lock.Lock()
+
+	if q.running < q.maxConcurrent && q.nQueued == 0 {
+		q.running++
+		q.nAdmitted++
+		q.lock.Unlock()
+		return nil
+	}
+
+	if q.nQueued >= q.maxQueued && !q.shedLocked(priority) {
+		q.nRejected++
+		q.lock.Unlock()
+		return errSearchQueueFull
+	}
+
+	waiter := &admissionWaiter{admitted: make(chan error, 1)}
+	q.queues[priority] = append(q.queues[priority], waiter)
+	q.nQueued++
+	q.lock.Unlock()
+
+	select {
+	case err := <-waiter.admitted:
+		return err
+	case <-ctx.Done():
+	}
+
+	q.lock.Lock()
+	removed := q.removeLocked(priority, waiter)
+	if removed {
+		q.nTimedOut++
+	}
+	q.lock.Unlock()
+
+	if !removed {
+		// The search was admitted or shed at the same time as the context was done.
+		if err := <-waiter.admitted; err != nil {
+			return err
+		}
+		q.release()
+	}
+	return ctx.Err()
+}
+
+// shedLocked removes the most recent queued search with a lower priority than
+// priority to make room in the queue. Returns false if there is no such search.
+func (q *admissionQueue) shedLocked(priority searchPriority) bool {
+	for p := nSearchPriorities - 1; p > priority; p-- {
+		if n := len(q.queues[p]); n > 0 {
+			waiter := q.queues[p][n-1]
+			q.queues[p] = q.queues[p][:n-1]
+			q.nQueued--
+			q.nShed++
+			waiter.admitted <- errSearchShed
+			return true
+		}
+	}
+	return false
+}
+
+func (q *admissionQueue) removeLocked(priority searchPriority, waiter *admissionWaiter) bool {
+	for i, w := range q.queues[priority] {
+		if w == waiter {
+			q.queues[priority] = append(q.queues[priority][:i], q.queues[priority][i+1:]...)
+			q.nQueued--
+			return true
+		}
+	}
+	return false
+}
+
+// release hands the slot of a completed search to the next queued search.
+func (q *admissionQueue) release() {
+	q.lock.Lock()
+	defer q.lock.Unlock()
+
+	for p := range q.queues {
+		if len(q.queues[p]) > 0 {
+			waiter := q.queues[p][0]
+			q.queues[p] = q.queues[p][1:]
+			q.nQueued--
+			q.nAdmitted++
+			waiter.admitted <- nil
+			return
+		}
+	}
+	q.running--
+}
+
+type admissionStats struct {
+	running  int
+	queued   int
+	admitted uint64
+	rejected uint64
+	shed     uint64
+	timedOut uint64
+}
+
+func (q *admissionQueue) stats() admissionStats {
+	q.lock.Lock()
+	defer q.lock.Unlock()
+	return admissionStats{
+		running:  q.running,
+		queued:   q.nQueued,
+		admitted: q.nAdmitted,
+		rejected: q.nRejected,
+		shed:     q.nShed,
+		timedOut: q.nTimedOut,
+	}
+}
+
+// admitSearch applies the search timeout to the context of the request, and
+// waits for the search to be admitted if admission control is enabled. The
+// returned function must be called once the search completes if the error is
+// nil.
+func (s *Server) admitSearch(r *http.Request) (context.Context, func(), error) {
+	priority, err := parseSearchPriority(r)
+	if err != nil {
+		return nil, nil, err
+	}
+
+	ctx, cancel := r.Context(), context.CancelFunc(func() {})
+	if s.searchTimeout > 0 {
+		ctx, cancel = context.WithTimeout(ctx, s.searchTimeout)
+	}
+
+	if s.admission == nil {
+		return ctx, cancel, nil
+	}
+
+	if err := s.admission.acquire(ctx, priority); err != nil {
+		cancel()
+		return nil, nil, searchContextError(err)
+	}
+
+	return ctx, func() {
+		s.admission.release()
+		cancel()
+	}, nil
+}
+
+// searchContextError converts errors from admission control and queries which
+// were not run before their deadline to coded errors.
+func searchContextError(err error) error {
+	switch {
+	case errors.Is(err, errSearchQueueFull), errors.Is(err, errSearchShed):
+		return CodedError(http.StatusTooManyRequests, err)
+	case errors.Is(err, context.DeadlineExceeded):
+		return CodedErrorf(http.StatusServiceUnavailable, "search timed out: %w", err)
+	case errors.Is(err, context.Canceled):
+		return CodedErrorf(http.StatusServiceUnavailable, "search canceled: %w", err)
+	default:
+		return nil
+	}
+}
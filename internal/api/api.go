@@ -1,16 +1,21 @@
 package api
 
 import (
+	"bytes"
+	"encoding/base64"
 	"encoding/json"
 	"fmt"
 	"io"
 	"log"
 	"log/slog"
+	"math"
 	"mime/multipart"
 	"ndb-server/internal/ndb"
 	"net/http"
+	"net/url"
 	"os"
 	"path/filepath"
+	"strconv"
 	"strings"
 	"sync"
 	"sync/atomic"
@@ -22,7 +27,23 @@ import (
 )
 
 const (
+	// maxInsertFileSize applies when the file part of an insert request is sent
+	// before the metadata part, in which case the file must be buffered in memory.
 	maxInsertFileSize = 100 * 1024 * 1024 // 100 MB
+	// maxStreamingInsertFileSize applies when the metadata part is sent first
+	// and the file is parsed as it is read from the request. The parsed chunks are
+	// still held in the document until it is inserted with a single call, so this
+	// bounds the memory used by an insert.
+	maxStreamingInsertFileSize = 1024 * 1024 * 1024 // 1 GB
+	insertParseBatchSize       = 4096
+	maxSearchBatchSize         = 1000
+	// maxDeleteBatchSize is the number of documents deleted while holding the lock,
+	// deleting a document takes on the order of a millisecond.
+	maxDeleteBatchSize = 50
+	// The number of sources returned by the sources page endpoint if no limit
+	// is specified, and the maximum limit.
+	defaultSourcesPageSize = 1000
+	maxSourcesPageSize     = 10000
 )
 
 type checkpointTaskInfo struct {
@@ -32,7 +53,18 @@ type checkpointTaskInfo struct {
 }
 
 type Server struct {
+	// lock guards the ndb itself, searches hold the read lock. Inserts and upvotes
+	// also only hold the read lock while they are applied, since the ndb supports
+	// queries concurrently with these operations, however deletes and replacing
+	// the ndb require the write lock since chunks are removed while searches may
+	// be reading them.
 	lock sync.RWMutex
+	// writeLock serializes modifications to the ndb, it must be acquired before
+	// lock. It also guards dirty, prune, and the op log state on followers.
+	writeLock sync.Mutex
+	// checkpointLock serializes checkpoints, it is held until the checkpoint upload
+	// completes, while lock is only held while the snapshot is saved.
+	checkpointLock sync.Mutex
 
 	ndb    ndb.NeuralDB
 	leader bool
@@ -44,6 +76,41 @@ type Server struct {
 	currVersion    atomic.Int64
 	dirty          bool
 	checkpointTask atomic.Pointer[checkpointTaskInfo]
+
+	// pullLock serializes loading new checkpoints on followers, since they can be
+	// loaded both by the checkpoint poller and when replicating the op log.
+	pullLock sync.Mutex
+	// ndbPath is the local directory of the live ndb, it is guarded by lock.
+	ndbPath string
+	// ndbOptions are used to open the ndb, as well as any checkpoints loaded later.
+	ndbOptions ndb.Options
+
+	// recentQueries are replayed for up to warmupBudget on each checkpoint that is
+	// loaded before it replaces the live ndb, it is nil if warmup is disabled.
+	recentQueries *queryRecorder
+	warmupBudget  time.Duration
+
+	// opLog records the writes applied on the leader so that followers can replay
+	// them between checkpoints, it is nil on followers.
+	opLog *opLog
+	// opState is the state of the op log that has been applied by a follower, and
+	// opsSinceLoad indicates if any ops have been applied since the last checkpoint
+	// was loaded. These are only used on followers, and are guarded by writeLock.
+	opState      OpLogState
+	opsSinceLoad bool
+
+	// upvotes coalesces concurrent upvote requests into larger finetuning batches.
+	upvotes *upvoteQueue
+
+	prune pruneState
+
+	// admission bounds the number of concurrent searches, it is nil if admission
+	// control is disabled. searchTimeout bounds the time a search waits to be
+	// admitted and to be run, 0 is no timeout.
+	admission     *admissionQueue
+	searchTimeout time.Duration
+
+	metrics *serverMetrics
 }
 
 func (s *Server) getVersion() Version {
@@ -87,48 +154,136 @@ func downloadLatestVersionFromCheckpointer(checkpointer Checkpointer, localCheck
 }
 
 func NewServer(checkpointer Checkpointer, leader bool, localCheckpointDir string) (*Server, error) {
+	return NewServerWithOptions(checkpointer, leader, localCheckpointDir, ndb.DefaultOptions())
+}
+
+// NewServerWithOptions creates a server which opens the ndb, and any checkpoints
+// loaded later, with the given options. Followers which do not replicate the op
+// log can use read only mode, which avoids recovery, WAL writes, and compactions
+// of the RocksDB instance each time a checkpoint is loaded.
+func NewServerWithOptions(checkpointer Checkpointer, leader bool, localCheckpointDir string, ndbOptions ndb.Options) (*Server, error) {
 	if !leader && checkpointer == nil {
 		return nil, fmt.Errorf("checkpointer must be initialized for non-leader nodes")
 	}
 
+	if leader && ndbOptions.ReadOnly {
+		return nil, fmt.Errorf("leader cannot open the ndb in read only mode")
+	}
+
 	currVersion, err := downloadLatestVersionFromCheckpointer(checkpointer, localCheckpointDir)
 	if err != nil {
 		return nil, err
 	}
 
-	neuralDB, err := ndb.New(localVersionPath(localCheckpointDir, currVersion))
+	ndbPath := localVersionPath(localCheckpointDir, currVersion)
+
+	initialOptions := ndbOptions
+	if currVersion == 0 {
+		// There is no checkpoint to open yet, so an empty ndb is created. It is not
+		// modified on a read only follower, since writes are rejected on followers.
+		initialOptions.ReadOnly = false
+	}
+
+	neuralDB, err := ndb.NewWithOptions(ndbPath, initialOptions)
 	if err != nil {
 		return nil, fmt.Errorf("failed to initialize neuralDB for version %v: %w", currVersion, err)
 	}
 
+	opState, err := loadOpLogState(ndbPath)
+	if err != nil {
+		return nil, fmt.Errorf("failed to load op log state for version %v: %w", currVersion, err)
+	}
+
 	server := &Server{
 		ndb:                neuralDB,
 		leader:             leader,
 		localCheckpointDir: localCheckpointDir,
 		checkpointer:       checkpointer,
 		dirty:              false,
+		ndbPath:            ndbPath,
+		ndbOptions:         ndbOptions,
+		metrics:            newServerMetrics(),
 	}
 	server.currVersion.Store(int64(currVersion))
+	server.upvotes = newUpvoteQueue(server.applyUpvotes)
+
+	if leader {
+		if server.prune.deletedVersions, err = loadPruneState(ndbPath); err != nil {
+			return nil, fmt.Errorf("failed to load prune state for version %v: %w", currVersion, err)
+		}
+
+		if opState.Epoch == "" && currVersion != 0 {
+			// The checkpoint predates the op log, so it is not known which ops followers
+			// have applied, they must load a checkpoint created by this leader.
+			opState.Epoch = "unknown"
+		}
+		server.opLog, err = newOpLog(filepath.Join(localCheckpointDir, opLogDir), uuid.NewString(), opState, defaultOpLogMaxBytes)
+		if err != nil {
+			return nil, err
+		}
+	} else {
+		server.opState = opState
+	}
 
 	return server, nil
 }
 
+// EnableWarmup records the most recent nQueries searches, so that they can be
+// replayed on new checkpoints for up to budget before the checkpoint is used to
+// serve queries. It must be called before the server handles any requests.
+func (s *Server) EnableWarmup(nQueries int, budget time.Duration) {
+	if nQueries <= 0 || budget <= 0 {
+		s.recentQueries = nil
+		return
+	}
+	s.recentQueries = newQueryRecorder(nQueries)
+	s.warmupBudget = budget
+}
+
+// EnableAdmissionControl limits the number of searches and batch searches which
+// run concurrently to maxConcurrent, with at most maxQueued searches waiting to
+// run. Searches that cannot be queued are rejected with a 429 status, and low
+// priority searches in the queue are displaced by high priority searches when
+// the queue is full. It must be called before the server handles any requests.
+func (s *Server) EnableAdmissionControl(maxConcurrent, maxQueued int) {
+	if maxConcurrent <= 0 {
+		s.admission = nil
+		return
+	}
+	s.admission = newAdmissionQueue(maxConcurrent, max(maxQueued, 0))
+}
+
+// SetSearchTimeout bounds the time a search waits to be admitted and to be run,
+// searches which time out fail with a 503 status. The ndb cannot interrupt a
+// query once it is running, so the timeout is checked before each query starts.
+// It must be called before the server handles any requests.
+func (s *Server) SetSearchTimeout(timeout time.Duration) {
+	s.searchTimeout = max(timeout, 0)
+}
+
 func (s *Server) Router() chi.Router {
 	r := chi.NewRouter()
 	r.Use(middleware.RequestID)
 	r.Use(middleware.Logger)
 	r.Use(middleware.Recoverer)
 
+	r.Get("/metrics", s.Metrics)
+
 	r.Route("/api/v1", func(r chi.Router) {
 		r.Get("/health", func(w http.ResponseWriter, r *http.Request) {
 			w.WriteHeader(http.StatusOK)
 		})
-		r.Post("/search", RestHandler(s.Search))
-		r.Post("/insert", RestHandler(s.Insert))
-		r.Post("/delete", RestHandler(s.Delete))
-		r.Post("/upvote", RestHandler(s.Upvote))
-		r.Get("/sources", RestHandler(s.Sources))
+		r.Post("/search", RestHandler(s.timed("search", s.Search)))
+		r.Post("/search/batch", RestHandler(s.timed("search_batch", s.SearchBatch)))
+		r.Post("/insert", RestHandler(s.timed("insert", s.Insert)))
+		r.Post("/delete", RestHandler(s.timed("delete", s.Delete)))
+		r.Post("/upvote", RestHandler(s.timed("upvote", s.Upvote)))
+		r.Get("/sources", RestHandler(s.timed("sources", s.Sources)))
+		r.Get("/sources/page", RestHandler(s.timed("sources_page", s.SourcesPage)))
+		r.Get("/sources/count", RestHandler(s.timed("sources_count", s.SourcesCount)))
 		r.Get("/version", RestHandler(s.Version))
+		r.Get("/stats", RestHandler(s.Stats))
+		r.Get("/oplog", RestHandler(s.OpLog))
 		r.Post("/checkpoint", RestHandler(s.Checkpoint))
 	})
 
@@ -142,62 +297,297 @@ func formatQueryLog(query string) string {
 	return query
 }
 
+func (p *NDBSearchParams) ndbConstraints() (ndb.Constraints, error) {
+	ndbConstaints := make(ndb.Constraints, len(p.Constraints))
+	for key, constraint := range p.Constraints {
+		constraint, err := constraint.asNDBConstraint()
+		if err != nil {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "unable to parse constraint %s: %w", key, err)
+		}
+		ndbConstaints[key] = constraint
+	}
+	return ndbConstaints, nil
+}
+
+func (p *NDBSearchParams) hybridOptions() (ndb.HybridOptions, error) {
+	options := ndb.DefaultHybridOptions()
+	switch p.Fusion {
+	case "":
+	case "rrf":
+		options.Fusion = ndb.ReciprocalRankFusion
+	case "weighted":
+		options.Fusion = ndb.WeightedFusion
+	default:
+		return options, CodedErrorf(http.StatusUnprocessableEntity, "invalid fusion '%s': must be 'rrf' or 'weighted'", p.Fusion)
+	}
+	if p.DenseWeight != nil {
+		if *p.DenseWeight < 0 || *p.DenseWeight > 1 {
+			return options, CodedErrorf(http.StatusUnprocessableEntity, "dense_weight must be between 0 and 1")
+		}
+		options.DenseWeight = *p.DenseWeight
+	}
+	if p.Candidates < 0 {
+		return options, CodedErrorf(http.StatusUnprocessableEntity, "candidates must be >= 0")
+	}
+	options.Candidates = p.Candidates
+	return options, nil
+}
+
+func newSearchResponse(query string, chunks []ndb.Chunk) NDBSearchResponse {
+	references := make([]Reference, len(chunks))
+	for i, chunk := range chunks {
+		references[i] = Reference{
+			Id:       chunk.Id,
+			Text:     chunk.Text,
+			Source:   chunk.Document,
+			SourceId: chunk.DocId,
+			Metadata: chunk.Metadata,
+			Score:    chunk.Score,
+		}
+	}
+
+	return NDBSearchResponse{Query: query, References: references}
+}
+
 func (s *Server) Search(r *http.Request) (any, error) {
+	stages := &s.metrics.stages
+
+	start := time.Now()
+	ctx, done, err := s.admitSearch(r)
+	if err != nil {
+		return nil, err
+	}
+	defer done()
+	stages.admission.observe(time.Since(start))
+
+	start = time.Now()
 	searchParams, err := ParseRequest[NDBSearchParams](r)
 	if err != nil {
 		return nil, err
 	}
+	stages.parse.observe(time.Since(start))
 
 	logger := slog.With("request_id", r.Context().Value(middleware.RequestIDKey), "action", "search")
 
-	s.lock.RLock()
+	s.rlock(lockOpSearch)
 	defer s.lock.RUnlock()
 
-	ndbConstaints := make(ndb.Constraints, len(searchParams.Constraints))
-	for key, constraint := range searchParams.Constraints {
-		constraint, err := constraint.asNDBConstraint()
-		if err != nil {
-			return nil, CodedErrorf(http.StatusUnprocessableEntity, "unable to parse constraint %s: %w", key, err)
-		}
-		ndbConstaints[key] = constraint
+	// The search timeout covers the wait for the lock behind deletes and prunes,
+	// so a search which timed out while waiting is not run, even if its results
+	// are cached.
+	if err := searchContextError(ctx.Err()); err != nil {
+		return nil, err
 	}
 
-	logger.Info("search: received", "query", formatQueryLog(searchParams.Query), "top_k", searchParams.TopK, "constraints", ndbConstaints.String())
+	start = time.Now()
+	ndbConstaints, err := searchParams.ndbConstraints()
+	if err != nil {
+		return nil, err
+	}
+	stages.constraints.observe(time.Since(start))
+
+	logger.Info("search: received", "query", formatQueryLog(searchParams.Query), "top_k", searchParams.TopK, "constraints", ndbConstaints.String(), "hybrid", len(searchParams.Embedding) > 0)
+
+	if len(searchParams.Embedding) > 0 {
+		return s.searchHybrid(logger, searchParams, ndbConstaints)
+	}
 
-	chunks, err := s.ndb.Query(searchParams.Query, searchParams.TopK, ndbConstaints)
+	s.recentQueries.record(ndb.BatchQuery{Query: searchParams.Query, TopK: searchParams.TopK, Constraints: ndbConstaints})
+
+	chunks, timings, err := s.ndb.QueryContext(ctx, searchParams.Query, searchParams.TopK, ndbConstaints)
 	if err != nil {
 		logger.Error("search: error", "error", err, "query", searchParams.Query)
+		if err := searchContextError(err); err != nil {
+			return nil, err
+		}
 		return nil, CodedErrorf(http.StatusInternalServerError, "ndb query error %w", err)
 	}
 
+	stages.args.observe(timings.Args)
+	if timings.Cached {
+		s.metrics.searchCached.Add(1)
+	} else {
+		stages.engine.observe(timings.Engine)
+		stages.serialize.observe(timings.Serialize)
+	}
+	stages.convert.observe(timings.Convert)
+	s.metrics.searchResults.Add(uint64(len(chunks)))
+
 	logger.Info("search: complete", "n_chunks", len(chunks))
 
-	references := make([]Reference, len(chunks))
-	for i, chunk := range chunks {
-		references[i] = Reference{
-			Id:       chunk.Id,
-			Text:     chunk.Text,
-			Source:   chunk.Document,
-			SourceId: chunk.DocId,
-			Metadata: chunk.Metadata,
-			Score:    chunk.Score,
+	start = time.Now()
+	response := newSearchResponse(searchParams.Query, chunks)
+	stages.response.observe(time.Since(start))
+
+	return response, nil
+}
+
+// searchHybrid runs a search with a query embedding, it must be called with the
+// read lock held. Hybrid searches are not recorded for warmup, since they are
+// not cached and retrieve more candidates than the top_k of the search.
+func (s *Server) searchHybrid(logger *slog.Logger, params NDBSearchParams, constraints ndb.Constraints) (any, error) {
+	options, err := params.hybridOptions()
+	if err != nil {
+		return nil, err
+	}
+
+	if err := s.checkEmbeddingDim(len(params.Embedding)); err != nil {
+		return nil, err
+	}
+
+	// The engine cannot be interrupted, and hybrid queries are not given the
+	// deadline, so the timeout only applies until the lock is acquired.
+	start := time.Now()
+	chunks, err := s.ndb.QueryHybrid(params.Query, params.Embedding, params.TopK, constraints, options)
+	if err != nil {
+		logger.Error("search: error", "error", err, "query", params.Query)
+		return nil, CodedErrorf(http.StatusInternalServerError, "ndb query error %w", err)
+	}
+	s.metrics.stages.hybrid.observe(time.Since(start))
+	s.metrics.searchResults.Add(uint64(len(chunks)))
+
+	logger.Info("search: complete", "n_chunks", len(chunks))
+
+	return newSearchResponse(params.Query, chunks), nil
+}
+
+// checkEmbeddingDim returns an error if embeddings of the dimension cannot be
+// used with the embeddings in the ndb, since a mismatch is an error in the
+// request rather than in the ndb. It must be called with a lock held.
+func (s *Server) checkEmbeddingDim(dim int) error {
+	if indexDim := s.ndb.DenseIndexStats().Dim; dim > 0 && indexDim > 0 && dim != indexDim {
+		return CodedErrorf(http.StatusUnprocessableEntity, "embedding dimension %d does not match the dimension of the index %d", dim, indexDim)
+	}
+	return nil
+}
+
+func (s *Server) SearchBatch(r *http.Request) (any, error) {
+	ctx, done, err := s.admitSearch(r)
+	if err != nil {
+		return nil, err
+	}
+	defer done()
+
+	batchParams, err := ParseRequest[NDBBatchSearchParams](r)
+	if err != nil {
+		return nil, err
+	}
+
+	logger := slog.With("request_id", r.Context().Value(middleware.RequestIDKey), "action", "search_batch")
+
+	if len(batchParams.Queries) > maxSearchBatchSize {
+		return nil, CodedErrorf(http.StatusUnprocessableEntity, "number of queries in batch exceeds maximum of %d", maxSearchBatchSize)
+	}
+
+	queries := make([]ndb.BatchQuery, len(batchParams.Queries))
+	for i, params := range batchParams.Queries {
+		if params.TopK <= 0 {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "query %d: top_k must be > 0", i)
+		}
+		if len(params.Embedding) > 0 {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "query %d: embeddings are not supported in batch searches, use /search", i)
+		}
+		ndbConstaints, err := params.ndbConstraints()
+		if err != nil {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "query %d: %w", i, err)
 		}
+		queries[i] = ndb.BatchQuery{Query: params.Query, TopK: params.TopK, Constraints: ndbConstaints}
+	}
+
+	logger.Info("search_batch: received", "n_queries", len(queries))
+
+	for _, query := range queries {
+		s.recentQueries.record(query)
+	}
+
+	s.rlock(lockOpSearchBatch)
+	defer s.lock.RUnlock()
+
+	// As for Search, none of the queries are run if the timeout expired while
+	// waiting for the lock.
+	if err := searchContextError(ctx.Err()); err != nil {
+		return nil, err
+	}
+
+	results, err := s.ndb.QueryBatchContext(ctx, queries)
+	if err != nil {
+		if results == nil {
+			logger.Error("search_batch: error", "error", err)
+			if err := searchContextError(err); err != nil {
+				return nil, err
+			}
+			return nil, CodedErrorf(http.StatusInternalServerError, "ndb query error %w", err)
+		}
+		// The queries that completed before the timeout are returned.
+		logger.Warn("search_batch: timed out", "error", err)
+	}
+
+	logger.Info("search_batch: complete", "n_queries", len(queries))
+
+	response := NDBBatchSearchResponse{Results: make([]NDBSearchResponse, len(results))}
+	for i, chunks := range results {
+		response.Results[i] = newSearchResponse(queries[i].Query, chunks)
+		response.Results[i].TimedOut = chunks == nil
+	}
+
+	return response, nil
+}
+
+func newInsertDocument(metadata NDBDocumentMetadata) (*ndb.DocumentBuilder, error) {
+	if !strings.HasSuffix(metadata.Filename, ".csv") {
+		return nil, CodedErrorf(http.StatusUnprocessableEntity, "only CSV files are supported for insertion")
 	}
 
-	return NDBSearchResponse{Query: searchParams.Query, References: references}, nil
+	var docId string
+	if metadata.SourceId != nil {
+		docId = *metadata.SourceId
+	} else {
+		docId = uuid.NewString()
+	}
+
+	doc, err := ndb.NewDocumentBuilder(metadata.Filename, docId)
+	if err != nil {
+		return nil, CodedErrorf(http.StatusInternalServerError, "ndb insert error %w", err)
+	}
+	return doc, nil
 }
 
-func getMetadataAndContent(r *http.Request) ([]byte, NDBDocumentMetadata, error) {
+func parseIntoDocument(doc *ndb.DocumentBuilder, content io.Reader, metadata NDBDocumentMetadata, capture *insertCapture) error {
+	_, err := ParseContentStreamWithEmbeddings(content, metadata.TextColumns, metadata.MetadataTypes, metadata.EmbeddingColumn, insertParseBatchSize, func(chunks []string, chunkMetadata []map[string]any, embeddings [][]float32) error {
+		if err := doc.AddChunks(chunks, chunkMetadata); err != nil {
+			return CodedErrorf(http.StatusInternalServerError, "ndb insert error %w", err)
+		}
+		if err := doc.AddEmbeddings(embeddings); err != nil {
+			return CodedErrorf(http.StatusUnprocessableEntity, "invalid embeddings: %w", err)
+		}
+		capture.add(chunks, chunkMetadata, embeddings)
+		return nil
+	})
+	return err
+}
+
+// getInsertDocument reads the multipart insert request and builds the document
+// to insert. If the metadata part precedes the file part then the file is parsed
+// and passed to the document as it is read from the request, otherwise the file
+// must be buffered until the metadata is read.
+// If capture is not nil the parsed chunks are also added to it.
+func getInsertDocument(r *http.Request, logger *slog.Logger, capture *insertCapture) (doc *ndb.DocumentBuilder, metadata NDBDocumentMetadata, err error) {
 	boundary, err := getMultipartBoundary(r)
 	if err != nil {
 		return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error getting multipart boundary: %w", err)
 	}
 
+	defer func() {
+		if err != nil && doc != nil {
+			doc.Free()
+			doc = nil
+		}
+	}()
+
 	reader := multipart.NewReader(r.Body, boundary)
 
 	var contents []byte
-	var metadata NDBDocumentMetadata
-	foundMetadata := false
+	foundContents, foundFile := false, false
 
 	for {
 		part, err := reader.NextPart()
@@ -205,37 +595,69 @@ func getMetadataAndContent(r *http.Request) ([]byte, NDBDocumentMetadata, error)
 			break
 		}
 		if err != nil {
-			return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error parsing multipart request: %w", err)
+			return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error parsing multipart request: %w", err)
 		}
 		defer part.Close()
 
 		if part.FormName() == "file" {
+			if foundFile {
+				return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "file part specified multiple times")
+			}
+			foundFile = true
+
+			if doc != nil {
+				content := &sizeLimitedReader{r: part, limit: maxStreamingInsertFileSize}
+				if err := parseIntoDocument(doc, content, metadata, capture); err != nil {
+					if content.n == 0 {
+						return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "no file content provided")
+					}
+					return doc, NDBDocumentMetadata{}, err
+				}
+				foundContents = true
+				continue
+			}
+
 			data, err := io.ReadAll(io.LimitReader(part, maxInsertFileSize+1)) // +1 to ensure we catch overflows
 			if err != nil {
-				return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error reading file: %w", err)
+				return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error reading file: %w", err)
 			}
 
 			if len(data) > maxInsertFileSize {
-				return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusUnprocessableEntity, "file size exceeds maximum limit of %d bytes, please chunk file", maxInsertFileSize)
+				return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusUnprocessableEntity, "file size exceeds maximum limit of %d bytes, please chunk file or send metadata before the file to stream it", maxInsertFileSize)
 			}
 
 			contents = data
+			foundContents = len(data) > 0
 		} else if part.FormName() == "metadata" {
+			if doc != nil {
+				return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "metadata part specified multiple times")
+			}
 			if err := json.NewDecoder(part).Decode(&metadata); err != nil {
-				return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error parsing metadata: %w", err)
+				return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "error parsing metadata: %w", err)
+			}
+
+			logger.Info("insert: received", "filename", metadata.Filename, "source_id", metadata.SourceId, "text_columns", metadata.TextColumns, "metadata_dtypes", metadata.MetadataTypes, "upsert", metadata.Upsert, "embedding_column", metadata.EmbeddingColumn, "streaming", contents == nil)
+
+			if doc, err = newInsertDocument(metadata); err != nil {
+				return doc, NDBDocumentMetadata{}, err
 			}
-			foundMetadata = true
 		}
 	}
 
-	if len(contents) == 0 {
-		return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "no file content provided")
+	if !foundContents {
+		return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "no file content provided")
+	}
+	if doc == nil {
+		return doc, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "no metadata provided")
 	}
-	if !foundMetadata {
-		return nil, NDBDocumentMetadata{}, CodedErrorf(http.StatusBadRequest, "no metadata provided")
+
+	if contents != nil {
+		if err := parseIntoDocument(doc, bytes.NewReader(contents), metadata, capture); err != nil {
+			return doc, NDBDocumentMetadata{}, err
+		}
 	}
 
-	return contents, metadata, nil
+	return doc, metadata, nil
 }
 
 func (s *Server) Insert(r *http.Request) (any, error) {
@@ -245,52 +667,66 @@ func (s *Server) Insert(r *http.Request) (any, error) {
 		return nil, CodedErrorf(http.StatusForbidden, "only leader can insert documents")
 	}
 
-	content, metadata, err := getMetadataAndContent(r)
+	var capture *insertCapture
+	if s.opLog != nil {
+		capture = s.opLog.newInsertCapture()
+		defer capture.discard()
+	}
+
+	doc, metadata, err := getInsertDocument(r, logger, capture)
 	if err != nil {
-		logger.Error("error getting metadata and content", "error", err)
+		logger.Error("insert: error parsing document", "error", err)
 		return nil, err
 	}
+	defer doc.Free()
 
-	if !strings.HasSuffix(metadata.Filename, ".csv") {
-		return nil, CodedErrorf(http.StatusUnprocessableEntity, "only CSV files are supported for insertion")
-	}
+	logger.Info("insert: parsed document", "n_chunks", doc.NChunks())
 
-	logger.Info("insert: received", "filename", metadata.Filename, "source_id", metadata.SourceId, "text_columns", metadata.TextColumns, "metadata_dtypes", metadata.MetadataTypes, "upsert", metadata.Upsert)
+	s.lockWrites(lockOpInsert)
+	defer s.writeLock.Unlock()
 
-	chunks, chunkMetadata, err := ParseContent(content, metadata.TextColumns, metadata.MetadataTypes)
-	if err != nil {
-		logger.Error("insert: error parsing document content", "error", err)
+	s.rlock(lockOpInsert)
+	// Inserts are serialized by the write lock, so the dimension of the index
+	// cannot change before the insert.
+	if err := s.checkEmbeddingDim(doc.EmbeddingDim()); err != nil {
+		s.lock.RUnlock()
+		logger.Error("insert: error", "error", err, "source_id", doc.DocId())
 		return nil, err
 	}
-
-	logger.Info("insert: parsed document", "n_chunks", len(chunks))
-
-	var docId string
-	if metadata.SourceId != nil {
-		docId = *metadata.SourceId
-	} else {
-		docId = uuid.NewString()
+	info, err := s.ndb.InsertDocument(doc)
+	s.lock.RUnlock()
+	if err != nil {
+		logger.Error("insert: error", "error", err, "source_id", doc.DocId())
+		return nil, CodedErrorf(http.StatusInternalServerError, "ndb insert error %w", err)
 	}
 
-	s.lock.Lock()
-	defer s.lock.Unlock()
+	// The document is inserted, so the changes must be checkpointed even if the
+	// upsert delete fails.
+	s.dirty = true
 
-	if err := s.ndb.Insert(metadata.Filename, docId, chunks, chunkMetadata, nil); err != nil {
-		logger.Error("insert: error", "error", err, "source_id", docId)
-		return nil, CodedErrorf(http.StatusInternalServerError, "ndb insert error %w", err)
+	if capture != nil {
+		if file, fileBytes, err := capture.finish(); err != nil {
+			logger.Warn("insert: document could not be added to the op log, followers will need to wait for the next checkpoint", "source_id", doc.DocId(), "error", err)
+			s.opLog.appendGap()
+		} else {
+			s.opLog.append(Op{Type: OpInsert, DocId: doc.DocId(), Document: metadata.Filename, MetadataTypes: metadata.MetadataTypes, ChunkIds: &ChunkIdRange{Start: info.StartId, End: info.EndId}, file: file, fileBytes: fileBytes})
+		}
 	}
 
 	if metadata.Upsert && metadata.SourceId != nil {
-		if err := s.ndb.Delete(docId, true); err != nil {
-			logger.Error("insert: error during upsert delete", "error", err, "source_id", docId)
+		s.wlock(lockOpUpsertDelete)
+		_, nVersions, err := s.ndb.DeleteBatch([]string{*metadata.SourceId}, true)
+		s.lock.Unlock()
+		if err != nil {
+			logger.Error("insert: error during upsert delete", "error", err, "source_id", *metadata.SourceId)
 			return nil, CodedErrorf(http.StatusInternalServerError, "ndb upsert delete error %w", err)
 		}
-		logger.Info("insert: upsert delete complete", "source_id", docId)
+		s.recordOp(Op{Type: OpDelete, DocId: *metadata.SourceId, KeepLatestVersion: true})
+		s.prune.deletedVersions += nVersions
+		logger.Info("insert: upsert delete complete", "source_id", *metadata.SourceId)
 	}
 
-	s.dirty = true
-
-	logger.Info("insert: complete", "source_id", docId)
+	logger.Info("insert: complete", "source_id", doc.DocId())
 
 	return nil, nil
 }
@@ -309,18 +745,31 @@ func (s *Server) Delete(r *http.Request) (any, error) {
 
 	logger.Info("delete: received", "ids", deleteParams.SourceIds, "keep_latest_version", deleteParams.KeepLatestVersion)
 
-	s.lock.Lock()
-	defer s.lock.Unlock()
+	s.lockWrites(lockOpDelete)
+	defer s.writeLock.Unlock()
+
+	ids := deleteParams.SourceIds
+	for start := 0; start < len(ids); start += maxDeleteBatchSize {
+		batch := ids[start:min(start+maxDeleteBatchSize, len(ids))]
+
+		// Searches cannot run while documents are deleted, the lock is released
+		// between batches so that they are not blocked for the entire request.
+		s.wlock(lockOpDelete)
+		n, nVersions, err := s.ndb.DeleteBatch(batch, deleteParams.KeepLatestVersion)
+		s.lock.Unlock()
 
-	for _, id := range deleteParams.SourceIds {
-		if err := s.ndb.Delete(id, deleteParams.KeepLatestVersion); err != nil {
-			logger.Error("delete: error", "error", err, "id", id)
+		for _, id := range batch[:n] {
+			s.dirty = true
+			s.recordOp(Op{Type: OpDelete, DocId: id, KeepLatestVersion: deleteParams.KeepLatestVersion})
+		}
+		s.prune.deletedVersions += nVersions
+
+		if err != nil {
+			logger.Error("delete: error", "error", err, "n_deleted", start+n)
 			return nil, CodedErrorf(http.StatusInternalServerError, "ndb delete error %w", err)
 		}
 	}
 
-	s.dirty = true
-
 	logger.Info("delete: complete", "ids", deleteParams.SourceIds)
 
 	return nil, nil
@@ -340,9 +789,6 @@ func (s *Server) Upvote(r *http.Request) (any, error) {
 
 	logger.Info("upvote: received", "n_queries", len(upvoteParams.QueryIdPairs))
 
-	s.lock.Lock()
-	defer s.lock.Unlock()
-
 	queries := make([]string, len(upvoteParams.QueryIdPairs))
 	labels := make([]uint64, len(upvoteParams.QueryIdPairs))
 	for i, pair := range upvoteParams.QueryIdPairs {
@@ -350,28 +796,35 @@ func (s *Server) Upvote(r *http.Request) (any, error) {
 		labels[i] = pair.ReferenceId
 	}
 
-	if err := s.ndb.Finetune(queries, labels); err != nil {
+	if err := s.upvotes.submit(queries, labels); err != nil {
 		logger.Error("upvote: error", "error", err)
 		return nil, CodedErrorf(http.StatusInternalServerError, "ndb upvote error %w", err)
 	}
 
-	s.dirty = true
-
 	logger.Info("upvote: complete")
 
 	return nil, nil
 }
 
-func (s *Server) Sources(r *http.Request) (any, error) {
-	s.lock.RLock()
-	defer s.lock.RUnlock()
+// applyUpvotes finetunes the ndb with a batch of upvotes from the upvote queue.
+func (s *Server) applyUpvotes(queries []string, labels []uint64) error {
+	s.lockWrites(lockOpUpvote)
+	defer s.writeLock.Unlock()
 
-	sources, err := s.ndb.Sources()
+	s.rlock(lockOpUpvote)
+	err := s.ndb.Finetune(queries, labels)
+	s.lock.RUnlock()
 	if err != nil {
-		slog.Error("sources: error", "request_id", r.Context().Value(middleware.RequestIDKey), "action", "sources", "error", err)
-		return nil, CodedErrorf(http.StatusInternalServerError, "ndb list sources error %w", err)
+		return err
 	}
+	s.recordOp(Op{Type: OpUpvote, Queries: queries, Labels: labels})
 
+	s.dirty = true
+
+	return nil
+}
+
+func toNDBSources(sources []ndb.Source) []NDBSource {
 	response := make([]NDBSource, len(sources))
 	for i, src := range sources {
 		response[i] = NDBSource{
@@ -380,10 +833,107 @@ func (s *Server) Sources(r *http.Request) (any, error) {
 			Version:  src.DocVersion,
 		}
 	}
+	return response
+}
+
+func (s *Server) Sources(r *http.Request) (any, error) {
+	prefix := r.URL.Query().Get("prefix")
+
+	s.lock.RLock()
+	var sources []ndb.Source
+	var err error
+	if prefix == "" {
+		sources, err = s.ndb.Sources()
+	} else {
+		sources, err = s.ndb.SourcesPage(nil, prefix, math.MaxInt)
+	}
+	s.lock.RUnlock()
+
+	if err != nil {
+		slog.Error("sources: error", "request_id", r.Context().Value(middleware.RequestIDKey), "action", "sources", "error", err)
+		return nil, CodedErrorf(http.StatusInternalServerError, "ndb list sources error %w", err)
+	}
+
+	return toNDBSources(sources), nil
+}
+
+// The cursor for a page of sources is the version and doc id of the last source
+// in the previous page.
+func encodeSourcesCursor(source ndb.Source) string {
+	return base64.RawURLEncoding.EncodeToString(fmt.Appendf(nil, "%d:%s", source.DocVersion, source.DocId))
+}
+
+func decodeSourcesCursor(cursor string) (*ndb.SourcesCursor, error) {
+	data, err := base64.RawURLEncoding.DecodeString(cursor)
+	if err != nil {
+		return nil, err
+	}
+
+	version, docId, ok := strings.Cut(string(data), ":")
+	if !ok {
+		return nil, fmt.Errorf("missing separator")
+	}
+
+	docVersion, err := strconv.ParseUint(version, 10, 32)
+	if err != nil {
+		return nil, err
+	}
+
+	return &ndb.SourcesCursor{DocId: docId, DocVersion: uint32(docVersion)}, nil
+}
+
+func (s *Server) SourcesPage(r *http.Request) (any, error) {
+	params := r.URL.Query()
+
+	var after *ndb.SourcesCursor
+	if cursor := params.Get("cursor"); cursor != "" {
+		var err error
+		if after, err = decodeSourcesCursor(cursor); err != nil {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "invalid value for 'cursor': %v", err)
+		}
+	}
+
+	limit := defaultSourcesPageSize
+	if limitParam := params.Get("limit"); limitParam != "" {
+		var err error
+		if limit, err = strconv.Atoi(limitParam); err != nil {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "invalid value for 'limit': %v", err)
+		}
+		if limit <= 0 || limit > maxSourcesPageSize {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "'limit' must be between 1 and %d", maxSourcesPageSize)
+		}
+	}
+
+	s.lock.RLock()
+	sources, err := s.ndb.SourcesPage(after, params.Get("prefix"), limit)
+	s.lock.RUnlock()
+
+	if err != nil {
+		slog.Error("sources: error", "request_id", r.Context().Value(middleware.RequestIDKey), "action", "sources_page", "error", err)
+		return nil, CodedErrorf(http.StatusInternalServerError, "ndb list sources error %w", err)
+	}
+
+	response := NDBSourcesPageResponse{Sources: toNDBSources(sources)}
+	if len(sources) == limit {
+		response.NextCursor = encodeSourcesCursor(sources[len(sources)-1])
+	}
 
 	return response, nil
 }
 
+func (s *Server) SourcesCount(r *http.Request) (any, error) {
+	s.lock.RLock()
+	count, err := s.ndb.SourcesCount(r.URL.Query().Get("prefix"))
+	s.lock.RUnlock()
+
+	if err != nil {
+		slog.Error("sources: error", "request_id", r.Context().Value(middleware.RequestIDKey), "action", "sources_count", "error", err)
+		return nil, CodedErrorf(http.StatusInternalServerError, "ndb count sources error %w", err)
+	}
+
+	return NDBSourcesCountResponse{Count: count}, nil
+}
+
 func (s *Server) Version(r *http.Request) (any, error) {
 	currVersion := s.getVersion()
 
@@ -402,6 +952,37 @@ func (s *Server) Version(r *http.Request) (any, error) {
 	return res, nil
 }
 
+func (s *Server) Stats(r *http.Request) (any, error) {
+	s.lock.RLock()
+	defer s.lock.RUnlock()
+
+	cache := s.ndb.QueryCacheStats()
+	upvotes := s.upvotes.stats()
+	embeddings := s.ndb.DenseIndexStats()
+
+	return NDBStatsResponse{
+		QueryCache: NDBQueryCacheStats{
+			Hits:      cache.Hits,
+			Misses:    cache.Misses,
+			Evictions: cache.Evictions,
+			Entries:   cache.Entries,
+			Bytes:     cache.Bytes,
+			Capacity:  cache.Capacity,
+		},
+		Upvotes: NDBUpvoteStats{
+			PendingQueries: upvotes.pendingQueries,
+			Requests:       upvotes.requests,
+			Batches:        upvotes.batches,
+		},
+		Embeddings: NDBEmbeddingStats{
+			Chunks:   embeddings.Chunks,
+			Bytes:    embeddings.Bytes,
+			MaxBytes: embeddings.MaxBytes,
+			Dim:      embeddings.Dim,
+		},
+	}, nil
+}
+
 func (s *Server) Checkpoint(r *http.Request) (any, error) {
 	if !s.leader {
 		return nil, CodedErrorf(http.StatusForbidden, "only leader can create checkpoints")
@@ -422,78 +1003,69 @@ func (s *Server) Checkpoint(r *http.Request) (any, error) {
 	return res, nil
 }
 
+// PushCheckpoint saves a snapshot of the ndb and uploads it as a new checkpoint
+// version. The snapshot is saved with writeLock held so that it is consistent,
+// searches can continue while it is saved. The snapshot is a RocksDB checkpoint,
+// so saving it mostly consists of hard linking the SST files of the live db, and
+// the upload is done without holding the lock. The live db is not changed by the
+// checkpoint, the snapshot is deleted once it is uploaded.
 func (s *Server) PushCheckpoint(logger *slog.Logger, async bool) (NDBCheckpointResponse, error) {
-	s.lock.Lock()
-	defer s.lock.Unlock()
-
 	if !s.leader {
 		return NDBCheckpointResponse{}, CodedErrorf(http.StatusForbidden, "only leader can create checkpoints")
 	}
 
-	currVersion := s.getVersion()
-
-	if !s.dirty {
-		logger.Info("checkpointer: no changes to checkpoint, skipping")
-		return NDBCheckpointResponse{Version: int(currVersion), NewCheckpoint: false}, nil
-	}
-
-	if s.checkpointer == nil {
-		logger.Error("checkpointer: no checkpointer initialized, cannot push checkpoint")
-		return NDBCheckpointResponse{}, CodedErrorf(http.StatusInternalServerError, "checkpointer must be initialized to push checkpoints")
+	if async {
+		if !s.checkpointLock.TryLock() {
+			return NDBCheckpointResponse{}, CodedErrorf(http.StatusConflict, "a checkpoint is already in progress")
+		}
+	} else {
+		s.checkpointLock.Lock()
 	}
 
+	currVersion := s.getVersion()
 	newVersion := currVersion + 1
-	logger.Info("checkpointer: creating new checkpoint", "version", newVersion)
-
-	s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: false, err: nil})
+	newVersionPath := localVersionPath(s.localCheckpointDir, newVersion)
 
-	result := NDBCheckpointResponse{Version: int(newVersion), NewCheckpoint: true}
-
-	run := func() (NDBCheckpointResponse, error) {
-		newVersionPath := localVersionPath(s.localCheckpointDir, newVersion)
-
-		if err := s.ndb.Save(newVersionPath); err != nil {
-			logger.Error("checkpointer: failed to save ndb state", "old_version", currVersion, "new_version", newVersion, "error", err)
-			err := fmt.Errorf("failed to save ndb state: %w", err)
-			s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
-			return NDBCheckpointResponse{}, err
-		}
+	sources, opState, result, err := s.saveSnapshot(logger, currVersion, newVersion, newVersionPath)
+	if err != nil || !result.NewCheckpoint {
+		s.checkpointLock.Unlock()
+		return result, err
+	}
 
-		newNdb, err := ndb.New(newVersionPath)
-		if err != nil {
-			logger.Error("checkpointer: failed to load ndb from new checkpoint", "old_version", currVersion, "new_version", newVersion, "error", err)
-			err := fmt.Errorf("failed to load ndb from new checkpoint (version=%v): %w", newVersion, err)
-			s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
-			return NDBCheckpointResponse{}, err
-		}
+	upload := func() (NDBCheckpointResponse, error) {
+		defer s.checkpointLock.Unlock()
+		defer sources.Free()
 
-		sources, err := s.ndb.Sources()
-		if err != nil {
-			logger.Error("checkpointer: failed to get ndb sources", "old_version", currVersion, "new_version", newVersion, "error", err)
-			err := fmt.Errorf("failed to get ndb sources: %w", err)
-			s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
-			return NDBCheckpointResponse{}, err
-		}
-
-		logger.Info("checkpointer: successfully saved ndb state", "old_version", currVersion, "new_version", newVersion, "path", localVersionPath)
+		defer func() {
+			if err := os.RemoveAll(newVersionPath); err != nil {
+				logger.Error("checkpointer: failed to remove checkpoint snapshot", "version", newVersion, "error", err)
+			}
+		}()
 
 		if err := s.checkpointer.Upload(logger, newVersion, newVersionPath, sources); err != nil {
 			logger.Error("checkpointer: failed to upload checkpoint", "old_version", currVersion, "new_version", newVersion, "error", err)
 			err := fmt.Errorf("failed to upload checkpoint (version=%v): %w", newVersion, err)
+
+			s.lockWrites(lockOpCheckpoint)
+			s.dirty = true // The changes in the snapshot still need to be checkpointed
+			s.writeLock.Unlock()
+
 			s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
 			return NDBCheckpointResponse{}, err
 		}
 
 		logger.Info("checkpointer: successfully uploaded checkpoint", "version", newVersion)
 
-		s.ndb = newNdb
+		s.lock.Lock()
 		if !s.setVersion(currVersion, newVersion) {
 			panic(fmt.Sprintf("failed to update version from %d to %d", currVersion, newVersion))
 		}
-		s.dirty = false
+		s.lock.Unlock()
 
-		if err := os.RemoveAll(localVersionPath(s.localCheckpointDir, currVersion)); err != nil {
-			logger.Error("checkpointer: failed to remove old checkpoint files", "version", currVersion, "error", err)
+		// Followers that are behind the checkpoint can load it instead of replaying
+		// the ops it contains.
+		if s.opLog != nil {
+			s.opLog.truncate(opState.Seq)
 		}
 
 		s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: nil})
@@ -501,12 +1073,81 @@ func (s *Server) PushCheckpoint(logger *slog.Logger, async bool) (NDBCheckpointR
 	}
 
 	if async {
-		go run()
+		go upload()
 		return result, nil
 	} else {
-		return run()
+		return upload()
+	}
+}
+
+// saveSnapshot must be called with s.checkpointLock held.
+func (s *Server) saveSnapshot(logger *slog.Logger, currVersion, newVersion Version, newVersionPath string) (*ndb.SourceList, OpLogState, NDBCheckpointResponse, error) {
+	s.lockWrites(lockOpCheckpoint)
+	defer s.writeLock.Unlock()
+
+	s.lock.RLock()
+	defer s.lock.RUnlock()
+
+	if !s.dirty {
+		logger.Info("checkpointer: no changes to checkpoint, skipping")
+		return nil, OpLogState{}, NDBCheckpointResponse{Version: int(currVersion), NewCheckpoint: false}, nil
+	}
+
+	if s.checkpointer == nil {
+		logger.Error("checkpointer: no checkpointer initialized, cannot push checkpoint")
+		return nil, OpLogState{}, NDBCheckpointResponse{}, CodedErrorf(http.StatusInternalServerError, "checkpointer must be initialized to push checkpoints")
+	}
+
+	logger.Info("checkpointer: creating new checkpoint", "version", newVersion)
+
+	s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: false, err: nil})
+
+	// Remove any files left by a previous failed attempt at this version.
+	if err := os.RemoveAll(newVersionPath); err != nil {
+		logger.Error("checkpointer: failed to clear checkpoint snapshot path", "version", newVersion, "error", err)
 	}
 
+	if err := s.ndb.Save(newVersionPath); err != nil {
+		logger.Error("checkpointer: failed to save ndb state", "old_version", currVersion, "new_version", newVersion, "error", err)
+		err := fmt.Errorf("failed to save ndb state: %w", err)
+		s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
+		return nil, OpLogState{}, NDBCheckpointResponse{}, err
+	}
+
+	// The list of sources is shared with the ndb, so it is not copied for the
+	// checkpoint metadata.
+	sources, err := s.ndb.SourceList()
+	if err != nil {
+		logger.Error("checkpointer: failed to get ndb sources", "old_version", currVersion, "new_version", newVersion, "error", err)
+		err := fmt.Errorf("failed to get ndb sources: %w", err)
+		s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
+		return nil, OpLogState{}, NDBCheckpointResponse{}, err
+	}
+
+	// The op log is only modified by writers, so this is the state of the snapshot.
+	var opState OpLogState
+	if s.opLog != nil {
+		opState = s.opLog.state()
+		if err := saveOpLogState(newVersionPath, opState); err != nil {
+			logger.Error("checkpointer: failed to save op log state", "new_version", newVersion, "error", err)
+			sources.Free()
+			s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
+			return nil, OpLogState{}, NDBCheckpointResponse{}, err
+		}
+	}
+
+	if err := savePruneState(newVersionPath, s.prune.deletedVersions); err != nil {
+		logger.Error("checkpointer: failed to save prune state", "new_version", newVersion, "error", err)
+		sources.Free()
+		s.checkpointTask.Store(&checkpointTaskInfo{version: newVersion, complete: true, err: err})
+		return nil, OpLogState{}, NDBCheckpointResponse{}, err
+	}
+
+	s.dirty = false
+
+	logger.Info("checkpointer: successfully saved ndb state", "old_version", currVersion, "new_version", newVersion, "path", newVersionPath)
+
+	return sources, opState, NDBCheckpointResponse{Version: int(newVersion), NewCheckpoint: true}, nil
 }
 
 func (s *Server) PushCheckpoints(interval time.Duration) {
@@ -536,6 +1177,14 @@ func (s *Server) PushCheckpoints(interval time.Duration) {
 }
 
 func (s *Server) PullLatestCheckpoint(logger *slog.Logger) error {
+	return s.pullLatestCheckpoint(logger, false)
+}
+
+// pullLatestCheckpoint loads the latest checkpoint if it is newer than the current
+// version. If force is true the latest checkpoint is loaded even if it is the
+// current version, this is used to discard ops that were replayed from the op log
+// of a leader that has since restarted.
+func (s *Server) pullLatestCheckpoint(logger *slog.Logger, force bool) error {
 	if s.checkpointer == nil {
 		logger.Error("checkpointer: no checkpointer initialized, cannot pull latest checkpoint")
 		return CodedErrorf(http.StatusInternalServerError, "checkpointer must be initialized to pull checkpoints")
@@ -546,6 +1195,9 @@ func (s *Server) PullLatestCheckpoint(logger *slog.Logger) error {
 		return CodedErrorf(http.StatusForbidden, "PullLatestCheckpoint should not be called on leader")
 	}
 
+	s.pullLock.Lock()
+	defer s.pullLock.Unlock()
+
 	checkpoints, err := s.checkpointer.List(logger)
 	if err != nil {
 		logger.Error("checkpointer: error listing checkpoints", "error", err)
@@ -555,12 +1207,22 @@ func (s *Server) PullLatestCheckpoint(logger *slog.Logger) error {
 	currVersion := s.getVersion()
 
 	latest := latestVersion(checkpoints)
-	if latest <= currVersion {
+	if latest == 0 || latest < currVersion || (latest == currVersion && !force) {
 		logger.Info("checkpointer: no new checkpoints found", "current_version", currVersion, "latest_version", latest)
 		return nil
 	}
 
+	s.lock.RLock()
+	oldPath := s.ndbPath
+	s.lock.RUnlock()
+
 	localPath := localVersionPath(s.localCheckpointDir, latest)
+	if localPath == oldPath {
+		// The current version is being reloaded, so it cannot be downloaded to the
+		// same location as the live ndb.
+		localPath += "_" + uuid.NewString()
+	}
+
 	if err := s.checkpointer.Download(logger, latest, localPath); err != nil {
 		logger.Error("checkpointer: failed to download checkpoint", "version", latest, "error", err)
 		return fmt.Errorf("failed to download checkpoint (version=%v): %w", latest, err)
@@ -568,33 +1230,69 @@ func (s *Server) PullLatestCheckpoint(logger *slog.Logger) error {
 
 	logger.Info("checkpointer: successfully downloaded new checkpoint", "version", latest)
 
-	newNdb, err := ndb.New(localPath)
+	opState, err := loadOpLogState(localPath)
+	if err != nil {
+		logger.Error("checkpointer: failed to load op log state of checkpoint", "version", latest, "error", err)
+		return fmt.Errorf("failed to load op log state of checkpoint (version=%v): %w", latest, err)
+	}
+
+	newNdb, err := ndb.NewWithOptions(localPath, s.ndbOptions)
 	if err != nil {
 		logger.Error("checkpointer: failed to load checkpoint into ndb", "version", latest, "error", err)
 		return fmt.Errorf("failed to load checkpoint into ndb (version=%v): %w", latest, err)
 	}
 
+	s.warmup(logger, newNdb, latest)
+
+	s.lockWrites(lockOpLoadCheckpoint)
 	s.lock.Lock()
 
 	if s.setVersion(currVersion, latest) {
 		logger.Info("checkpointer: updated version", "old_version", currVersion, "new_version", latest)
+		oldNdb := s.ndb
 		s.ndb = newNdb
+		s.ndbPath = localPath
+		s.opState = opState
+		s.opsSinceLoad = false
 		s.dirty = false // doesn't really matter since this should only be called on follower
 
+		// Searches hold the read lock while using the ndb, so nothing can reference the old ndb.
+		oldNdb.Free()
+
 		s.lock.Unlock()
+		s.writeLock.Unlock()
 
-		if err := os.RemoveAll(localVersionPath(s.localCheckpointDir, currVersion)); err != nil {
+		if err := os.RemoveAll(oldPath); err != nil {
 			logger.Error("checkpointer: failed to remove old checkpoint files", "version", currVersion, "error", err)
 		}
-		logger.Info("checkpointer: successfully loaded new checkpoint into ndb", "version", latest)
+		logger.Info("checkpointer: successfully loaded new checkpoint into ndb", "version", latest, "op_log_epoch", opState.Epoch, "op_log_seq", opState.Seq)
 	} else {
 		s.lock.Unlock()
+		s.writeLock.Unlock()
+		newNdb.Free()
 		logger.Info("checkpointer: version update skipped due to version conflict", "old_version", currVersion, "new_version", latest, "current_version", s.getVersion())
 	}
 
 	return nil
 }
 
+// warmup replays the recent searches on a checkpoint that has not yet replaced
+// the live ndb, so no locks are needed to use it.
+func (s *Server) warmup(logger *slog.Logger, newNdb ndb.NeuralDB, version Version) {
+	if s.recentQueries == nil {
+		return
+	}
+
+	queries := s.recentQueries.recent()
+	start := time.Now()
+	nQueries, err := newNdb.Warmup(queries, s.warmupBudget)
+	if err != nil {
+		logger.Error("checkpointer: failed to warm up new checkpoint", "version", version, "error", err)
+		return
+	}
+	logger.Info("checkpointer: warmed up new checkpoint", "version", version, "n_queries", nQueries, "n_recent_queries", len(queries), "duration", time.Since(start).String())
+}
+
 func (s *Server) PullCheckpoints(interval time.Duration) {
 	if s.leader {
 		log.Fatal("PullCheckpoints should not be called on leader")
@@ -613,3 +1311,240 @@ func (s *Server) PullCheckpoints(interval time.Duration) {
 		}
 	}
 }
+
+func (s *Server) recordOp(op Op) {
+	if s.opLog != nil {
+		s.opLog.append(op)
+	}
+}
+
+func (s *Server) OpLog(r *http.Request) (any, error) {
+	if !s.leader || s.opLog == nil {
+		return nil, CodedErrorf(http.StatusForbidden, "only leader has an op log")
+	}
+
+	state := OpLogState{Epoch: r.URL.Query().Get("epoch")}
+	if after := r.URL.Query().Get("after"); after != "" {
+		seq, err := strconv.ParseUint(after, 10, 64)
+		if err != nil {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "invalid value for 'after': %v", err)
+		}
+		state.Seq = seq
+	}
+
+	ops, next, err := s.opLog.since(state)
+	if err != nil {
+		return nil, CodedErrorf(http.StatusGone, "%v", err)
+	}
+
+	return NDBOpLogResponse{Epoch: next.Epoch, Seq: next.Seq, Ops: ops}, nil
+}
+
+var opLogClient = &http.Client{Timeout: time.Minute}
+
+func (s *Server) fetchOps(leaderUrl string, state OpLogState) (NDBOpLogResponse, int, error) {
+	query := url.Values{}
+	query.Set("epoch", state.Epoch)
+	query.Set("after", strconv.FormatUint(state.Seq, 10))
+
+	res, err := opLogClient.Get(leaderUrl + "/api/v1/oplog?" + query.Encode())
+	if err != nil {
+		return NDBOpLogResponse{}, 0, fmt.Errorf("failed to request op log: %w", err)
+	}
+	defer res.Body.Close()
+
+	if res.StatusCode != http.StatusOK {
+		msg, _ := io.ReadAll(res.Body)
+		return NDBOpLogResponse{}, res.StatusCode, fmt.Errorf("op log request returned status %d: %s", res.StatusCode, strings.TrimSpace(string(msg)))
+	}
+
+	var ops NDBOpLogResponse
+	if err := json.NewDecoder(res.Body).Decode(&ops); err != nil {
+		return NDBOpLogResponse{}, res.StatusCode, fmt.Errorf("failed to parse op log response: %w", err)
+	}
+
+	return ops, res.StatusCode, nil
+}
+
+// applyOp must be called with s.writeLock held, the ndb lock is acquired in the
+// same way as for the corresponding endpoint on the leader.
+func (s *Server) applyOp(op Op) error {
+	switch op.Type {
+	case OpInsert:
+		return s.applyInsert(op)
+	case OpDelete:
+		s.lock.Lock()
+		defer s.lock.Unlock()
+		return s.ndb.Delete(op.DocId, op.KeepLatestVersion)
+	case OpUpvote:
+		s.lock.RLock()
+		defer s.lock.RUnlock()
+		return s.ndb.Finetune(op.Queries, op.Labels)
+	case OpPrune:
+		s.lock.Lock()
+		defer s.lock.Unlock()
+		return s.ndb.Prune()
+	default:
+		return fmt.Errorf("unknown op type '%s'", op.Type)
+	}
+}
+
+func (s *Server) applyInsert(op Op) error {
+	metadata, err := op.typedMetadata()
+	if err != nil {
+		return err
+	}
+
+	doc, err := ndb.NewDocumentBuilder(op.Document, op.DocId)
+	if err != nil {
+		return err
+	}
+	defer doc.Free()
+
+	if err := doc.AddChunks(op.Chunks, metadata); err != nil {
+		return err
+	}
+	if err := doc.AddEmbeddings(op.Embeddings); err != nil {
+		return err
+	}
+
+	s.lock.RLock()
+	info, err := s.ndb.InsertDocument(doc)
+	s.lock.RUnlock()
+	if err != nil {
+		return err
+	}
+
+	if op.ChunkIds != nil && (info.StartId != op.ChunkIds.Start || info.EndId != op.ChunkIds.End) {
+		return fmt.Errorf("insert of doc %s was assigned chunk ids %d-%d, but was assigned %d-%d on the leader", op.DocId, info.StartId, info.EndId, op.ChunkIds.Start, op.ChunkIds.End)
+	}
+
+	return nil
+}
+
+// applyOps returns true if the ops were applied, and false if the state of the
+// follower changed while the ops were being fetched or applied. writeLock is
+// acquired for each op rather than for the whole response, so that loading a
+// checkpoint, and searches waiting behind deletes, are not blocked for longer
+// than a single op.
+func (s *Server) applyOps(logger *slog.Logger, state OpLogState, ops NDBOpLogResponse) (bool, error) {
+	for _, op := range ops.Ops {
+		if op.Seq != state.Seq+1 {
+			return false, fmt.Errorf("expected op with seq %d, received seq %d", state.Seq+1, op.Seq)
+		}
+
+		next := OpLogState{Epoch: ops.Epoch, Seq: op.Seq}
+		if applied, err := s.applyNextOp(logger, state, next, op); !applied || err != nil {
+			return false, err
+		}
+		state = next
+	}
+
+	s.lockWrites(lockOpReplication)
+	defer s.writeLock.Unlock()
+
+	if s.opState != state {
+		return false, nil
+	}
+	s.opState = OpLogState{Epoch: ops.Epoch, Seq: ops.Seq}
+
+	return true, nil
+}
+
+// applyNextOp applies the op if the follower is still in the given state, and
+// updates it to the next state.
+func (s *Server) applyNextOp(logger *slog.Logger, state, next OpLogState, op Op) (bool, error) {
+	s.lockWrites(lockOpReplication)
+	defer s.writeLock.Unlock()
+
+	if s.opState != state {
+		return false, nil
+	}
+
+	if err := s.applyOp(op); err != nil {
+		logger.Error("replication: failed to apply op", "seq", op.Seq, "type", op.Type, "error", err)
+		// The ndb may not match the leader anymore, so the next pull should load
+		// the latest checkpoint.
+		s.opState = OpLogState{Epoch: "invalid"}
+		s.opsSinceLoad = true
+		return false, fmt.Errorf("failed to apply op %d: %w", op.Seq, err)
+	}
+
+	s.opState = next
+	s.opsSinceLoad = true
+
+	return true, nil
+}
+
+// PullOps replays the ops from the leader's op log that have not been applied
+// yet. If the ops are no longer available from the leader, then the latest
+// checkpoint is loaded instead.
+func (s *Server) PullOps(logger *slog.Logger, leaderUrl string) error {
+	if s.leader {
+		return CodedErrorf(http.StatusForbidden, "PullOps should not be called on leader")
+	}
+
+	if s.ndbOptions.ReadOnly {
+		return fmt.Errorf("cannot apply ops from the leader to a read only ndb")
+	}
+
+	nApplied := 0
+	for {
+		s.lockWrites(lockOpReplication)
+		state, opsSinceLoad := s.opState, s.opsSinceLoad
+		s.writeLock.Unlock()
+
+		ops, status, err := s.fetchOps(leaderUrl, state)
+		if status == http.StatusGone {
+			logger.Info("replication: ops unavailable from leader, loading latest checkpoint", "epoch", state.Epoch, "seq", state.Seq)
+			return s.pullLatestCheckpoint(logger, opsSinceLoad)
+		}
+		if err != nil {
+			logger.Error("replication: failed to fetch ops", "error", err)
+			return err
+		}
+
+		if len(ops.Ops) == 0 {
+			if ops.Epoch != state.Epoch {
+				// The follower is at the base state of the leader's epoch, this
+				// updates to the new epoch so that subsequent ops are compatible.
+				if _, err := s.applyOps(logger, state, ops); err != nil {
+					return err
+				}
+			}
+			if nApplied > 0 {
+				logger.Info("replication: applied ops", "n_ops", nApplied, "epoch", ops.Epoch, "seq", ops.Seq)
+			}
+			return nil
+		}
+
+		applied, err := s.applyOps(logger, state, ops)
+		if err != nil {
+			return err
+		}
+		if !applied {
+			logger.Info("replication: follower state changed while fetching ops, retrying")
+			continue
+		}
+		nApplied += len(ops.Ops)
+	}
+}
+
+func (s *Server) ReplicateFromLeader(leaderUrl string, interval time.Duration) {
+	if s.leader {
+		log.Fatal("ReplicateFromLeader should not be called on leader")
+	}
+
+	ticker := time.Tick(interval)
+
+	logger := slog.With("action", "replicate_from_leader")
+
+	for {
+		select {
+		case <-ticker:
+			if err := s.PullOps(logger, leaderUrl); err != nil {
+				logger.Error("replication: error pulling ops from leader", "error", err)
+			}
+		}
+	}
+}
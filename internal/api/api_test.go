@@ -5,11 +5,16 @@ import (
 	"context"
 	"encoding/json"
 	"fmt"
+	"io"
 	"log/slog"
 	"mime/multipart"
 	"ndb-server/internal/api"
+	"ndb-server/internal/ndb"
 	"net/http"
 	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"strings"
 	"testing"
 	"time"
 
@@ -41,12 +46,14 @@ func callBackendMethod(backend http.Handler, method string, path string, body []
 }
 
 func callSearch(backend http.Handler, query string, topk int, constraints map[string]api.Constraint) (api.NDBSearchResponse, error) {
-	request := api.NDBSearchParams{
+	return callSearchWithParams(backend, api.NDBSearchParams{
 		Query:       query,
 		TopK:        topk,
 		Constraints: constraints,
-	}
+	})
+}
 
+func callSearchWithParams(backend http.Handler, request api.NDBSearchParams) (api.NDBSearchResponse, error) {
 	body, err := json.Marshal(request)
 	if err != nil {
 		return api.NDBSearchResponse{}, err
@@ -60,10 +67,53 @@ func callSearch(backend http.Handler, query string, topk int, constraints map[st
 	return response, nil
 }
 
+func callSearchBatch(backend http.Handler, queries []api.NDBSearchParams) (api.NDBBatchSearchResponse, error) {
+	body, err := json.Marshal(api.NDBBatchSearchParams{Queries: queries})
+	if err != nil {
+		return api.NDBBatchSearchResponse{}, err
+	}
+
+	var response api.NDBBatchSearchResponse
+	if err := callBackendMethod(backend, http.MethodPost, "/api/v1/search/batch", body, &response); err != nil {
+		return api.NDBBatchSearchResponse{}, fmt.Errorf("failed to call batch search: %w", err)
+	}
+
+	return response, nil
+}
+
 func callInsert(backend http.Handler, data string, metdata api.NDBDocumentMetadata) error {
+	return callInsertWithOrder(backend, data, metdata, false)
+}
+
+// callInsertStreaming sends the metadata before the file, which allows the
+// server to parse the file as it is read.
+func callInsertStreaming(backend http.Handler, data string, metdata api.NDBDocumentMetadata) error {
+	return callInsertWithOrder(backend, data, metdata, true)
+}
+
+func callInsertWithOrder(backend http.Handler, data string, metdata api.NDBDocumentMetadata, metadataFirst bool) error {
 	body := new(bytes.Buffer)
 
 	writer := multipart.NewWriter(body)
+
+	writeMetadata := func() error {
+		metadataJSON, err := json.Marshal(metdata)
+		if err != nil {
+			return fmt.Errorf("failed to marshal metadata: %w", err)
+		}
+
+		if err := writer.WriteField("metadata", string(metadataJSON)); err != nil {
+			return fmt.Errorf("failed to write metadata to form: %w", err)
+		}
+		return nil
+	}
+
+	if metadataFirst {
+		if err := writeMetadata(); err != nil {
+			return err
+		}
+	}
+
 	part, err := writer.CreateFormFile("file", "file.csv")
 	if err != nil {
 		return fmt.Errorf("failed to create form file: %w", err)
@@ -72,13 +122,10 @@ func callInsert(backend http.Handler, data string, metdata api.NDBDocumentMetada
 		return fmt.Errorf("failed to write data to form file: %w", err)
 	}
 
-	metadataJSON, err := json.Marshal(metdata)
-	if err != nil {
-		return fmt.Errorf("failed to marshal metadata: %w", err)
-	}
-
-	if err := writer.WriteField("metadata", string(metadataJSON)); err != nil {
-		return fmt.Errorf("failed to write metadata to form: %w", err)
+	if !metadataFirst {
+		if err := writeMetadata(); err != nil {
+			return err
+		}
 	}
 
 	if err := writer.Close(); err != nil {
@@ -203,6 +250,42 @@ func TestLeaderOnly(t *testing.T) {
 		}))
 	})
 
+	t.Run("Insert Streaming", func(t *testing.T) {
+		// Uses its own server, so that the state of the other subtests is not
+		// changed.
+		streaming, err := api.NewServer(nil, true, t.TempDir())
+		require.NoError(t, err)
+		streamingRouter := streaming.Router()
+
+		require.NoError(t, callInsertStreaming(streamingRouter, doc1, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			SourceId:      &docId1,
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+		}))
+		require.NoError(t, callInsertStreaming(streamingRouter, doc2, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			SourceId:      nil,
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeString, "k2": api.MetadataTypeInt, "k3": api.MetadataTypeString},
+		}))
+
+		// The streamed chunks are the same as the buffered ones. doc2 has a
+		// random source id, so only the chunks are compared.
+		for _, query := range []string{"a b c d e", "z e"} {
+			expected, err := callSearch(router, query, 10, nil)
+			require.NoError(t, err)
+			actual, err := callSearch(streamingRouter, query, 10, nil)
+			require.NoError(t, err)
+			require.Equal(t, len(expected.References), len(actual.References))
+			for i := range expected.References {
+				assert.Equal(t, expected.References[i].Id, actual.References[i].Id)
+				assert.Equal(t, expected.References[i].Text, actual.References[i].Text)
+				assert.Equal(t, expected.References[i].Metadata, actual.References[i].Metadata)
+			}
+		}
+	})
+
 	t.Run("Search", func(t *testing.T) {
 		res1, err := callSearch(router, "a b c d e", 10, nil)
 		require.NoError(t, err)
@@ -255,6 +338,27 @@ func TestLeaderOnly(t *testing.T) {
 		checkResults(t, res4, []int{4})
 	})
 
+	t.Run("Batch Search", func(t *testing.T) {
+		res, err := callSearchBatch(router, []api.NDBSearchParams{
+			{Query: "a b c d e", TopK: 10},
+			{Query: "z e", TopK: 10},
+			{Query: "a b c d e", TopK: 10, Constraints: map[string]api.Constraint{
+				"k4": {ConstraintType: api.SubstringType, Value: "apple", Dtype: api.MetadataTypeString},
+			}},
+		})
+		require.NoError(t, err)
+		require.Len(t, res.Results, 3)
+
+		assert.Equal(t, "a b c d e", res.Results[0].Query)
+		checkResults(t, res.Results[0], []int{4, 3, 2, 1, 0})
+		assert.Equal(t, "z e", res.Results[1].Query)
+		checkResults(t, res.Results[1], []int{8, 4})
+		checkResults(t, res.Results[2], []int{4, 0})
+
+		_, err = callSearchBatch(router, []api.NDBSearchParams{{Query: "a b", TopK: 0}})
+		require.Error(t, err)
+	})
+
 	t.Run("Upvote", func(t *testing.T) {
 		res1, err := callSearch(router, "a b c d e h i j", 10, nil)
 		require.NoError(t, err)
@@ -441,3 +545,849 @@ func TestLeaderAndFollower(t *testing.T) {
 		}
 	})
 }
+
+func TestReadOnlyFollower(t *testing.T) {
+	ctx, cancel := context.WithCancel(context.Background())
+	t.Cleanup(cancel)
+
+	checkpointer, _ := createMinioS3Checkpointer(t, ctx)
+
+	options := ndb.DefaultOptions()
+	options.ReadOnly = true
+
+	_, err := api.NewServerWithOptions(checkpointer, true, t.TempDir(), options)
+	require.Error(t, err)
+
+	leader, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+	leaderRouter := leader.Router()
+
+	// The follower starts before there are any checkpoints.
+	follower, err := api.NewServerWithOptions(checkpointer, false, t.TempDir(), options)
+	require.NoError(t, err)
+	followerRouter := follower.Router()
+
+	res, err := callSearch(followerRouter, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{})
+
+	metadataTypes := []map[string]string{
+		{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+		{"k1": api.MetadataTypeString, "k2": api.MetadataTypeInt, "k3": api.MetadataTypeString},
+	}
+	for i, doc := range []string{doc1, doc2} {
+		require.NoError(t, callInsert(leaderRouter, doc, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			TextColumns:   []string{"text"},
+			MetadataTypes: metadataTypes[i],
+		}))
+
+		ckpt, err := leader.PushCheckpoint(slog.Default(), false)
+		require.NoError(t, err)
+		assert.Equal(t, i+1, ckpt.Version)
+
+		require.NoError(t, follower.PullLatestCheckpoint(slog.Default()))
+
+		ver, err := callVersion(followerRouter)
+		require.NoError(t, err)
+		assert.Equal(t, i+1, ver.CurrVersion)
+	}
+
+	res, err = callSearch(followerRouter, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{8, 4})
+
+	err = follower.PullOps(slog.Default(), "http://localhost:1")
+	require.Error(t, err)
+	assert.Contains(t, err.Error(), "read only")
+}
+
+func TestWarmupOnCheckpointLoad(t *testing.T) {
+	ctx, cancel := context.WithCancel(context.Background())
+	t.Cleanup(cancel)
+
+	checkpointer, _ := createMinioS3Checkpointer(t, ctx)
+
+	leader, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+	leaderRouter := leader.Router()
+
+	insertDoc := func(doc string) {
+		require.NoError(t, callInsert(leaderRouter, doc, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeString},
+		}))
+		_, err := leader.PushCheckpoint(slog.Default(), false)
+		require.NoError(t, err)
+	}
+
+	insertDoc(doc1)
+
+	follower, err := api.NewServer(checkpointer, false, t.TempDir())
+	require.NoError(t, err)
+	follower.EnableWarmup(10, time.Minute)
+	followerRouter := follower.Router()
+
+	res, err := callSearch(followerRouter, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{4})
+
+	insertDoc(doc2)
+	require.NoError(t, follower.PullLatestCheckpoint(slog.Default()))
+
+	var stats api.NDBStatsResponse
+	require.NoError(t, callBackendMethod(followerRouter, "GET", "/api/v1/stats", nil, &stats))
+	assert.Equal(t, uint64(1), stats.QueryCache.Entries)
+	assert.Equal(t, uint64(0), stats.QueryCache.Hits)
+
+	// The search was replayed on the new checkpoint before it was loaded, so the
+	// result is already cached, and includes the chunks of the new checkpoint.
+	res, err = callSearch(followerRouter, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{8, 4})
+
+	require.NoError(t, callBackendMethod(followerRouter, "GET", "/api/v1/stats", nil, &stats))
+	assert.Equal(t, uint64(1), stats.QueryCache.Hits)
+}
+
+func TestConcurrentUpvotes(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	const nRequests = 16
+	errs := make(chan error, nRequests)
+	for i := 0; i < nRequests; i++ {
+		go func(i int) {
+			errs <- callUpvote(router, api.NDBUpvoteParams{
+				QueryIdPairs: []api.QueryIdPair{
+					{QueryText: "h i j", ReferenceId: 2},
+					{QueryText: fmt.Sprintf("q%d", i), ReferenceId: uint64(i % 5)},
+				},
+			})
+		}(i)
+	}
+	for i := 0; i < nRequests; i++ {
+		require.NoError(t, <-errs)
+	}
+
+	var stats api.NDBStatsResponse
+	require.NoError(t, callBackendMethod(router, "GET", "/api/v1/stats", nil, &stats))
+	assert.Equal(t, uint64(nRequests), stats.Upvotes.Requests)
+	assert.True(t, stats.Upvotes.Batches >= 1 && stats.Upvotes.Batches <= nRequests, "unexpected number of batches %d", stats.Upvotes.Batches)
+	assert.Equal(t, 0, stats.Upvotes.PendingQueries)
+
+	res, err := callSearch(router, "a b c d e h i j", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{2, 4, 3, 1, 0})
+}
+
+func TestDeleteManyDocuments(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	const nDocs = 120 // More than one batch of deletes.
+	ids := make([]string, nDocs)
+	for i := range ids {
+		ids[i] = fmt.Sprintf("doc_%d", i)
+		require.NoError(t, callInsert(router, fmt.Sprintf("text\nchunk%d a b c\n", i), api.NDBDocumentMetadata{
+			Filename:    "file.csv",
+			SourceId:    &ids[i],
+			TextColumns: []string{"text"},
+		}))
+	}
+
+	body, err := json.Marshal(api.NDBDeleteParams{SourceIds: ids[:nDocs-1]})
+	require.NoError(t, err)
+	require.NoError(t, callBackendMethod(router, http.MethodPost, "/api/v1/delete", body, nil))
+
+	sources, err := callSources(router)
+	require.NoError(t, err)
+	require.Len(t, sources, 1)
+	assert.Equal(t, ids[nDocs-1], sources[0].SourceId)
+}
+
+func TestSourcesPage(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	for _, id := range []string{"b_1", "a_2", "a_1", "b_2", "a_3"} {
+		require.NoError(t, callInsert(router, "text\nsome text\n", api.NDBDocumentMetadata{
+			Filename:    id + ".csv",
+			SourceId:    &id,
+			TextColumns: []string{"text"},
+		}))
+	}
+
+	var ids []string
+	cursor := ""
+	for {
+		var page api.NDBSourcesPageResponse
+		require.NoError(t, callBackendMethod(router, http.MethodGet, "/api/v1/sources/page?prefix=a&limit=2&cursor="+cursor, nil, &page))
+		for _, source := range page.Sources {
+			ids = append(ids, source.SourceId)
+		}
+		if page.NextCursor == "" {
+			break
+		}
+		cursor = page.NextCursor
+	}
+	assert.Equal(t, []string{"a_1", "a_2", "a_3"}, ids)
+
+	var count api.NDBSourcesCountResponse
+	require.NoError(t, callBackendMethod(router, http.MethodGet, "/api/v1/sources/count", nil, &count))
+	assert.Equal(t, 5, count.Count)
+	require.NoError(t, callBackendMethod(router, http.MethodGet, "/api/v1/sources/count?prefix=b", nil, &count))
+	assert.Equal(t, 2, count.Count)
+
+	var sources []api.NDBSource
+	require.NoError(t, callBackendMethod(router, http.MethodGet, "/api/v1/sources?prefix=b_2", nil, &sources))
+	require.Len(t, sources, 1)
+	assert.Equal(t, "b_2.csv", sources[0].Source)
+
+	assert.Error(t, callBackendMethod(router, http.MethodGet, "/api/v1/sources/page?limit=0", nil, nil))
+	assert.Error(t, callBackendMethod(router, http.MethodGet, "/api/v1/sources/page?cursor=invalid", nil, nil))
+}
+
+func TestPruneIfNeeded(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	const nDocs = 10
+	ids := make([]string, nDocs)
+	for i := range ids {
+		ids[i] = fmt.Sprintf("doc_%d", i)
+		require.NoError(t, callInsert(router, fmt.Sprintf("text\nchunk%d a b c\n", i), api.NDBDocumentMetadata{
+			Filename:    "file.csv",
+			SourceId:    &ids[i],
+			TextColumns: []string{"text"},
+		}))
+	}
+
+	pruned, err := server.PruneIfNeeded(slog.Default(), 0.5)
+	require.NoError(t, err)
+	assert.False(t, pruned, "nothing has been deleted")
+
+	require.NoError(t, callDelete(router, ids[0]))
+	require.NoError(t, callDelete(router, ids[1]))
+
+	pruned, err = server.PruneIfNeeded(slog.Default(), 0.5)
+	require.NoError(t, err)
+	assert.False(t, pruned, "deleted ratio is below the threshold")
+
+	pruned, err = server.PruneIfNeeded(slog.Default(), 0.2)
+	require.NoError(t, err)
+	assert.True(t, pruned)
+
+	pruned, err = server.PruneIfNeeded(slog.Default(), 0.2)
+	require.NoError(t, err)
+	assert.False(t, pruned, "nothing has been deleted since the last prune")
+
+	res, err := callSearch(router, "chunk5", 10, nil)
+	require.NoError(t, err)
+	require.Len(t, res.References, 1)
+	assert.Equal(t, ids[5], res.References[0].SourceId)
+
+	sources, err := callSources(router)
+	require.NoError(t, err)
+	assert.Len(t, sources, nDocs-2)
+
+	require.NoError(t, callDelete(router, "missing_doc"))
+	pruned, err = server.PruneIfNeeded(slog.Default(), 0.01)
+	require.NoError(t, err)
+	assert.False(t, pruned, "deletes which remove no versions are not counted")
+}
+
+func TestPruneStateSavedInCheckpoint(t *testing.T) {
+	ctx, cancel := context.WithCancel(context.Background())
+	t.Cleanup(cancel)
+
+	checkpointer, _ := createMinioS3Checkpointer(t, ctx)
+
+	leader, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+	router := leader.Router()
+
+	for i := 0; i < 4; i++ {
+		id := fmt.Sprintf("doc_%d", i)
+		require.NoError(t, callInsert(router, fmt.Sprintf("text\nchunk%d a b c\n", i), api.NDBDocumentMetadata{
+			Filename:    "file.csv",
+			SourceId:    &id,
+			TextColumns: []string{"text"},
+		}))
+	}
+	require.NoError(t, callDelete(router, "doc_0"))
+
+	_, err = leader.PushCheckpoint(slog.Default(), false)
+	require.NoError(t, err)
+
+	// A leader restarted from the checkpoint still counts the deleted version.
+	newLeader, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+
+	pruned, err := newLeader.PruneIfNeeded(slog.Default(), 0.5)
+	require.NoError(t, err)
+	assert.False(t, pruned, "deleted ratio is below the threshold")
+
+	pruned, err = newLeader.PruneIfNeeded(slog.Default(), 0.2)
+	require.NoError(t, err)
+	assert.True(t, pruned)
+}
+
+// blockingCheckpointer wraps a Checkpointer and blocks uploads until unblocked.
+type blockingCheckpointer struct {
+	api.Checkpointer
+	uploading chan struct{}
+	unblock   chan struct{}
+}
+
+func (c *blockingCheckpointer) Upload(logger *slog.Logger, version api.Version, localPath string, sources *ndb.SourceList) error {
+	c.uploading <- struct{}{}
+	<-c.unblock
+	return c.Checkpointer.Upload(logger, version, localPath, sources)
+}
+
+func TestCheckpointDoesNotBlockServer(t *testing.T) {
+	ctx, cancel := context.WithCancel(context.Background())
+	t.Cleanup(cancel)
+
+	s3Checkpointer, _ := createMinioS3Checkpointer(t, ctx)
+	checkpointer := &blockingCheckpointer{Checkpointer: s3Checkpointer, uploading: make(chan struct{}), unblock: make(chan struct{})}
+
+	server, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	ckpt, err := callCheckpoint(router)
+	require.NoError(t, err)
+	assert.Equal(t, 1, ckpt.Version)
+	<-checkpointer.uploading
+
+	// Searches and inserts can proceed while the checkpoint is being uploaded.
+	res, err := callSearch(router, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{4})
+
+	require.NoError(t, callInsert(router, doc2, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeString, "k2": api.MetadataTypeInt, "k3": api.MetadataTypeString},
+	}))
+
+	_, err = callCheckpoint(router)
+	require.Error(t, err, "only one checkpoint can be in progress")
+
+	ver, err := callVersion(router)
+	require.NoError(t, err)
+	assert.Equal(t, 0, ver.CurrVersion)
+	assert.False(t, ver.LastCheckpoint.Complete)
+
+	close(checkpointer.unblock)
+
+	require.Eventually(t, func() bool {
+		ver, err := callVersion(router)
+		return err == nil && ver.LastCheckpoint.Complete && ver.CurrVersion == 1
+	}, 10*time.Second, 10*time.Millisecond)
+
+	ckpts, err := s3Checkpointer.List(slog.Default())
+	require.NoError(t, err)
+	assert.Equal(t, []api.Version{1}, ckpts)
+
+	// The insert during the upload is not part of checkpoint 1, so the server is still dirty.
+	go func() { <-checkpointer.uploading }()
+	ckpt2, err := server.PushCheckpoint(slog.Default(), false)
+	require.NoError(t, err)
+	assert.Equal(t, 2, ckpt2.Version)
+	assert.True(t, ckpt2.NewCheckpoint)
+
+	res, err = callSearch(router, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{8, 4})
+}
+
+func checkReplicated(t *testing.T, leader, follower http.Handler) {
+	constraints := map[string]api.Constraint{
+		"k3": {ConstraintType: api.EqualToType, Value: 7, Dtype: api.MetadataTypeInt},
+	}
+
+	for _, query := range []string{"a b c d e", "z e", "w x y z a b"} {
+		for _, c := range []map[string]api.Constraint{nil, constraints} {
+			expected, err := callSearch(leader, query, 10, c)
+			require.NoError(t, err)
+			actual, err := callSearch(follower, query, 10, c)
+			require.NoError(t, err)
+			assert.Equal(t, expected, actual)
+		}
+	}
+
+	expectedSources, err := callSources(leader)
+	require.NoError(t, err)
+	actualSources, err := callSources(follower)
+	require.NoError(t, err)
+	assert.ElementsMatch(t, expectedSources, actualSources)
+}
+
+func TestReplicationFromOpLog(t *testing.T) {
+	ctx, cancel := context.WithCancel(context.Background())
+	t.Cleanup(cancel)
+
+	checkpointer, _ := createMinioS3Checkpointer(t, ctx)
+
+	leader, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+	leaderRouter := leader.Router()
+	leaderServer := httptest.NewServer(leaderRouter)
+	t.Cleanup(leaderServer.Close)
+
+	require.NoError(t, callInsert(leaderRouter, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		SourceId:      nil,
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	_, err = leader.PushCheckpoint(slog.Default(), false)
+	require.NoError(t, err)
+
+	follower, err := api.NewServer(checkpointer, false, t.TempDir())
+	require.NoError(t, err)
+	followerRouter := follower.Router()
+
+	t.Run("Replay Ops", func(t *testing.T) {
+		id := "doc2"
+		require.NoError(t, callInsert(leaderRouter, doc2, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			SourceId:      &id,
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeString, "k2": api.MetadataTypeInt, "k3": api.MetadataTypeString},
+		}))
+
+		require.NoError(t, callUpvote(leaderRouter, api.NDBUpvoteParams{
+			QueryIdPairs: []api.QueryIdPair{{QueryText: "w x y z a b", ReferenceId: 2}},
+		}))
+
+		require.NoError(t, callInsert(leaderRouter, doc1, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			SourceId:      &id,
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+			Upsert:        true,
+		}))
+
+		pruned, err := leader.PruneIfNeeded(slog.Default(), 0.1)
+		require.NoError(t, err)
+		assert.True(t, pruned)
+
+		res, err := callSearch(followerRouter, "z e", 10, nil)
+		require.NoError(t, err)
+		checkResults(t, res, []int{4})
+
+		require.NoError(t, follower.PullOps(slog.Default(), leaderServer.URL))
+
+		checkReplicated(t, leaderRouter, followerRouter)
+
+		ver, err := callVersion(followerRouter)
+		require.NoError(t, err)
+		assert.Equal(t, 1, ver.CurrVersion)
+	})
+
+	t.Run("Op Log Unavailable", func(t *testing.T) {
+		// A new leader started from the same checkpoint does not have the ops the
+		// follower replayed from the previous leader.
+		newLeaderDir := t.TempDir()
+		newLeader, err := api.NewServer(checkpointer, true, newLeaderDir)
+		require.NoError(t, err)
+		newLeaderRouter := newLeader.Router()
+		newLeaderServer := httptest.NewServer(newLeaderRouter)
+		t.Cleanup(newLeaderServer.Close)
+
+		// Reloads the checkpoint, discarding the ops from the previous leader.
+		require.NoError(t, follower.PullOps(slog.Default(), newLeaderServer.URL))
+		checkReplicated(t, newLeaderRouter, followerRouter)
+
+		id := "doc2"
+		require.NoError(t, callInsert(newLeaderRouter, doc2, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			SourceId:      &id,
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeString, "k2": api.MetadataTypeInt, "k3": api.MetadataTypeString},
+		}))
+		require.NoError(t, callDelete(newLeaderRouter, "doc2"))
+
+		require.NoError(t, follower.PullOps(slog.Default(), newLeaderServer.URL))
+		checkReplicated(t, newLeaderRouter, followerRouter)
+
+		// Ops included in a checkpoint are removed from the op log, followers that
+		// have not applied them load the checkpoint instead.
+		require.NoError(t, callInsert(newLeaderRouter, doc1, api.NDBDocumentMetadata{
+			Filename:      "file.csv",
+			SourceId:      nil,
+			TextColumns:   []string{"text"},
+			MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+		}))
+		ckpt, err := newLeader.PushCheckpoint(slog.Default(), false)
+		require.NoError(t, err)
+		assert.Equal(t, 2, ckpt.Version)
+
+		// The files of the inserts are removed with their ops.
+		files, err := os.ReadDir(filepath.Join(newLeaderDir, "oplog"))
+		require.NoError(t, err)
+		assert.Empty(t, files)
+
+		require.NoError(t, follower.PullOps(slog.Default(), newLeaderServer.URL))
+		checkReplicated(t, newLeaderRouter, followerRouter)
+
+		ver, err := callVersion(followerRouter)
+		require.NoError(t, err)
+		assert.Equal(t, 2, ver.CurrVersion)
+	})
+
+	t.Run("Follower Only", func(t *testing.T) {
+		err := callBackendMethod(followerRouter, "GET", "/api/v1/oplog", nil, nil)
+		require.Error(t, err)
+		assert.Contains(t, err.Error(), "403")
+	})
+}
+
+func TestHybridSearch(t *testing.T) {
+	ctx, cancel := context.WithCancel(context.Background())
+	t.Cleanup(cancel)
+
+	checkpointer, _ := createMinioS3Checkpointer(t, ctx)
+
+	leader, err := api.NewServer(checkpointer, true, t.TempDir())
+	require.NoError(t, err)
+	leaderRouter := leader.Router()
+	leaderServer := httptest.NewServer(leaderRouter)
+	t.Cleanup(leaderServer.Close)
+
+	metadata := api.NDBDocumentMetadata{Filename: "file.csv", TextColumns: []string{"text"}, MetadataTypes: map[string]string{"k": api.MetadataTypeInt}, EmbeddingColumn: "embedding"}
+	require.NoError(t, callInsert(leaderRouter, "text,k,embedding\nfruit apple,1,\"[1, 0, 0]\"\nfruit banana,2,\"[0, 1, 0]\"\nfruit cherry,3,\"[0, 0, 2]\"\n", metadata))
+
+	weight := float32(1)
+	hybrid := api.NDBSearchParams{Query: "fruit", TopK: 4, Embedding: []float32{0.1, 0.2, 1}, DenseWeight: &weight}
+
+	res, err := callSearchWithParams(leaderRouter, hybrid)
+	require.NoError(t, err)
+	checkResults(t, res, []int{2, 1, 0})
+
+	var stats api.NDBStatsResponse
+	require.NoError(t, callBackendMethod(leaderRouter, "GET", "/api/v1/stats", nil, &stats))
+	assert.Equal(t, api.NDBEmbeddingStats{Chunks: 3, Bytes: 36, Dim: 3}, stats.Embeddings)
+
+	err = callInsert(leaderRouter, "text,k,embedding\nfruit durian,4,\"[1, 0]\"\n", metadata)
+	require.Error(t, err)
+	assert.Contains(t, err.Error(), "422")
+	assert.Contains(t, err.Error(), "does not match the dimension")
+
+	_, err = callSearchWithParams(leaderRouter, api.NDBSearchParams{Query: "fruit", TopK: 4, Embedding: []float32{1, 0}})
+	require.Error(t, err)
+	assert.Contains(t, err.Error(), "422")
+
+	err = callInsert(leaderRouter, "text,k,embedding\nfruit durian,4,notjson\n", metadata)
+	require.Error(t, err)
+	assert.Contains(t, err.Error(), "422")
+
+	_, err = callSearchWithParams(leaderRouter, api.NDBSearchParams{Query: "fruit", TopK: 4, Embedding: []float32{1, 0, 0}, Fusion: "invalid"})
+	require.Error(t, err)
+	assert.Contains(t, err.Error(), "422")
+
+	_, err = callSearchBatch(leaderRouter, []api.NDBSearchParams{hybrid})
+	require.Error(t, err)
+	assert.Contains(t, err.Error(), "422")
+
+	_, err = leader.PushCheckpoint(slog.Default(), false)
+	require.NoError(t, err)
+
+	// The embeddings are included in the checkpoint.
+	follower, err := api.NewServer(checkpointer, false, t.TempDir())
+	require.NoError(t, err)
+	followerRouter := follower.Router()
+
+	res, err = callSearchWithParams(followerRouter, hybrid)
+	require.NoError(t, err)
+	checkResults(t, res, []int{2, 1, 0})
+
+	// The embeddings of inserts are replicated from the op log.
+	require.NoError(t, callInsert(leaderRouter, "text,k,embedding\nfruit elderberry,5,\"[0, 0, 1]\"\n", metadata))
+	require.NoError(t, follower.PullOps(slog.Default(), leaderServer.URL))
+
+	expected, err := callSearchWithParams(leaderRouter, hybrid)
+	require.NoError(t, err)
+	checkResults(t, expected, []int{2, 3, 1, 0})
+	actual, err := callSearchWithParams(followerRouter, hybrid)
+	require.NoError(t, err)
+	assert.Equal(t, expected, actual)
+}
+
+func TestQueryCacheStats(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	getStats := func() api.NDBStatsResponse {
+		var stats api.NDBStatsResponse
+		require.NoError(t, callBackendMethod(router, "GET", "/api/v1/stats", nil, &stats))
+		return stats
+	}
+
+	for i := 0; i < 3; i++ {
+		res, err := callSearch(router, "z e", 10, nil)
+		require.NoError(t, err)
+		checkResults(t, res, []int{4})
+	}
+
+	stats := getStats()
+	assert.Equal(t, uint64(2), stats.QueryCache.Hits)
+	assert.Equal(t, uint64(1), stats.QueryCache.Misses)
+	assert.Equal(t, uint64(1), stats.QueryCache.Entries)
+
+	options := ndb.DefaultOptions()
+	options.QueryCacheSize = 0
+	server, err = api.NewServerWithOptions(nil, true, t.TempDir(), options)
+	require.NoError(t, err)
+	router = server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	res, err := callSearch(router, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{4})
+
+	stats = getStats()
+	assert.Equal(t, uint64(0), stats.QueryCache.Hits)
+	assert.Equal(t, uint64(0), stats.QueryCache.Entries)
+	assert.Equal(t, uint64(0), stats.QueryCache.Capacity)
+}
+
+func TestMetrics(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	for i := 0; i < 2; i++ {
+		res, err := callSearch(router, "z e", 10, nil)
+		require.NoError(t, err)
+		checkResults(t, res, []int{4})
+	}
+
+	req := httptest.NewRequest(http.MethodGet, "/metrics", nil)
+	res := httptest.NewRecorder()
+	router.ServeHTTP(res, req)
+	require.Equal(t, http.StatusOK, res.Code)
+
+	metrics := res.Body.String()
+	for _, expected := range []string{
+		`ndb_request_duration_seconds_count{endpoint="search"} 2`,
+		`ndb_request_duration_seconds_count{endpoint="insert"} 1`,
+		`ndb_search_stage_duration_seconds_count{stage="engine"} 1`,
+		`ndb_search_stage_duration_seconds_count{stage="response"} 2`,
+		`ndb_search_stage_duration_seconds_bucket{stage="parse",le="+Inf"} 2`,
+		`ndb_lock_wait_seconds_count{op="search",mode="read"} 2`,
+		`ndb_lock_wait_seconds_count{op="insert",mode="read"} 1`,
+		`ndb_lock_wait_seconds_count{op="insert",mode="writers"} 1`,
+		"ndb_search_results_total 2\n",
+		"ndb_search_cached_total 1\n",
+		"ndb_query_cache_hits_total 1\n",
+	} {
+		assert.Contains(t, metrics, expected)
+	}
+}
+
+func TestAdmissionControl(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	server.EnableAdmissionControl(1, 1)
+	router := server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	searchBody := `{"query": "z e", "top_k": 10}`
+
+	search := func(body io.Reader, priority string) <-chan int {
+		code := make(chan int, 1)
+		go func() {
+			req := httptest.NewRequest(http.MethodPost, "/api/v1/search", body)
+			if priority != "" {
+				req.Header.Set("X-Priority", priority)
+			}
+			res := httptest.NewRecorder()
+			router.ServeHTTP(res, req)
+			code <- res.Code
+		}()
+		return code
+	}
+
+	// Searches are admitted before their request bodies are read, so a search with
+	// a blocked body holds the only slot.
+	blockedBody, blockedWriter := io.Pipe()
+	blocked := search(blockedBody, "")
+	_, err = blockedWriter.Write([]byte(searchBody[:1]))
+	require.NoError(t, err)
+
+	waitForQueued := func(n int) {
+		t.Helper()
+		for i := 0; i < 1000; i++ {
+			req := httptest.NewRequest(http.MethodGet, "/metrics", nil)
+			res := httptest.NewRecorder()
+			router.ServeHTTP(res, req)
+			if strings.Contains(res.Body.String(), fmt.Sprintf("ndb_search_admission_queued %d\n", n)) {
+				return
+			}
+			time.Sleep(time.Millisecond)
+		}
+		t.Fatalf("expected %d queued searches", n)
+	}
+
+	lowPriority := search(strings.NewReader(searchBody), "low")
+	waitForQueued(1)
+
+	// The queue is full and there is no lower priority search to displace.
+	assert.Equal(t, http.StatusTooManyRequests, <-search(strings.NewReader(searchBody), "low"))
+
+	res := httptest.NewRecorder()
+	req := httptest.NewRequest(http.MethodPost, "/api/v1/search", strings.NewReader(searchBody))
+	req.Header.Set("X-Priority", "urgent")
+	router.ServeHTTP(res, req)
+	assert.Equal(t, http.StatusUnprocessableEntity, res.Code)
+
+	// A high priority search displaces the queued low priority search.
+	highPriority := search(strings.NewReader(searchBody), "high")
+	assert.Equal(t, http.StatusTooManyRequests, <-lowPriority)
+	waitForQueued(1)
+
+	_, err = blockedWriter.Write([]byte(searchBody[1:]))
+	require.NoError(t, err)
+	require.NoError(t, blockedWriter.Close())
+
+	assert.Equal(t, http.StatusOK, <-blocked)
+	assert.Equal(t, http.StatusOK, <-highPriority)
+
+	searchRes, err := callSearch(router, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, searchRes, []int{4})
+}
+
+func TestSearchTimeout(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	server.EnableAdmissionControl(1, 10)
+	server.SetSearchTimeout(50 * time.Millisecond)
+	router := server.Router()
+
+	require.NoError(t, callInsert(router, doc1, api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	}))
+
+	searchBody := `{"query": "z e", "top_k": 10}`
+
+	blockedBody, blockedWriter := io.Pipe()
+	blocked := make(chan int, 1)
+	go func() {
+		req := httptest.NewRequest(http.MethodPost, "/api/v1/search", blockedBody)
+		res := httptest.NewRecorder()
+		router.ServeHTTP(res, req)
+		blocked <- res.Code
+	}()
+	_, err = blockedWriter.Write([]byte(searchBody[:1]))
+	require.NoError(t, err)
+
+	// The search times out while waiting for the blocked search.
+	req := httptest.NewRequest(http.MethodPost, "/api/v1/search", strings.NewReader(searchBody))
+	res := httptest.NewRecorder()
+	router.ServeHTTP(res, req)
+	assert.Equal(t, http.StatusServiceUnavailable, res.Code)
+
+	// The blocked search times out before its query is run.
+	time.Sleep(50 * time.Millisecond)
+	_, err = blockedWriter.Write([]byte(searchBody[1:]))
+	require.NoError(t, err)
+	require.NoError(t, blockedWriter.Close())
+	assert.Equal(t, http.StatusServiceUnavailable, <-blocked)
+
+	searchRes, err := callSearch(router, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, searchRes, []int{4})
+}
+
+func TestInsertRejectsDuplicateParts(t *testing.T) {
+	server, err := api.NewServer(nil, true, t.TempDir())
+	require.NoError(t, err)
+	router := server.Router()
+
+	metadata, err := json.Marshal(api.NDBDocumentMetadata{
+		Filename:      "file.csv",
+		TextColumns:   []string{"text"},
+		MetadataTypes: map[string]string{"k1": api.MetadataTypeFloat, "k2": api.MetadataTypeBool, "k3": api.MetadataTypeInt, "k4": api.MetadataTypeString},
+	})
+	require.NoError(t, err)
+
+	insert := func(parts ...string) error {
+		body := new(bytes.Buffer)
+		writer := multipart.NewWriter(body)
+		for _, part := range parts {
+			if part == "file" {
+				file, err := writer.CreateFormFile("file", "file.csv")
+				require.NoError(t, err)
+				_, err = file.Write([]byte(doc1))
+				require.NoError(t, err)
+			} else {
+				require.NoError(t, writer.WriteField("metadata", string(metadata)))
+			}
+		}
+		require.NoError(t, writer.Close())
+
+		return callBackendMethod(router, http.MethodPost, "/api/v1/insert", body.Bytes(), nil, func(r *http.Request) {
+			r.Header.Set("Content-Type", writer.FormDataContentType())
+		})
+	}
+
+	for _, parts := range [][]string{{"metadata", "metadata", "file"}, {"metadata", "file", "file"}, {"file", "file", "metadata"}} {
+		err := insert(parts...)
+		require.Error(t, err)
+		assert.Contains(t, err.Error(), fmt.Sprintf("%s part specified multiple times", parts[1]))
+	}
+	require.NoError(t, insert("metadata", "file"))
+
+	res, err := callSearch(router, "z e", 10, nil)
+	require.NoError(t, err)
+	checkResults(t, res, []int{4})
+}
@@ -13,7 +13,8 @@ type Checkpointer interface {
 
 	Download(logger *slog.Logger, version Version, localPath string) error
 
-	Upload(logger *slog.Logger, version Version, localPath string, sources []ndb.Source) error
+	// The sources are written to the checkpoint metadata, the list may be nil.
+	Upload(logger *slog.Logger, version Version, localPath string, sources *ndb.SourceList) error
 }
 
 func versionName(version Version) string {
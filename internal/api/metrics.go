@@ -0,0 +1,292 @@
+package api
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"net/http"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// The upper bounds of the latency histogram buckets in seconds.
+var latencyBuckets = []float64{0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}
+
+// histogram is a latency histogram which can be observed concurrently without
+// locking.
+type histogram struct {
+	// counts[i] is the number of observations in bucket i, and the last entry is
+	// for observations greater than all of the bucket bounds. The counts are
+	// accumulated when the histogram is exported.
+	counts []atomic.Uint64
+	sumNs  atomic.Uint64
+	count  atomic.Uint64
+}
+
+func newHistogram() *histogram {
+	return &histogram{counts: make([]atomic.Uint64, len(latencyBuckets)+1)}
+}
+
+func (h *histogram) observe(d time.Duration) {
+	h.counts[sort.SearchFloat64s(latencyBuckets, d.Seconds())].Add(1)
+	h.sumNs.Add(uint64(d))
+	h.count.Add(1)
+}
+
+// histogramVec is a set of histograms with the same name and label names, which
+// are distinguished by the values of their labels.
+type histogramVec struct {
+	name   string
+	help   string
+	labels []string
+
+	lock       sync.RWMutex
+	histograms map[string]*histogram
+}
+
+func newHistogramVec(name, help string, labels ...string) *histogramVec {
+	return &histogramVec{name: name, help: help, labels: labels, histograms: make(map[string]*histogram)}
+}
+
+// with returns the histogram for the label values, which must be in the same
+// order as the label names.
+func (v *histogramVec) with(values ...string) *histogram {
+	pairs := make([]string, len(values))
+	for i, value := range values {
+		pairs[i] = fmt.Sprintf("%s=%q", v.labels[i], value)
+	}
+	key := strings.Join(pairs, ",")
+
+	v.lock.RLock()
+	h, ok := v.histograms[key]
+	v.lock.RUnlock()
+	if ok {
+		return h
+	}
+
+	v.lock.Lock()
+	defer v.lock.Unlock()
+	if h, ok := v.histograms[key]; ok {
+		return h
+	}
+	h = newHistogram()
+	v.histograms[key] = h
+	return h
+}
+
+func withLabel(labels, extra string) string {
+	if labels == "" {
+		return extra
+	}
+	return labels + "," + extra
+}
+
+func (v *histogramVec) write(w io.Writer) {
+	v.lock.RLock()
+	histograms := make(map[string]*histogram, len(v.histograms))
+	keys := make([]string, 0, len(v.histograms))
+	for key, h := range v.histograms {
+		histograms[key] = h
+		keys = append(keys, key)
+	}
+	v.lock.RUnlock()
+	sort.Strings(keys)
+
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s histogram\n", v.name, v.help, v.name)
+	for _, labels := range keys {
+		h := histograms[labels]
+
+		cumulative := uint64(0)
+		for i, bound := range latencyBuckets {
+			cumulative += h.counts[i].Load()
+			fmt.Fprintf(w, "%s_bucket{%s} %d\n", v.name, withLabel(labels, fmt.Sprintf("le=\"%g\"", bound)), cumulative)
+		}
+		cumulative += h.counts[len(latencyBuckets)].Load()
+		fmt.Fprintf(w, "%s_bucket{%s} %d\n", v.name, withLabel(labels, `le="+Inf"`), cumulative)
+		fmt.Fprintf(w, "%s_sum{%s} %g\n", v.name, labels, time.Duration(h.sumNs.Load()).Seconds())
+		fmt.Fprintf(w, "%s_count{%s} %d\n", v.name, labels, h.count.Load())
+	}
+}
+
+func writeMetric(w io.Writer, name, metricType, help string, value any) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s %s\n%s %v\n", name, help, name, metricType, name, value)
+}
+
+// searchStageHistograms are the histograms of the stages of a search, they are
+// resolved when the metrics are created so that searches do not look them up by
+// their labels.
+type searchStageHistograms struct {
+	admission   *histogram
+	parse       *histogram
+	constraints *histogram
+	args        *histogram
+	engine      *histogram
+	serialize   *histogram
+	convert     *histogram
+	response    *histogram
+	hybrid      *histogram
+}
+
+func newSearchStageHistograms(v *histogramVec) searchStageHistograms {
+	return searchStageHistograms{
+		admission:   v.with("admission"),
+		parse:       v.with("parse"),
+		constraints: v.with("constraints"),
+		args:        v.with("args"),
+		engine:      v.with("engine"),
+		serialize:   v.with("serialize"),
+		convert:     v.with("convert"),
+		response:    v.with("response"),
+		hybrid:      v.with("hybrid"),
+	}
+}
+
+// lockOp is the operation acquiring a lock, which labels its lock waits.
+type lockOp int
+
+const (
+	lockOpSearch lockOp = iota
+	lockOpSearchBatch
+	lockOpInsert
+	lockOpUpsertDelete
+	lockOpDelete
+	lockOpUpvote
+	lockOpPrune
+	lockOpCheckpoint
+	lockOpLoadCheckpoint
+	lockOpReplication
+	nLockOps
+)
+
+var lockOpNames = [nLockOps]string{
+	"search", "search_batch", "insert", "upsert_delete", "delete", "upvote", "prune", "checkpoint", "load_checkpoint", "replication",
+}
+
+// lockMode is read or write for the ndb lock, and writers for writeLock, which
+// serializes the writes to the ndb.
+type lockMode int
+
+const (
+	lockModeRead lockMode = iota
+	lockModeWrite
+	lockModeWriters
+	nLockModes
+)
+
+var lockModeNames = [nLockModes]string{"read", "write", "writers"}
+
+type serverMetrics struct {
+	requests     *histogramVec
+	searchStages *histogramVec
+	lockWait     *histogramVec
+
+	stages    searchStageHistograms
+	lockWaits [nLockOps][nLockModes]atomic.Pointer[histogram]
+
+	searchResults atomic.Uint64
+	searchCached  atomic.Uint64
+}
+
+func newServerMetrics() *serverMetrics {
+	m := &serverMetrics{
+		requests:     newHistogramVec("ndb_request_duration_seconds", "Duration of requests by endpoint.", "endpoint"),
+		searchStages: newHistogramVec("ndb_search_stage_duration_seconds", "Duration of each stage of search requests.", "stage"),
+		lockWait:     newHistogramVec("ndb_lock_wait_seconds", "Time spent waiting to acquire the ndb lock, or writeLock for the writers mode.", "op", "mode"),
+	}
+	m.stages = newSearchStageHistograms(m.searchStages)
+	return m
+}
+
+// lockWaitHistogram returns the histogram of the lock waits of the op, it is
+// looked up by its labels only the first time, and is not created until then,
+// so that only the locks each op acquires are exported.
+func (m *serverMetrics) lockWaitHistogram(op lockOp, mode lockMode) *histogram {
+	slot := &m.lockWaits[op][mode]
+	if h := slot.Load(); h != nil {
+		return h
+	}
+	h := m.lockWait.with(lockOpNames[op], lockModeNames[mode])
+	slot.Store(h)
+	return h
+}
+
+// timed records the duration of each request to the endpoint.
+func (s *Server) timed(endpoint string, handler func(r *http.Request) (any, error)) func(r *http.Request) (any, error) {
+	h := s.metrics.requests.with(endpoint)
+	return func(r *http.Request) (any, error) {
+		start := time.Now()
+		defer func() { h.observe(time.Since(start)) }()
+		return handler(r)
+	}
+}
+
+// rlock acquires the read lock on the ndb and records the time spent waiting for
+// it.
+func (s *Server) rlock(op lockOp) {
+	start := time.Now()
+	s.lock.RLock()
+	s.metrics.lockWaitHistogram(op, lockModeRead).observe(time.Since(start))
+}
+
+// wlock acquires the write lock on the ndb and records the time spent waiting
+// for it.
+func (s *Server) wlock(op lockOp) {
+	start := time.Now()
+	s.lock.Lock()
+	s.metrics.lockWaitHistogram(op, lockModeWrite).observe(time.Since(start))
+}
+
+// lockWrites acquires writeLock and records the time spent waiting for other
+// writes to complete.
+func (s *Server) lockWrites(op lockOp) {
+	start := time.Now()
+	s.writeLock.Lock()
+	s.metrics.lockWaitHistogram(op, lockModeWriters).observe(time.Since(start))
+}
+
+// Metrics exports the request and search stage latencies, and the statistics
+// returned by the stats endpoint, in the Prometheus text format.
+func (s *Server) Metrics(w http.ResponseWriter, r *http.Request) {
+	s.lock.RLock()
+	cache := s.ndb.QueryCacheStats()
+	s.lock.RUnlock()
+	upvotes := s.upvotes.stats()
+
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+
+	out := bufio.NewWriter(w)
+	defer out.Flush()
+
+	s.metrics.requests.write(out)
+	s.metrics.searchStages.write(out)
+	s.metrics.lockWait.write(out)
+
+	writeMetric(out, "ndb_search_results_total", "counter", "Number of results returned by search requests.", s.metrics.searchResults.Load())
+	writeMetric(out, "ndb_search_cached_total", "counter", "Number of search requests served from the query cache.", s.metrics.searchCached.Load())
+
+	writeMetric(out, "ndb_query_cache_hits_total", "counter", "Number of query cache hits.", cache.Hits)
+	writeMetric(out, "ndb_query_cache_misses_total", "counter", "Number of query cache misses.", cache.Misses)
+	writeMetric(out, "ndb_query_cache_evictions_total", "counter", "Number of query cache evictions.", cache.Evictions)
+	writeMetric(out, "ndb_query_cache_entries", "gauge", "Number of entries in the query cache.", cache.Entries)
+	writeMetric(out, "ndb_query_cache_bytes", "gauge", "Approximate memory used by the query cache.", cache.Bytes)
+	writeMetric(out, "ndb_query_cache_capacity_bytes", "gauge", "Maximum memory used by the query cache.", cache.Capacity)
+
+	if s.admission != nil {
+		admission := s.admission.stats()
+		writeMetric(out, "ndb_search_admission_running", "gauge", "Number of admitted searches which are running.", admission.running)
+		writeMetric(out, "ndb_search_admission_queued", "gauge", "Number of searches waiting to be admitted.", admission.queued)
+		writeMetric(out, "ndb_search_admission_admitted_total", "counter", "Number of searches admitted.", admission.admitted)
+		writeMetric(out, "ndb_search_admission_rejected_total", "counter", "Number of searches rejected because the queue was full.", admission.rejected)
+		writeMetric(out, "ndb_search_admission_shed_total", "counter", "Number of queued searches displaced by higher priority searches.", admission.shed)
+		writeMetric(out, "ndb_search_admission_timed_out_total", "counter", "Number of searches which timed out while queued.", admission.timedOut)
+	}
+
+	writeMetric(out, "ndb_upvote_requests_total", "counter", "Number of upvote requests.", upvotes.requests)
+	writeMetric(out, "ndb_upvote_batches_total", "counter", "Number of upvote batches applied.", upvotes.batches)
+	writeMetric(out, "ndb_upvote_pending_queries", "gauge", "Number of upvoted queries waiting to be applied.", upvotes.pendingQueries)
+
+	writeMetric(out, "ndb_checkpoint_version", "gauge", "Version of the checkpoint the ndb was loaded from or last pushed.", s.getVersion())
+}
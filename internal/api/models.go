@@ -148,6 +148,17 @@ type NDBSearchParams struct {
 	Query       string                `json:"query"`
 	TopK        int                   `json:"top_k"`
 	Constraints map[string]Constraint `json:"constraints"`
+	// Embedding is the embedding of the query, if it is set the results are
+	// reranked by fusing their scores with the similarity of the embedding to
+	// the embeddings of the chunks, see ndb.QueryHybrid.
+	Embedding []float32 `json:"embedding,omitempty"`
+	// Fusion is either "rrf", which is the default, or "weighted".
+	Fusion string `json:"fusion,omitempty"`
+	// DenseWeight is the weight of the embedding similarity in the fused score,
+	// between 0 and 1.
+	DenseWeight *float32 `json:"dense_weight,omitempty"`
+	// Candidates is the number of results that are reranked, 0 uses 4*top_k.
+	Candidates int `json:"candidates,omitempty"`
 }
 
 type Reference struct {
@@ -162,6 +173,17 @@ type Reference struct {
 type NDBSearchResponse struct {
 	Query      string      `json:"query_text"`
 	References []Reference `json:"references"`
+	// TimedOut is set for queries in a batch which were not run before the
+	// search timeout expired.
+	TimedOut bool `json:"timed_out,omitempty"`
+}
+
+type NDBBatchSearchParams struct {
+	Queries []NDBSearchParams `json:"queries"`
+}
+
+type NDBBatchSearchResponse struct {
+	Results []NDBSearchResponse `json:"results"`
 }
 
 type NDBDocumentMetadata struct {
@@ -170,6 +192,9 @@ type NDBDocumentMetadata struct {
 	TextColumns   []string          `json:"text_columns"`
 	MetadataTypes map[string]string `json:"metadata_types"`
 	Upsert        bool              `json:"upsert"`
+	// EmbeddingColumn is the column of the CSV which contains the embedding of
+	// each chunk as a JSON array of floats, for hybrid searches.
+	EmbeddingColumn string `json:"embedding_column,omitempty"`
 }
 
 type NDBDeleteParams struct {
@@ -192,6 +217,15 @@ type NDBSource struct {
 	Version  uint32 `json:"version"`
 }
 
+type NDBSourcesPageResponse struct {
+	Sources    []NDBSource `json:"sources"`
+	NextCursor string      `json:"next_cursor,omitempty"`
+}
+
+type NDBSourcesCountResponse struct {
+	Count int `json:"count"`
+}
+
 type LastCheckpoint struct {
 	Version  int    `json:"version"`
 	Complete bool   `json:"complete"`
@@ -203,7 +237,41 @@ type NDBVersionResponse struct {
 	LastCheckpoint *LastCheckpoint `json:"last_checkpoint,omitempty"`
 }
 
+type NDBQueryCacheStats struct {
+	Hits      uint64 `json:"hits"`
+	Misses    uint64 `json:"misses"`
+	Evictions uint64 `json:"evictions"`
+	Entries   uint64 `json:"entries"`
+	Bytes     uint64 `json:"bytes"`
+	Capacity  uint64 `json:"capacity"`
+}
+
+type NDBEmbeddingStats struct {
+	Chunks   uint64 `json:"chunks"`
+	Bytes    uint64 `json:"bytes"`
+	MaxBytes uint64 `json:"max_bytes"`
+	Dim      int    `json:"dim"`
+}
+
+type NDBUpvoteStats struct {
+	PendingQueries int    `json:"pending_queries"`
+	Requests       uint64 `json:"requests"`
+	Batches        uint64 `json:"batches"`
+}
+
+type NDBStatsResponse struct {
+	QueryCache NDBQueryCacheStats `json:"query_cache"`
+	Upvotes    NDBUpvoteStats     `json:"upvotes"`
+	Embeddings NDBEmbeddingStats  `json:"embeddings"`
+}
+
 type NDBCheckpointResponse struct {
 	Version       int  `json:"version"`
 	NewCheckpoint bool `json:"new_checkpoint"`
 }
+
+type NDBOpLogResponse struct {
+	Epoch string `json:"epoch"`
+	Seq   uint64 `json:"seq"`
+	Ops   []Op   `json:"ops"`
+}
@@ -0,0 +1,449 @@
+package api
+
+import (
+	"bufio"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+	"sync"
+)
+
+const (
+	OpInsert = "insert"
+	OpDelete = "delete"
+	OpUpvote = "upvote"
+	OpPrune  = "prune"
+)
+
+// Op is a write that was applied to the leader's ndb. Followers replay the ops
+// in order of Seq to stay up to date between checkpoints.
+type Op struct {
+	Seq  uint64 `json:"seq"`
+	Type string `json:"type"`
+
+	// Used by insert and delete
+	DocId string `json:"doc_id,omitempty"`
+
+	// Used by insert. Followers check that they assign the same chunk ids to the
+	// insert as the leader, since upvotes refer to chunks by id.
+	Document      string            `json:"document,omitempty"`
+	Chunks        []string          `json:"chunks,omitempty"`
+	MetadataTypes map[string]string `json:"metadata_types,omitempty"`
+	Metadata      []map[string]any  `json:"metadata,omitempty"`
+	Embeddings    [][]float32       `json:"embeddings,omitempty"`
+	ChunkIds      *ChunkIdRange     `json:"chunk_ids,omitempty"`
+
+	// Used by delete
+	KeepLatestVersion bool `json:"keep_latest_version,omitempty"`
+
+	// Used by upvote
+	Queries []string `json:"queries,omitempty"`
+	Labels  []uint64 `json:"labels,omitempty"`
+
+	// On the leader the chunks, metadata, and embeddings of an insert are stored
+	// in a file in
+	// the op log directory instead of in memory, and are only read when the op is
+	// sent to a follower.
+	file      string
+	fileBytes int
+}
+
+// ChunkIdRange is the range of chunk ids assigned to an insert, as returned by
+// the ndb.
+type ChunkIdRange struct {
+	Start uint64 `json:"start"`
+	End   uint64 `json:"end"`
+}
+
+// The metadata values are decoded from json as float64, this converts them back
+// to the types used when the chunks were parsed.
+func (op *Op) typedMetadata() ([]map[string]any, error) {
+	if op.Metadata == nil {
+		return nil, nil
+	}
+
+	metadata := make([]map[string]any, len(op.Metadata))
+	for i, meta := range op.Metadata {
+		metadata[i] = make(map[string]any, len(meta))
+		for key, value := range meta {
+			switch op.MetadataTypes[key] {
+			case MetadataTypeInt:
+				v, ok := value.(float64)
+				if !ok {
+					return nil, fmt.Errorf("invalid int metadata value %v for key %s", value, key)
+				}
+				metadata[i][key] = int(v)
+			case MetadataTypeFloat, MetadataTypeBool, MetadataTypeString:
+				metadata[i][key] = value
+			default:
+				return nil, fmt.Errorf("unknown metadata type for key %s", key)
+			}
+		}
+	}
+	return metadata, nil
+}
+
+func metadataSize(metadata map[string]any) int {
+	size := 0
+	for key, value := range metadata {
+		size += len(key) + 16
+		if str, ok := value.(string); ok {
+			size += len(str)
+		}
+	}
+	return size
+}
+
+func (op *Op) size() int {
+	size := len(op.DocId) + len(op.Document) + op.fileBytes + 64
+	for _, chunk := range op.Chunks {
+		size += len(chunk)
+	}
+	for _, meta := range op.Metadata {
+		size += metadataSize(meta)
+	}
+	for _, embedding := range op.Embeddings {
+		size += 4 * len(embedding)
+	}
+	for _, query := range op.Queries {
+		size += len(query) + 8
+	}
+	return size
+}
+
+// OpLogState identifies a point in the history of the leader's ndb. The epoch is
+// regenerated each time the leader starts, since any ops that were not included
+// in a checkpoint are lost when the leader restarts, and so a new epoch implies
+// that sequence numbers may have been reused.
+type OpLogState struct {
+	Epoch string
+	Seq   uint64
+}
+
+// The op log state of a checkpoint is saved in the checkpoint directory, so that
+// servers loading the checkpoint know which ops it contains.
+const opLogStateFilename = "oplog_state.json"
+
+func saveOpLogState(dir string, state OpLogState) error {
+	data, err := json.Marshal(state)
+	if err != nil {
+		return fmt.Errorf("failed to marshal op log state: %w", err)
+	}
+	if err := os.WriteFile(filepath.Join(dir, opLogStateFilename), data, 0644); err != nil {
+		return fmt.Errorf("failed to write op log state: %w", err)
+	}
+	return nil
+}
+
+// loadOpLogState returns the zero state if the checkpoint does not have an op log
+// state, this is the case for new ndbs, and checkpoints from before the op log.
+func loadOpLogState(dir string) (OpLogState, error) {
+	data, err := os.ReadFile(filepath.Join(dir, opLogStateFilename))
+	if errors.Is(err, os.ErrNotExist) {
+		return OpLogState{}, nil
+	}
+	if err != nil {
+		return OpLogState{}, fmt.Errorf("failed to read op log state: %w", err)
+	}
+
+	var state OpLogState
+	if err := json.Unmarshal(data, &state); err != nil {
+		return OpLogState{}, fmt.Errorf("failed to parse op log state: %w", err)
+	}
+	return state, nil
+}
+
+const (
+	defaultOpLogMaxBytes = 256 * 1024 * 1024 // 256 MB
+	maxOpLogResponseSize = 16 * 1024 * 1024  // 16 MB
+	// opLogDir is the directory in the local checkpoint directory which holds the
+	// files of the inserts in the leader's op log.
+	opLogDir = "oplog"
+)
+
+var errOpsUnavailable = errors.New("ops are no longer available in the op log")
+
+// opLog holds the ops applied by the leader since the last checkpoint, up to
+// maxBytes. The chunks of inserts are stored in files in dir, and count towards
+// maxBytes, so only the small ops are held in memory. Once ops are removed from
+// the log, followers which have not yet applied them must load a newer
+// checkpoint.
+type opLog struct {
+	lock sync.Mutex
+
+	dir string
+
+	epoch string
+	// The state of the checkpoint the leader was started from. A follower in this
+	// state can apply the ops from this epoch.
+	base OpLogState
+
+	firstSeq uint64 // The seq of the first op that is still available.
+	lastSeq  uint64
+	ops      []Op
+	nBytes   int
+	maxBytes int
+}
+
+// newOpLog clears dir, since the files of ops from a previous epoch cannot be
+// served once the leader restarts.
+func newOpLog(dir string, epoch string, base OpLogState, maxBytes int) (*opLog, error) {
+	if err := os.RemoveAll(dir); err != nil {
+		return nil, fmt.Errorf("failed to clear op log directory: %w", err)
+	}
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, fmt.Errorf("failed to create op log directory: %w", err)
+	}
+
+	return &opLog{
+		dir:      dir,
+		epoch:    epoch,
+		base:     base,
+		firstSeq: base.Seq + 1,
+		lastSeq:  base.Seq,
+		maxBytes: maxBytes,
+	}, nil
+}
+
+func (l *opLog) state() OpLogState {
+	l.lock.Lock()
+	defer l.lock.Unlock()
+
+	return OpLogState{Epoch: l.epoch, Seq: l.lastSeq}
+}
+
+func (l *opLog) append(op Op) {
+	l.lock.Lock()
+	defer l.lock.Unlock()
+
+	l.lastSeq++
+	op.Seq = l.lastSeq
+
+	size := op.size()
+	if size > l.maxBytes {
+		op.removeFile()
+		l.dropUpToLocked(l.lastSeq)
+		return
+	}
+
+	l.ops = append(l.ops, op)
+	l.nBytes += size
+
+	for l.nBytes > l.maxBytes {
+		l.dropUpToLocked(l.ops[0].Seq)
+	}
+}
+
+// appendGap records that a write was applied that could not be added to the log,
+// followers that have not applied it will need to load a newer checkpoint.
+func (l *opLog) appendGap() {
+	l.lock.Lock()
+	defer l.lock.Unlock()
+
+	l.lastSeq++
+	l.dropUpToLocked(l.lastSeq)
+}
+
+// truncate removes the ops contained in a checkpoint once it is uploaded.
+func (l *opLog) truncate(seq uint64) {
+	l.lock.Lock()
+	defer l.lock.Unlock()
+
+	if seq >= l.firstSeq {
+		l.dropUpToLocked(seq)
+	}
+}
+
+func (l *opLog) dropUpToLocked(seq uint64) {
+	n := 0
+	for n < len(l.ops) && l.ops[n].Seq <= seq {
+		l.nBytes -= l.ops[n].size()
+		l.ops[n].removeFile()
+		n++
+	}
+	l.ops = append(l.ops[:0:0], l.ops[n:]...)
+	l.firstSeq = seq + 1
+}
+
+// since returns the ops after the given state, as well as the state once the
+// ops are applied. The chunks of inserts are read from their files without
+// holding the lock, if an op is removed from the log before its file is read
+// then the ops are no longer available.
+func (l *opLog) since(state OpLogState) ([]Op, OpLogState, error) {
+	ops, next, err := l.opsSince(state)
+	if err != nil {
+		return nil, OpLogState{}, err
+	}
+
+	for i := range ops {
+		if err := ops[i].loadFile(); errors.Is(err, os.ErrNotExist) {
+			return nil, OpLogState{}, errOpsUnavailable
+		} else if err != nil {
+			return nil, OpLogState{}, err
+		}
+	}
+
+	return ops, next, nil
+}
+
+func (l *opLog) opsSince(state OpLogState) ([]Op, OpLogState, error) {
+	l.lock.Lock()
+	defer l.lock.Unlock()
+
+	compatible := state.Epoch == l.epoch || (state.Epoch == l.base.Epoch && state.Seq == l.base.Seq)
+	if !compatible || state.Seq+1 < l.firstSeq || state.Seq > l.lastSeq {
+		return nil, OpLogState{}, errOpsUnavailable
+	}
+
+	start := len(l.ops)
+	for i, op := range l.ops {
+		if op.Seq > state.Seq {
+			start = i
+			break
+		}
+	}
+
+	ops := make([]Op, 0)
+	size := 0
+	for _, op := range l.ops[start:] {
+		if len(ops) > 0 && size+op.size() > maxOpLogResponseSize {
+			break
+		}
+		ops = append(ops, op)
+		size += op.size()
+	}
+
+	next := OpLogState{Epoch: l.epoch, Seq: state.Seq}
+	if len(ops) > 0 {
+		next.Seq = ops[len(ops)-1].Seq
+	}
+
+	return ops, next, nil
+}
+
+// insertRecord is a batch of chunks of an insert in the file of its op.
+type insertRecord struct {
+	Chunks     []string         `json:"chunks"`
+	Metadata   []map[string]any `json:"metadata,omitempty"`
+	Embeddings [][]float32      `json:"embeddings,omitempty"`
+}
+
+func (op *Op) loadFile() error {
+	if op.file == "" {
+		return nil
+	}
+
+	file, err := os.Open(op.file)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+
+	decoder := json.NewDecoder(bufio.NewReader(file))
+	for {
+		var record insertRecord
+		if err := decoder.Decode(&record); err == io.EOF {
+			return nil
+		} else if err != nil {
+			return fmt.Errorf("failed to read op %d: %w", op.Seq, err)
+		}
+		op.Chunks = append(op.Chunks, record.Chunks...)
+		op.Metadata = append(op.Metadata, record.Metadata...)
+		op.Embeddings = append(op.Embeddings, record.Embeddings...)
+	}
+}
+
+func (op *Op) removeFile() {
+	if op.file != "" {
+		os.Remove(op.file)
+	}
+}
+
+var errInsertTooLarge = errors.New("insert exceeds the op log size")
+
+// insertCapture writes the chunks of an insert to a file in the op log directory
+// as they are parsed, so that the insert can be added to the op log without a
+// copy of the document in memory. If the insert exceeds the size of the op log,
+// or the file cannot be written, it is not added to the log.
+type insertCapture struct {
+	file     *os.File
+	writer   *bufio.Writer
+	nBytes   int
+	maxBytes int
+	err      error
+}
+
+func (l *opLog) newInsertCapture() *insertCapture {
+	c := &insertCapture{maxBytes: l.maxBytes}
+
+	file, err := os.CreateTemp(l.dir, "insert_")
+	if err != nil {
+		c.err = fmt.Errorf("failed to create op log file: %w", err)
+		return c
+	}
+	c.file, c.writer = file, bufio.NewWriter(file)
+	return c
+}
+
+func (c *insertCapture) add(chunks []string, metadata []map[string]any, embeddings [][]float32) {
+	if c == nil || c.err != nil {
+		return
+	}
+
+	data, err := json.Marshal(insertRecord{Chunks: chunks, Metadata: metadata, Embeddings: embeddings})
+	if err != nil {
+		c.fail(fmt.Errorf("failed to encode op log record: %w", err))
+		return
+	}
+
+	c.nBytes += len(data) + 1
+	if c.nBytes > c.maxBytes {
+		c.fail(errInsertTooLarge)
+		return
+	}
+
+	data = append(data, '\n')
+	if _, err := c.writer.Write(data); err != nil {
+		c.fail(fmt.Errorf("failed to write op log file: %w", err))
+	}
+}
+
+func (c *insertCapture) fail(err error) {
+	c.err = err
+	c.discard()
+}
+
+// finish returns the path and size of the file for the op, the file is then
+// owned by the op log.
+func (c *insertCapture) finish() (string, int, error) {
+	if c.err != nil {
+		return "", 0, c.err
+	}
+
+	path := c.file.Name()
+	err := c.writer.Flush()
+	if closeErr := c.file.Close(); err == nil {
+		err = closeErr
+	}
+	c.file = nil
+	if err != nil {
+		os.Remove(path)
+		c.err = fmt.Errorf("failed to write op log file: %w", err)
+		return "", 0, c.err
+	}
+
+	return path, c.nBytes, nil
+}
+
+// discard removes the file if it was not passed to the op log.
+func (c *insertCapture) discard() {
+	if c == nil || c.file == nil {
+		return
+	}
+	c.file.Close()
+	os.Remove(c.file.Name())
+	c.file = nil
+}
@@ -3,7 +3,10 @@ package api
 import (
 	"bytes"
 	"encoding/csv"
+	"encoding/json"
+	"errors"
 	"fmt"
+	"io"
 	"net/http"
 	"strconv"
 	"strings"
@@ -46,58 +49,270 @@ func buildMetadataParsers(colToIdx map[string]int, metadataTypes map[string]stri
 	return metdataParsers, nil
 }
 
-func ParseContent(data []byte, textCols []string, metadataTypes map[string]string) ([]string, []map[string]any, error) {
-	reader := csv.NewReader(bytes.NewReader(data))
+type rowParser struct {
+	textIdxs       []int
+	metadataIdxs   map[string]int
+	metadataParser map[string]metadataParserFunc
+	// The index of the embedding column, or -1 if there is none.
+	embeddingIdx int
+}
+
+func newRowParser(header []string, textCols []string, metadataTypes map[string]string, embeddingCol string) (*rowParser, error) {
+	colToIdx := make(map[string]int, len(header))
+	for i, col := range header {
+		colToIdx[col] = i
+	}
+
+	textIdxs := make([]int, 0, len(textCols))
+	for _, col := range textCols {
+		idx, ok := colToIdx[col]
+		if !ok {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "column '%s' specified for indexing is not present in the CSV header", col)
+		}
+		textIdxs = append(textIdxs, idx)
+	}
 
-	rows, err := reader.ReadAll()
+	metdataParsers, err := buildMetadataParsers(colToIdx, metadataTypes)
 	if err != nil {
-		return nil, nil, CodedErrorf(http.StatusUnprocessableEntity, "only CSV files are supported: unable to read CSV file: %w", err)
+		return nil, err
 	}
 
-	if len(rows) < 1 {
-		return nil, nil, CodedErrorf(http.StatusUnprocessableEntity, "CSV file is empty")
+	metadataIdxs := make(map[string]int, len(metdataParsers))
+	for col := range metdataParsers {
+		metadataIdxs[col] = colToIdx[col]
 	}
 
-	header := rows[0]
+	embeddingIdx := -1
+	if embeddingCol != "" {
+		idx, ok := colToIdx[embeddingCol]
+		if !ok {
+			return nil, CodedErrorf(http.StatusUnprocessableEntity, "embedding column '%s' is not present in the CSV header", embeddingCol)
+		}
+		embeddingIdx = idx
+	}
 
-	colToIdx := make(map[string]int, len(header))
-	for i, col := range header {
-		colToIdx[col] = i
+	return &rowParser{textIdxs: textIdxs, metadataIdxs: metadataIdxs, metadataParser: metdataParsers, embeddingIdx: embeddingIdx}, nil
+}
+
+// parseEmbedding parses the embedding column of the row, which is a JSON array
+// of floats.
+func (p *rowParser) parseEmbedding(row []string) ([]float32, error) {
+	if p.embeddingIdx < 0 {
+		return nil, nil
+	}
+	var embedding []float32
+	if err := json.Unmarshal([]byte(row[p.embeddingIdx]), &embedding); err != nil {
+		return nil, CodedErrorf(http.StatusUnprocessableEntity, "error parsing embedding column value %s: %w", row[p.embeddingIdx], err)
 	}
+	return embedding, nil
+}
 
-	for _, col := range textCols {
-		if _, ok := colToIdx[col]; !ok {
-			return nil, nil, CodedErrorf(http.StatusUnprocessableEntity, "column '%s' specified for indexing is not present in the CSV header", col)
+func (p *rowParser) parse(row []string) (string, map[string]any, error) {
+	chunk := strings.Builder{}
+	for _, idx := range p.textIdxs {
+		chunk.WriteString(row[idx])
+		chunk.WriteRune(' ')
+	}
+
+	meta := make(map[string]any, len(p.metadataParser))
+	for col, parser := range p.metadataParser {
+		value := row[p.metadataIdxs[col]]
+		parsedValue, err := parser(value)
+		if err != nil {
+			return "", nil, CodedErrorf(http.StatusUnprocessableEntity, "error parsing metadata column %s value %s: %w", col, value, err)
 		}
+		meta[col] = parsedValue
 	}
 
-	metdataParsers, err := buildMetadataParsers(colToIdx, metadataTypes)
+	return strings.TrimSpace(chunk.String()), meta, nil
+}
+
+// The number of parsed batches that can be buffered between the CSV decoding
+// and the consumer of ParseContentStream. This bounds the memory used by the
+// pipeline to roughly (streamPipelineDepth + 2) * batchSize rows.
+const streamPipelineDepth = 4
+
+type chunkBatch struct {
+	chunks     []string
+	metadata   []map[string]any
+	embeddings [][]float32
+}
+
+// ParseContentStream decodes the CSV incrementally and invokes onBatch with
+// up to batchSize chunks at a time. Decoding and metadata conversion run in a
+// separate goroutine so that they overlap with the work done by onBatch. If
+// onBatch returns an error parsing is stopped and the error is returned. The
+// slices passed to onBatch are not reused by the parser. Returns the total
+// number of chunks parsed.
+func ParseContentStream(data io.Reader, textCols []string, metadataTypes map[string]string, batchSize int, onBatch func(chunks []string, metadata []map[string]any) error) (int, error) {
+	return ParseContentStreamWithEmbeddings(data, textCols, metadataTypes, "", batchSize, func(chunks []string, metadata []map[string]any, _ [][]float32) error {
+		return onBatch(chunks, metadata)
+	})
+}
+
+// ParseContentStreamWithEmbeddings is ParseContentStream for a CSV which also
+// has an embedding for each chunk in embeddingCol. The embeddings passed to
+// onBatch are nil if embeddingCol is empty.
+func ParseContentStreamWithEmbeddings(data io.Reader, textCols []string, metadataTypes map[string]string, embeddingCol string, batchSize int, onBatch func(chunks []string, metadata []map[string]any, embeddings [][]float32) error) (int, error) {
+	reader := csv.NewReader(data)
+	reader.ReuseRecord = true
+
+	header, err := reader.Read()
+	if err == io.EOF {
+		return 0, CodedErrorf(http.StatusUnprocessableEntity, "CSV file is empty")
+	}
 	if err != nil {
-		return nil, nil, err
+		return 0, csvReadError(err)
+	}
+
+	parser, err := newRowParser(header, textCols, metadataTypes, embeddingCol)
+	if err != nil {
+		return 0, err
 	}
 
-	chunks := make([]string, 0, len(rows)-1)
-	metadata := make([]map[string]any, 0, len(rows)-1)
+	batches := make(chan chunkBatch, streamPipelineDepth)
+	done := make(chan struct{})
+	var parseErr error
+
+	go func() {
+		defer close(batches)
 
-	for _, row := range rows[1:] {
-		chunk := strings.Builder{}
-		for _, col := range textCols {
-			chunk.WriteString(row[colToIdx[col]])
-			chunk.WriteRune(' ')
+		newBatch := func() chunkBatch {
+			batch := chunkBatch{chunks: make([]string, 0, batchSize), metadata: make([]map[string]any, 0, batchSize)}
+			if embeddingCol != "" {
+				batch.embeddings = make([][]float32, 0, batchSize)
+			}
+			return batch
 		}
-		chunks = append(chunks, strings.TrimSpace(chunk.String()))
 
-		meta := make(map[string]any, len(metdataParsers))
-		for col, parser := range metdataParsers {
-			value := row[colToIdx[col]]
-			parsedValue, err := parser(value)
+		send := func(batch chunkBatch) bool {
+			select {
+			case batches <- batch:
+				return true
+			case <-done:
+				return false
+			}
+		}
+
+		batch := newBatch()
+		for {
+			row, err := reader.Read()
+			if err == io.EOF {
+				break
+			}
+			if err != nil {
+				parseErr = csvReadError(err)
+				return
+			}
+
+			chunk, meta, err := parser.parse(row)
 			if err != nil {
-				return nil, nil, CodedErrorf(http.StatusUnprocessableEntity, "error parsing metadata column %s value %s: %w", col, value, err)
+				parseErr = err
+				return
+			}
+			batch.chunks = append(batch.chunks, chunk)
+			batch.metadata = append(batch.metadata, meta)
+
+			if embeddingCol != "" {
+				embedding, err := parser.parseEmbedding(row)
+				if err != nil {
+					parseErr = err
+					return
+				}
+				batch.embeddings = append(batch.embeddings, embedding)
+			}
+
+			if len(batch.chunks) == batchSize {
+				if !send(batch) {
+					return
+				}
+				batch = newBatch()
 			}
-			meta[col] = parsedValue
 		}
-		metadata = append(metadata, meta)
+
+		if len(batch.chunks) > 0 {
+			send(batch)
+		}
+	}()
+
+	nChunks := 0
+	var batchErr error
+	for batch := range batches {
+		if batchErr != nil {
+			continue // drain until the parser observes done
+		}
+		if err := onBatch(batch.chunks, batch.metadata, batch.embeddings); err != nil {
+			batchErr = err
+			close(done)
+			continue
+		}
+		nChunks += len(batch.chunks)
+	}
+
+	if batchErr != nil {
+		return nChunks, batchErr
+	}
+	if parseErr != nil { // batches is closed after parseErr is set
+		return nChunks, parseErr
+	}
+
+	return nChunks, nil
+}
+
+func csvReadError(err error) error {
+	var tooLarge *fileTooLargeError
+	if errors.As(err, &tooLarge) {
+		return CodedErrorf(http.StatusUnprocessableEntity, "%w", tooLarge)
+	}
+	return CodedErrorf(http.StatusUnprocessableEntity, "only CSV files are supported: unable to read CSV file: %w", err)
+}
+
+func ParseContent(data []byte, textCols []string, metadataTypes map[string]string) ([]string, []map[string]any, error) {
+	chunks := make([]string, 0)
+	metadata := make([]map[string]any, 0)
+
+	_, err := ParseContentStream(bytes.NewReader(data), textCols, metadataTypes, defaultParseBatchSize, func(batchChunks []string, batchMetadata []map[string]any) error {
+		chunks = append(chunks, batchChunks...)
+		metadata = append(metadata, batchMetadata...)
+		return nil
+	})
+	if err != nil {
+		return nil, nil, err
 	}
 
 	return chunks, metadata, nil
 }
+
+const defaultParseBatchSize = 4096
+
+type fileTooLargeError struct {
+	limit int64
+}
+
+func (e *fileTooLargeError) Error() string {
+	return fmt.Sprintf("file size exceeds maximum limit of %d bytes, please chunk file", e.limit)
+}
+
+// sizeLimitedReader is like io.LimitReader, except that it returns an error
+// once the limit is exceeded instead of silently truncating the input, which
+// is necessary when the input is consumed incrementally.
+type sizeLimitedReader struct {
+	r     io.Reader
+	limit int64
+	n     int64
+}
+
+func (l *sizeLimitedReader) Read(p []byte) (int, error) {
+	if l.n > l.limit {
+		return 0, &fileTooLargeError{limit: l.limit}
+	}
+	if remaining := l.limit - l.n + 1; int64(len(p)) > remaining { // +1 to ensure we catch overflows
+		p = p[:remaining]
+	}
+	n, err := l.r.Read(p)
+	l.n += int64(n)
+	if l.n > l.limit {
+		return n, &fileTooLargeError{limit: l.limit}
+	}
+	return n, err
+}
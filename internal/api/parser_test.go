@@ -1,6 +1,8 @@
 package api_test
 
 import (
+	"errors"
+	"fmt"
 	"ndb-server/internal/api"
 	"strings"
 	"testing"
@@ -68,3 +70,92 @@ func TestParseContent_EmptyCSV(t *testing.T) {
 		t.Errorf("expected error for empty CSV, got %v", err)
 	}
 }
+
+func TestParseContentStream_Batches(t *testing.T) {
+	data := strings.Builder{}
+	data.WriteString("text,id\n")
+	for i := 0; i < 10; i++ {
+		data.WriteString(fmt.Sprintf("text%d,%d\n", i, i))
+	}
+
+	batchSizes := []int{}
+	chunks := []string{}
+	ids := []any{}
+	n, err := api.ParseContentStream(strings.NewReader(data.String()), []string{"text"}, map[string]string{"id": api.MetadataTypeInt}, 4, func(batchChunks []string, batchMetadata []map[string]any) error {
+		batchSizes = append(batchSizes, len(batchChunks))
+		chunks = append(chunks, batchChunks...)
+		for _, meta := range batchMetadata {
+			ids = append(ids, meta["id"])
+		}
+		return nil
+	})
+	if err != nil {
+		t.Fatalf("unexpected error: %v", err)
+	}
+
+	assert.Equal(t, 10, n)
+	assert.Equal(t, []int{4, 4, 2}, batchSizes)
+	for i := 0; i < 10; i++ {
+		assert.Equal(t, fmt.Sprintf("text%d", i), chunks[i])
+		assert.Equal(t, i, ids[i])
+	}
+}
+
+func TestParseContentStream_InvalidRow(t *testing.T) {
+	data := "col1,col2\ntext1,1\ntext2,2\ntext3,invalidInt\ntext4,4\n"
+
+	n, err := api.ParseContentStream(strings.NewReader(data), []string{"col1"}, map[string]string{"col2": api.MetadataTypeInt}, 1, func([]string, []map[string]any) error {
+		return nil
+	})
+	if err == nil || !strings.Contains(err.Error(), "error parsing metadata column col2 value invalidInt") {
+		t.Errorf("expected error for invalid metadata value, got %v", err)
+	}
+	assert.Equal(t, 2, n)
+}
+
+func TestParseContentStream_BatchError(t *testing.T) {
+	data := strings.Builder{}
+	data.WriteString("text\n")
+	for i := 0; i < 1000; i++ {
+		data.WriteString(fmt.Sprintf("text%d\n", i))
+	}
+
+	calls := 0
+	_, err := api.ParseContentStream(strings.NewReader(data.String()), []string{"text"}, nil, 1, func([]string, []map[string]any) error {
+		calls++
+		return errors.New("batch error")
+	})
+	if err == nil || err.Error() != "batch error" {
+		t.Errorf("expected batch error, got %v", err)
+	}
+	assert.Equal(t, 1, calls)
+}
+
+func TestParseContentStream_Embeddings(t *testing.T) {
+	data := "text,embedding\na,\"[1, 0.5]\"\nb,\"[0, -1]\"\n"
+
+	var embeddings [][]float32
+	n, err := api.ParseContentStreamWithEmbeddings(strings.NewReader(data), []string{"text"}, nil, "embedding", 1, func(_ []string, _ []map[string]any, batchEmbeddings [][]float32) error {
+		embeddings = append(embeddings, batchEmbeddings...)
+		return nil
+	})
+	if err != nil {
+		t.Fatalf("unexpected error: %v", err)
+	}
+	assert.Equal(t, 2, n)
+	assert.Equal(t, [][]float32{{1, 0.5}, {0, -1}}, embeddings)
+
+	_, err = api.ParseContentStreamWithEmbeddings(strings.NewReader("text,embedding\na,notjson\n"), []string{"text"}, nil, "embedding", 1, func([]string, []map[string]any, [][]float32) error {
+		return nil
+	})
+	if err == nil || !strings.Contains(err.Error(), "error parsing embedding column value notjson") {
+		t.Errorf("expected error for invalid embedding, got %v", err)
+	}
+
+	_, err = api.ParseContentStreamWithEmbeddings(strings.NewReader(data), []string{"text"}, nil, "missing", 1, func([]string, []map[string]any, [][]float32) error {
+		return nil
+	})
+	if err == nil || !strings.Contains(err.Error(), "embedding column 'missing' is not present") {
+		t.Errorf("expected error for missing embedding column, got %v", err)
+	}
+}
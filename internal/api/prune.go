@@ -0,0 +1,140 @@
+package api
+
+import (
+	"encoding/json"
+	"errors"
+	"fmt"
+	"log"
+	"log/slog"
+	"net/http"
+	"os"
+	"path/filepath"
+	"time"
+)
+
+// Prunes are skipped until the time since the last prune is at least this
+// multiple of its duration, so that the ndb is locked for at most ~5% of the
+// time by prunes.
+const pruneBackoffFactor = 20
+
+// pruneState tracks the versions of documents deleted since the last prune, it
+// is guarded by writeLock. The number of deleted versions is saved with each
+// checkpoint, so that it is not reset when the leader restarts.
+type pruneState struct {
+	deletedVersions   int
+	lastPrune         time.Time
+	lastPruneDuration time.Duration
+}
+
+const pruneStateFilename = "prune_state.json"
+
+type savedPruneState struct {
+	DeletedVersions int `json:"deleted_versions"`
+}
+
+func savePruneState(dir string, deletedVersions int) error {
+	data, err := json.Marshal(savedPruneState{DeletedVersions: deletedVersions})
+	if err != nil {
+		return fmt.Errorf("failed to marshal prune state: %w", err)
+	}
+	if err := os.WriteFile(filepath.Join(dir, pruneStateFilename), data, 0644); err != nil {
+		return fmt.Errorf("failed to write prune state: %w", err)
+	}
+	return nil
+}
+
+// loadPruneState returns 0 deleted versions if the checkpoint does not have a
+// prune state, this is the case for new ndbs, and checkpoints from before the
+// prune state was saved.
+func loadPruneState(dir string) (int, error) {
+	data, err := os.ReadFile(filepath.Join(dir, pruneStateFilename))
+	if errors.Is(err, os.ErrNotExist) {
+		return 0, nil
+	}
+	if err != nil {
+		return 0, fmt.Errorf("failed to read prune state: %w", err)
+	}
+
+	var state savedPruneState
+	if err := json.Unmarshal(data, &state); err != nil {
+		return 0, fmt.Errorf("failed to parse prune state: %w", err)
+	}
+	return state.DeletedVersions, nil
+}
+
+// PruneIfNeeded prunes the ndb if the fraction of document versions deleted
+// since the last prune is at least threshold. The versions removed by deletes
+// are counted by the ndb, so deletes of documents that do not exist are not
+// counted. Returns true if the ndb was pruned.
+func (s *Server) PruneIfNeeded(logger *slog.Logger, threshold float64) (bool, error) {
+	if !s.leader {
+		return false, CodedErrorf(http.StatusForbidden, "PruneIfNeeded should only be called on leader")
+	}
+
+	s.lockWrites(lockOpPrune)
+	defer s.writeLock.Unlock()
+
+	if s.prune.deletedVersions == 0 {
+		return false, nil
+	}
+
+	if since := time.Since(s.prune.lastPrune); since < pruneBackoffFactor*s.prune.lastPruneDuration {
+		logger.Info("prune: skipping, last prune was too recent", "since_last_prune", since.String(), "last_prune_duration", s.prune.lastPruneDuration.String())
+		return false, nil
+	}
+
+	s.lock.RLock()
+	nSources, err := s.ndb.SourcesCount("")
+	s.lock.RUnlock()
+	if err != nil {
+		logger.Error("prune: failed to count ndb sources", "error", err)
+		return false, fmt.Errorf("failed to count ndb sources: %w", err)
+	}
+
+	// Sources are counted by version, so this is the fraction of the versions
+	// since the last prune which have been deleted.
+	ratio := float64(s.prune.deletedVersions) / float64(nSources+s.prune.deletedVersions)
+	if ratio < threshold {
+		return false, nil
+	}
+
+	logger.Info("prune: starting", "deleted_versions", s.prune.deletedVersions, "n_sources", nSources, "deleted_ratio", ratio)
+
+	start := time.Now()
+	s.wlock(lockOpPrune)
+	err = s.ndb.Prune()
+	s.lock.Unlock()
+	duration := time.Since(start)
+
+	if err != nil {
+		logger.Error("prune: error", "error", err)
+		return false, fmt.Errorf("failed to prune ndb: %w", err)
+	}
+
+	s.dirty = true
+	s.recordOp(Op{Type: OpPrune})
+	s.prune = pruneState{lastPrune: time.Now(), lastPruneDuration: duration}
+
+	logger.Info("prune: complete", "duration", duration.String())
+
+	return true, nil
+}
+
+// PruneDeleted periodically prunes the ndb once the fraction of document versions
+// deleted since the last prune reaches threshold.
+func (s *Server) PruneDeleted(interval time.Duration, threshold float64) {
+	if !s.leader {
+		log.Fatal("PruneDeleted should only be called on leader")
+	}
+
+	ticker := time.Tick(interval)
+
+	logger := slog.With("action", "prune")
+
+	for {
+		select {
+		case <-ticker:
+			_, _ = s.PruneIfNeeded(logger, threshold) // Errors are logged by PruneIfNeeded
+		}
+	}
+}
@@ -1,10 +1,14 @@
 package api
 
 import (
+	"bufio"
 	"bytes"
 	"context"
+	"crypto/sha256"
+	"encoding/hex"
 	"encoding/json"
 	"fmt"
+	"io"
 	"log/slog"
 	"ndb-server/internal/ndb"
 	"os"
@@ -13,6 +17,8 @@ import (
 	"slices"
 	"strconv"
 	"strings"
+	"sync"
+	"syscall"
 	"time"
 
 	"github.com/aws/aws-sdk-go-v2/aws"
@@ -21,18 +27,40 @@ import (
 	"github.com/aws/aws-sdk-go-v2/service/s3"
 )
 
-const checkpointsPrefix = "checkpoints"
+const (
+	checkpointsPrefix = "checkpoints"
+	// Immutable files (see isSharedFile) are stored once under this prefix, keyed by
+	// their content hash, and referenced by the manifest of each checkpoint that
+	// contains them, so that unchanged files are not uploaded again.
+	sharedFilesPrefix = checkpointsPrefix + "/shared"
+)
 
 var (
 	partialCheckpointRe = regexp.MustCompile(`^` + checkpointsPrefix + `/ndb_(\d+)/`)
 	// The checkpoint metadata is uploaded last, so if it is missing, we can assume the checkpoint is incomplete.
 	completeCheckpointRe = regexp.MustCompile(`^` + checkpointsPrefix + `/ndb_(\d+)/` + checkpointMetadataFilename + `$`)
+	manifestRe           = regexp.MustCompile(`^` + checkpointsPrefix + `/ndb_(\d+)/` + checkpointManifestFilename + `$`)
 )
 
 type S3Checkpointer struct {
 	bucket         string
 	client         *s3.Client
 	maxCheckpoints int
+
+	lock sync.Mutex
+	// Caches the content hash of files that have already been uploaded. The saved
+	// checkpoints hard link the SST files of the live DB, so unchanged files have
+	// the same identity across checkpoints and only need to be hashed once.
+	fileHashes map[fileIdentity]string
+	// The shared files from the last checkpoint that was downloaded, by key. Shared
+	// files that are already present locally are hard linked into later downloads
+	// instead of being downloaded again.
+	downloadedFiles map[string]localSharedFile
+}
+
+type localSharedFile struct {
+	path string
+	id   fileIdentity
 }
 
 var _ Checkpointer = (*S3Checkpointer)(nil)
@@ -153,13 +181,23 @@ func (c *S3Checkpointer) Download(logger *slog.Logger, version Version, dest str
 
 	src := filepath.Join(checkpointsPrefix, versionName(version))
 
-	objs, err := c.listObjects(ctx, src)
+	objs, err := c.listObjects(ctx, src+"/")
 	if err != nil {
 		logger.Info("s3_checkpointer: failed to list objects for checkpoint", "version", version, "src", src, "error", err)
 		return fmt.Errorf("failed to list objects for version %d: %w", version, err)
 	}
 
+	var manifest checkpointManifest
+
 	for _, obj := range objs {
+		if manifestRe.MatchString(obj) {
+			if manifest, err = c.readManifest(ctx, obj); err != nil {
+				logger.Info("s3_checkpointer: failed to read manifest for checkpoint", "version", version, "obj", obj, "error", err)
+				return err
+			}
+			continue
+		}
+
 		localFilepath := filepath.Join(dest, strings.TrimPrefix(obj, src))
 
 		logger.Info("s3_checkpointer: downloading object", "version", version, "obj", obj, "dest", localFilepath)
@@ -172,6 +210,36 @@ func (c *S3Checkpointer) Download(logger *slog.Logger, version Version, dest str
 		logger.Info("s3_checkpointer: object downloaded", "version", version, "obj", obj, "dest", localFilepath)
 	}
 
+	c.lock.Lock()
+	prevFiles := c.downloadedFiles
+	c.lock.Unlock()
+
+	downloadedFiles := make(map[string]localSharedFile, len(manifest.SharedFiles))
+	nLinked := 0
+
+	for _, file := range manifest.SharedFiles {
+		localFilepath := filepath.Join(dest, file.Path)
+
+		if prev, ok := prevFiles[file.Key]; ok && linkSharedFile(prev, localFilepath) {
+			nLinked++
+		} else if err := downloadObject(ctx, downloader, c.bucket, file.Key, localFilepath); err != nil {
+			logger.Info("s3_checkpointer: failed to download shared file for checkpoint", "version", version, "obj", file.Key, "error", err)
+			return fmt.Errorf("failed to download shared file %s: %w", file.Key, err)
+		}
+
+		if info, err := os.Stat(localFilepath); err == nil {
+			if id, ok := getFileIdentity(info); ok {
+				downloadedFiles[file.Key] = localSharedFile{path: localFilepath, id: id}
+			}
+		}
+	}
+
+	c.lock.Lock()
+	c.downloadedFiles = downloadedFiles
+	c.lock.Unlock()
+
+	logger.Info("s3_checkpointer: shared files downloaded", "version", version, "n_shared_files", len(manifest.SharedFiles), "n_linked", nLinked)
+
 	slog.Info("s3_checkpointer: checkpoint download successful", "version", version, "src", src, "dest", dest)
 
 	return nil
@@ -185,7 +253,196 @@ type CheckpointMetadata struct {
 
 const checkpointMetadataFilename = "checkpoint_metadata.json"
 
-func (c *S3Checkpointer) Upload(logger *slog.Logger, version Version, src string, sources []ndb.Source) error {
+type sharedCheckpointFile struct {
+	Path string // Relative to the checkpoint directory
+	Key  string
+}
+
+type checkpointManifest struct {
+	SharedFiles []sharedCheckpointFile
+}
+
+const checkpointManifestFilename = "checkpoint_manifest.json"
+
+// SST and blob files are never modified once they are written by RocksDB, and
+// neither are the embedding files of the ndb, so they can be shared between
+// checkpoints.
+func isSharedFile(path string) bool {
+	ext := filepath.Ext(path)
+	return ext == ".sst" || ext == ".blob" || ext == ".emb"
+}
+
+type fileIdentity struct {
+	dev, ino uint64
+	size     int64
+	modTime  int64
+}
+
+func getFileIdentity(info os.FileInfo) (fileIdentity, bool) {
+	stat, ok := info.Sys().(*syscall.Stat_t)
+	if !ok {
+		return fileIdentity{}, false
+	}
+	return fileIdentity{dev: uint64(stat.Dev), ino: stat.Ino, size: info.Size(), modTime: info.ModTime().UnixNano()}, true
+}
+
+// linkSharedFile hard links a previously downloaded shared file to dest, it returns
+// false if the file has been removed or modified since it was downloaded.
+func linkSharedFile(file localSharedFile, dest string) bool {
+	info, err := os.Stat(file.path)
+	if err != nil {
+		return false
+	}
+	if id, ok := getFileIdentity(info); !ok || id != file.id {
+		return false
+	}
+
+	if err := os.MkdirAll(filepath.Dir(dest), os.ModePerm); err != nil {
+		return false
+	}
+	return os.Link(file.path, dest) == nil
+}
+
+func hashFile(path string) (string, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return "", err
+	}
+	defer file.Close()
+
+	hash := sha256.New()
+	if _, err := io.Copy(hash, file); err != nil {
+		return "", fmt.Errorf("failed to hash file %s: %w", path, err)
+	}
+	return hex.EncodeToString(hash.Sum(nil)), nil
+}
+
+func (c *S3Checkpointer) sharedFileKey(path string, info os.FileInfo, hashes map[fileIdentity]string) (string, error) {
+	id, hasId := getFileIdentity(info)
+
+	var hash string
+	if hasId {
+		c.lock.Lock()
+		hash = c.fileHashes[id]
+		c.lock.Unlock()
+	}
+
+	if hash == "" {
+		var err error
+		if hash, err = hashFile(path); err != nil {
+			return "", err
+		}
+	}
+
+	if hasId {
+		hashes[id] = hash
+	}
+
+	return sharedFilesPrefix + "/" + hash + filepath.Ext(path), nil
+}
+
+func (c *S3Checkpointer) readManifest(ctx context.Context, key string) (checkpointManifest, error) {
+	obj, err := c.client.GetObject(ctx, &s3.GetObjectInput{
+		Bucket: aws.String(c.bucket),
+		Key:    aws.String(key),
+	})
+	if err != nil {
+		return checkpointManifest{}, fmt.Errorf("failed to get manifest s3://%s/%s: %w", c.bucket, key, err)
+	}
+	defer obj.Body.Close()
+
+	var manifest checkpointManifest
+	if err := json.NewDecoder(obj.Body).Decode(&manifest); err != nil {
+		return checkpointManifest{}, fmt.Errorf("failed to parse manifest s3://%s/%s: %w", c.bucket, key, err)
+	}
+
+	return manifest, nil
+}
+
+func (c *S3Checkpointer) uploadFile(ctx context.Context, uploader *manager.Uploader, path, key string) error {
+	file, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+
+	if _, err := uploader.Upload(ctx, &s3.PutObjectInput{
+		Bucket: aws.String(c.bucket),
+		Key:    aws.String(key),
+		Body:   file,
+	}); err != nil {
+		slog.Info("failed to upload file", "path", path, "bucket", c.bucket, "key", key, "error", err)
+		return fmt.Errorf("failed to upload file %s to s3://%s/%s: %w", path, c.bucket, key, err)
+	}
+
+	return nil
+}
+
+func (c *S3Checkpointer) putJson(ctx context.Context, key string, value any) error {
+	data, err := json.MarshalIndent(value, "", "  ")
+	if err != nil {
+		return fmt.Errorf("failed to marshal %s: %w", filepath.Base(key), err)
+	}
+
+	if _, err := c.client.PutObject(ctx, &s3.PutObjectInput{
+		Bucket: aws.String(c.bucket),
+		Key:    aws.String(key),
+		Body:   bytes.NewReader(data),
+	}); err != nil {
+		return fmt.Errorf("failed to upload %s to s3://%s/%s: %w", filepath.Base(key), c.bucket, key, err)
+	}
+
+	return nil
+}
+
+// writeCheckpointMetadata writes the same json as json.Marshal of the
+// CheckpointMetadata, except that the documents are encoded one at a time, so
+// that the metadata can be streamed without copying all of the sources.
+func writeCheckpointMetadata(w io.Writer, timestamp time.Time, version Version, sources *ndb.SourceList) error {
+	header, err := json.Marshal(CheckpointMetadata{Timestamp: timestamp, Version: version})
+	if err != nil {
+		return err
+	}
+
+	out := bufio.NewWriter(w)
+	// Replaces the `null}` for the empty documents with the encoded documents.
+	out.Write(bytes.TrimSuffix(header, []byte("null}")))
+	out.WriteByte('[')
+
+	encoder := json.NewEncoder(out)
+	for i := 0; sources != nil && i < sources.Len(); i++ {
+		if i > 0 {
+			out.WriteByte(',')
+		}
+		if err := encoder.Encode(sources.At(i)); err != nil {
+			return err
+		}
+	}
+
+	out.WriteString("]}")
+	return out.Flush()
+}
+
+func (c *S3Checkpointer) putMetadata(ctx context.Context, uploader *manager.Uploader, key string, version Version, sources *ndb.SourceList) error {
+	reader, writer := io.Pipe()
+	defer reader.Close() // Unblocks the writer if the upload fails
+
+	go func() {
+		writer.CloseWithError(writeCheckpointMetadata(writer, time.Now(), version, sources))
+	}()
+
+	if _, err := uploader.Upload(ctx, &s3.PutObjectInput{
+		Bucket: aws.String(c.bucket),
+		Key:    aws.String(key),
+		Body:   reader,
+	}); err != nil {
+		return fmt.Errorf("failed to upload %s to s3://%s/%s: %w", filepath.Base(key), c.bucket, key, err)
+	}
+
+	return nil
+}
+
+func (c *S3Checkpointer) Upload(logger *slog.Logger, version Version, src string, sources *ndb.SourceList) error {
 	ctx, cancel := context.WithTimeout(context.Background(), 10*time.Minute)
 	defer cancel()
 
@@ -195,7 +452,21 @@ func (c *S3Checkpointer) Upload(logger *slog.Logger, version Version, src string
 
 	uploader := manager.NewUploader(c.client)
 
-	err := filepath.Walk(src, func(path string, info os.FileInfo, err error) error {
+	existingSharedFiles, err := c.listObjects(ctx, sharedFilesPrefix+"/")
+	if err != nil {
+		logger.Error("s3_checkpointer: failed to list shared files", "error", err)
+		return fmt.Errorf("failed to list shared files: %w", err)
+	}
+	sharedFiles := make(map[string]struct{}, len(existingSharedFiles))
+	for _, key := range existingSharedFiles {
+		sharedFiles[key] = struct{}{}
+	}
+
+	var manifest checkpointManifest
+	hashes := make(map[fileIdentity]string)
+	nUploaded, nReused := 0, 0
+
+	err = filepath.Walk(src, func(path string, info os.FileInfo, err error) error {
 		if err != nil {
 			return fmt.Errorf("failed to walk directory %s: %w", src, err)
 		}
@@ -204,22 +475,29 @@ func (c *S3Checkpointer) Upload(logger *slog.Logger, version Version, src string
 			return nil
 		}
 
-		key := filepath.Join(dest, strings.TrimPrefix(path, src))
+		relPath := strings.TrimPrefix(path, src)
 
-		file, err := os.Open(path)
+		if !isSharedFile(path) {
+			nUploaded++
+			return c.uploadFile(ctx, uploader, path, filepath.Join(dest, relPath))
+		}
+
+		key, err := c.sharedFileKey(path, info, hashes)
 		if err != nil {
 			return err
 		}
-		defer file.Close()
+		manifest.SharedFiles = append(manifest.SharedFiles, sharedCheckpointFile{Path: relPath, Key: key})
 
-		if _, err := uploader.Upload(ctx, &s3.PutObjectInput{
-			Bucket: aws.String(c.bucket),
-			Key:    aws.String(key),
-			Body:   file,
-		}); err != nil {
-			slog.Info("failed to upload file", "path", path, "bucket", c.bucket, "key", key, "error", err)
-			return fmt.Errorf("failed to upload file %s to s3://%s/%s: %w", path, c.bucket, key, err)
+		if _, ok := sharedFiles[key]; ok {
+			nReused++
+			return nil
+		}
+
+		if err := c.uploadFile(ctx, uploader, path, key); err != nil {
+			return err
 		}
+		sharedFiles[key] = struct{}{}
+		nUploaded++
 
 		return nil
 	})
@@ -228,24 +506,21 @@ func (c *S3Checkpointer) Upload(logger *slog.Logger, version Version, src string
 		return fmt.Errorf("failed to upload files from %s: %w", src, err)
 	}
 
-	metadata := CheckpointMetadata{
-		Timestamp: time.Now(),
-		Version:   version,
-		Documents: sources,
-	}
+	c.lock.Lock()
+	c.fileHashes = hashes // Only keep the hashes of files that are still in use
+	c.lock.Unlock()
 
-	metadataJson, err := json.MarshalIndent(metadata, "", "  ")
-	if err != nil {
-		return fmt.Errorf("failed to marshal checkpoint metadata: %w", err)
+	logger.Info("s3_checkpointer: checkpoint files uploaded", "version", version, "n_uploaded", nUploaded, "n_reused", nReused)
+
+	// The manifest must be uploaded before the metadata, since the metadata marks the checkpoint as complete.
+	if err := c.putJson(ctx, filepath.Join(dest, checkpointManifestFilename), manifest); err != nil {
+		logger.Error("s3_checkpointer: failed to upload checkpoint manifest", "error", err)
+		return err
 	}
 
-	if _, err := c.client.PutObject(ctx, &s3.PutObjectInput{
-		Bucket: aws.String(c.bucket),
-		Key:    aws.String(filepath.Join(dest, checkpointMetadataFilename)),
-		Body:   bytes.NewReader(metadataJson),
-	}); err != nil {
+	if err := c.putMetadata(ctx, uploader, filepath.Join(dest, checkpointMetadataFilename), version, sources); err != nil {
 		logger.Error("s3_checkpointer: failed to upload checkpoint metadata", "error", err)
-		return fmt.Errorf("failed to upload checkpoint metadata to s3://%s/%s: %w", c.bucket, filepath.Join(dest, checkpointMetadataFilename), err)
+		return err
 	}
 
 	if err := c.deleteOldCheckpoints(logger, ctx); err != nil {
@@ -309,7 +584,7 @@ func (c *S3Checkpointer) deleteOldCheckpoints(logger *slog.Logger, ctx context.C
 
 	for _, version := range checkpointsToDelete {
 		logger.Info("s3_checkpointer: deleting checkpoint", "version", version)
-		ckptObjs, err := c.listObjects(ctx, filepath.Join(checkpointsPrefix, versionName(version)))
+		ckptObjs, err := c.listObjects(ctx, filepath.Join(checkpointsPrefix, versionName(version))+"/")
 		if err != nil {
 			logger.Error("s3_checkpointer: failed to list objects for checkpoint", "version", version, "error", err)
 			return fmt.Errorf("failed to list objects for version %d: %w", version, err)
@@ -328,5 +603,51 @@ func (c *S3Checkpointer) deleteOldCheckpoints(logger *slog.Logger, ctx context.C
 		logger.Info("s3_checkpointer: checkpoint deletion successful", "version", version)
 	}
 
+	return c.deleteUnreferencedSharedFiles(logger, ctx)
+}
+
+func (c *S3Checkpointer) deleteUnreferencedSharedFiles(logger *slog.Logger, ctx context.Context) error {
+	objs, err := c.listObjects(ctx, checkpointsPrefix+"/")
+	if err != nil {
+		return fmt.Errorf("failed to list objects in bucket %s: %w", c.bucket, err)
+	}
+
+	referenced := make(map[string]struct{})
+	for _, obj := range objs {
+		if !manifestRe.MatchString(obj) {
+			continue
+		}
+		manifest, err := c.readManifest(ctx, obj)
+		if err != nil {
+			return err
+		}
+		for _, file := range manifest.SharedFiles {
+			referenced[file.Key] = struct{}{}
+		}
+	}
+
+	nDeleted := 0
+	for _, obj := range objs {
+		if !strings.HasPrefix(obj, sharedFilesPrefix+"/") {
+			continue
+		}
+		if _, ok := referenced[obj]; ok {
+			continue
+		}
+
+		if _, err := c.client.DeleteObject(ctx, &s3.DeleteObjectInput{
+			Bucket: aws.String(c.bucket),
+			Key:    aws.String(obj),
+		}); err != nil {
+			logger.Error("s3_checkpointer: failed to delete shared file", "bucket", c.bucket, "key", obj, "error", err)
+			return fmt.Errorf("failed to delete object %s from s3://%s/%s: %w", obj, c.bucket, obj, err)
+		}
+		nDeleted++
+	}
+
+	if nDeleted > 0 {
+		logger.Info("s3_checkpointer: deleted unreferenced shared files", "n_deleted", nDeleted)
+	}
+
 	return nil
 }
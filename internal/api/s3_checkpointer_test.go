@@ -160,4 +160,85 @@ func TestS3Checkpointer(t *testing.T) {
 		assert.ElementsMatch(t, []api.Version{1, 3, 4}, ckpts2)
 	})
 
+	listSharedFiles := func(t *testing.T) []string {
+		paginator := s3.NewListObjectsV2Paginator(s3client, &s3.ListObjectsV2Input{
+			Bucket: aws.String(bucketName),
+			Prefix: aws.String("checkpoints/shared/"),
+		})
+		keys := []string{}
+		for paginator.HasMorePages() {
+			page, err := paginator.NextPage(ctx)
+			require.NoError(t, err)
+			for _, obj := range page.Contents {
+				keys = append(keys, *obj.Key)
+			}
+		}
+		return keys
+	}
+
+	t.Run("Incremental Checkpoints", func(t *testing.T) {
+		writeFile(t, filepath.Join(localDir, "5/model/000001.sst"), "sst 1 data")
+		writeFile(t, filepath.Join(localDir, "5/model/MANIFEST"), "manifest 5")
+		assert.NoError(t, checkpointer.Upload(slog.Default(), api.Version(5), filepath.Join(localDir, "5"), nil))
+		assert.Len(t, listSharedFiles(t), 1)
+
+		writeFile(t, filepath.Join(localDir, "6/model/MANIFEST"), "manifest 6")
+		require.NoError(t, os.Link(filepath.Join(localDir, "5/model/000001.sst"), filepath.Join(localDir, "6/model/000001.sst")))
+		writeFile(t, filepath.Join(localDir, "6/model/000002.sst"), "sst 2 data")
+		assert.NoError(t, checkpointer.Upload(slog.Default(), api.Version(6), filepath.Join(localDir, "6"), nil))
+		assert.Len(t, listSharedFiles(t), 2) // 000001.sst is not uploaded again
+
+		assert.NoError(t, checkpointer.Download(slog.Default(), api.Version(6), filepath.Join(localDir, "6_download")))
+		for _, file := range []string{"model/MANIFEST", "model/000001.sst", "model/000002.sst"} {
+			assertSameFileContent(t, filepath.Join(localDir, "6_download", file), filepath.Join(localDir, "6", file))
+		}
+		_, err := os.Stat(filepath.Join(localDir, "6_download", "checkpoint_manifest.json"))
+		assert.True(t, os.IsNotExist(err))
+
+		for _, version := range []api.Version{7, 8, 9} {
+			dir := filepath.Join(localDir, fmt.Sprint(version))
+			writeFile(t, filepath.Join(dir, "model/MANIFEST"), fmt.Sprintf("manifest %d", version))
+			writeFile(t, filepath.Join(dir, "model/000002.sst"), "sst 2 data")
+			assert.NoError(t, checkpointer.Upload(slog.Default(), version, dir, nil))
+		}
+
+		ckpts, err := checkpointer.List(slog.Default())
+		require.NoError(t, err)
+		assert.ElementsMatch(t, []api.Version{7, 8, 9}, ckpts)
+
+		// 000001.sst is no longer referenced by any checkpoint once checkpoint 6 is deleted.
+		assert.Len(t, listSharedFiles(t), 1)
+
+		assert.NoError(t, checkpointer.Download(slog.Default(), api.Version(9), filepath.Join(localDir, "9_download")))
+		assertSameFileContent(t, filepath.Join(localDir, "9_download", "model/000002.sst"), filepath.Join(localDir, "9", "model/000002.sst"))
+	})
+	t.Run("Incremental Download", func(t *testing.T) {
+		writeFile(t, filepath.Join(localDir, "10/model/MANIFEST"), "manifest 10")
+		writeFile(t, filepath.Join(localDir, "10/model/000003.sst"), "sst 3 data")
+		assert.NoError(t, checkpointer.Upload(slog.Default(), api.Version(10), filepath.Join(localDir, "10"), nil))
+
+		assert.NoError(t, checkpointer.Download(slog.Default(), api.Version(9), filepath.Join(localDir, "9_incremental")))
+		assert.NoError(t, checkpointer.Download(slog.Default(), api.Version(10), filepath.Join(localDir, "10_incremental")))
+
+		writeFile(t, filepath.Join(localDir, "11/model/MANIFEST"), "manifest 11")
+		writeFile(t, filepath.Join(localDir, "11/model/000002.sst"), "sst 2 data")
+		writeFile(t, filepath.Join(localDir, "11/model/000003.sst"), "sst 3 data")
+		assert.NoError(t, checkpointer.Upload(slog.Default(), api.Version(11), filepath.Join(localDir, "11"), nil))
+
+		// Simulate the follower removing the older version once it loads the newer one.
+		require.NoError(t, os.RemoveAll(filepath.Join(localDir, "9_incremental")))
+
+		assert.NoError(t, checkpointer.Download(slog.Default(), api.Version(11), filepath.Join(localDir, "11_incremental")))
+
+		for _, file := range []string{"model/MANIFEST", "model/000002.sst", "model/000003.sst"} {
+			assertSameFileContent(t, filepath.Join(localDir, "11_incremental", file), filepath.Join(localDir, "11", file))
+		}
+
+		// 000003.sst is unchanged from the previous download, so it is linked instead of downloaded.
+		prev, err := os.Stat(filepath.Join(localDir, "10_incremental", "model/000003.sst"))
+		require.NoError(t, err)
+		curr, err := os.Stat(filepath.Join(localDir, "11_incremental", "model/000003.sst"))
+		require.NoError(t, err)
+		assert.True(t, os.SameFile(prev, curr))
+	})
 }
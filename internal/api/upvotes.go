@@ -0,0 +1,150 @@
+package api
+
+import (
+	"ndb-server/internal/ndb"
+	"sync"
+)
+
+// The maximum number of queries finetuned in a single batch, upvote requests
+// are coalesced until the batch would exceed this size.
+const maxUpvoteBatchSize = 10000
+
+type upvoteRequest struct {
+	queries []string
+	labels  []uint64
+	done    chan error
+	// lead is signaled when the request should start applying the queued upvotes.
+	lead chan struct{}
+}
+
+// upvoteQueue coalesces concurrent upvote requests into larger finetuning
+// batches. Requests still return once their upvotes are applied. Batches are
+// applied by the request at the front of the queue: while a batch is applied,
+// later requests queue up and are applied together in the next batch. Once a
+// request's upvotes are applied it hands off applying any remaining requests to
+// the request at the front of the queue.
+type upvoteQueue struct {
+	lock sync.Mutex
+
+	pending  []*upvoteRequest
+	applying bool
+	apply    func(queries []string, labels []uint64) error
+
+	nPendingQueries int
+	nRequests       uint64
+	nBatches        uint64
+}
+
+func newUpvoteQueue(apply func(queries []string, labels []uint64) error) *upvoteQueue {
+	return &upvoteQueue{apply: apply}
+}
+
+func (q *upvoteQueue) submit(queries []string, labels []uint64) error {
+	req := &upvoteRequest{
+		queries: queries,
+		labels:  labels,
+		done:    make(chan error, 1),
+		lead:    make(chan struct{}, 1),
+	}
+
+	q.lock.Lock()
+	q.pending = append(q.pending, req)
+	q.nPendingQueries += len(queries)
+	q.nRequests++
+	if q.applying {
+		q.lock.Unlock()
+		select {
+		case err := <-req.done:
+			return err
+		case <-req.lead:
+		}
+	} else {
+		q.applying = true
+		q.lock.Unlock()
+	}
+
+	for {
+		q.lock.Lock()
+		batch := q.takeBatchLocked()
+		q.lock.Unlock()
+
+		q.applyBatch(batch)
+
+		select {
+		case err := <-req.done:
+			q.lock.Lock()
+			if len(q.pending) > 0 {
+				q.pending[0].lead <- struct{}{}
+			} else {
+				q.applying = false
+			}
+			q.lock.Unlock()
+			return err
+		default:
+		}
+	}
+}
+
+func (q *upvoteQueue) takeBatchLocked() []*upvoteRequest {
+	n, size := 0, 0
+	for n < len(q.pending) && (n == 0 || size+len(q.pending[n].queries) <= maxUpvoteBatchSize) {
+		size += len(q.pending[n].queries)
+		n++
+	}
+
+	batch := q.pending[:n:n]
+	q.pending = q.pending[n:]
+	q.nPendingQueries -= size
+	q.nBatches++
+	return batch
+}
+
+func (q *upvoteQueue) applyBatch(batch []*upvoteRequest) {
+	// Requests with invalid arguments fail on their own, so that they do not
+	// cause the other requests in the batch to fail.
+	valid := make([]*upvoteRequest, 0, len(batch))
+	for _, req := range batch {
+		if err := ndb.CheckFinetuneArgs(req.queries, req.labels); err != nil {
+			req.done <- err
+		} else {
+			valid = append(valid, req)
+		}
+	}
+
+	if len(valid) == 0 {
+		return
+	}
+
+	var queries []string
+	var labels []uint64
+	for _, req := range valid {
+		queries = append(queries, req.queries...)
+		labels = append(labels, req.labels...)
+	}
+
+	// Once the arguments are checked, finetuning only fails if the ndb cannot be
+	// written, which is not caused by any one request. The requests are not
+	// retried individually, since upvotes that were written before the error
+	// would be applied twice.
+	err := q.apply(queries, labels)
+	for _, req := range valid {
+		req.done <- err
+	}
+}
+
+type upvoteQueueStats struct {
+	pendingQueries int
+	requests       uint64
+	batches        uint64
+}
+
+func (q *upvoteQueue) stats() upvoteQueueStats {
+	q.lock.Lock()
+	defer q.lock.Unlock()
+
+	return upvoteQueueStats{
+		pendingQueries: q.nPendingQueries,
+		requests:       q.nRequests,
+		batches:        q.nBatches,
+	}
+}
@@ -0,0 +1,66 @@
+package api
+
+import (
+	"ndb-server/internal/ndb"
+	"sync"
+)
+
+// queryRecorder holds the most recent searches, which are replayed on a newly
+// loaded checkpoint before it starts serving queries, so that the first searches
+// after the swap do not all read from a cold RocksDB instance.
+type queryRecorder struct {
+	lock sync.Mutex
+
+	queries []ndb.BatchQuery
+	next    int
+	full    bool
+}
+
+func newQueryRecorder(maxQueries int) *queryRecorder {
+	return &queryRecorder{queries: make([]ndb.BatchQuery, maxQueries)}
+}
+
+func (r *queryRecorder) record(query ndb.BatchQuery) {
+	if r == nil {
+		return
+	}
+
+	r.lock.Lock()
+	defer r.lock.Unlock()
+
+	r.queries[r.next] = query
+	r.next++
+	if r.next == len(r.queries) {
+		r.next = 0
+		r.full = true
+	}
+}
+
+type recordedQueryKey struct {
+	topk        int
+	query       string
+	constraints string
+}
+
+// recent returns the distinct recorded queries, most recent first.
+func (r *queryRecorder) recent() []ndb.BatchQuery {
+	r.lock.Lock()
+	defer r.lock.Unlock()
+
+	n := r.next
+	if r.full {
+		n = len(r.queries)
+	}
+
+	recent := make([]ndb.BatchQuery, 0, n)
+	seen := make(map[recordedQueryKey]bool, n)
+	for i := 1; i <= n; i++ {
+		query := r.queries[(r.next-i+len(r.queries))%len(r.queries)]
+		key := recordedQueryKey{topk: query.TopK, query: query.Query, constraints: query.Constraints.Key()}
+		if !seen[key] {
+			seen[key] = true
+			recent = append(recent, query)
+		}
+	}
+	return recent
+}
@@ -0,0 +1,357 @@
+package ndb_test
+
+import (
+	"bufio"
+	"flag"
+	"fmt"
+	"math/rand"
+	"ndb-server/internal/ndb"
+	"os"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// The benchmarks are run with
+//
+//	go test -run '^$' -bench . ./internal/ndb -bench-chunks 10000,1000000
+//
+// The output is in the standard benchmark format, which can be compared across
+// runs with benchstat, or passed through go test -json. The corpora are
+// generated from a fixed seed so that runs with the same sizes are comparable.
+var benchChunks = flag.String("bench-chunks", "10000", "comma separated sizes of the synthetic corpora used by the benchmarks")
+
+const (
+	benchVocabSize     = 50000
+	benchChunkWords    = 40
+	benchQueryWords    = 5
+	benchDocChunks     = 10000
+	benchNQueries      = 1000
+	benchNCategories   = 100
+	benchInsertChunks  = 1000
+	benchCorpusSeed    = 42
+	benchQueriesSeed   = 43
+	benchInsertDocSeed = 44
+)
+
+// benchText generates text from a zipfian distribution over the vocabulary, so
+// that the token frequencies resemble those of natural text.
+type benchText struct {
+	zipf *rand.Zipf
+}
+
+func newBenchText(seed int64) *benchText {
+	rng := rand.New(rand.NewSource(seed))
+	return &benchText{zipf: rand.NewZipf(rng, 1.1, 1, benchVocabSize-1)}
+}
+
+func (t *benchText) words(n int) string {
+	words := make([]string, n)
+	for i := range words {
+		words[i] = "w" + strconv.FormatUint(t.zipf.Uint64(), 36)
+	}
+	return strings.Join(words, " ")
+}
+
+func (t *benchText) document(firstChunk, nChunks int) ([]string, []map[string]interface{}) {
+	chunks := make([]string, nChunks)
+	metadata := make([]map[string]interface{}, nChunks)
+	for i := range chunks {
+		chunks[i] = t.words(benchChunkWords)
+		id := firstChunk + i
+		metadata[i] = map[string]interface{}{"category": id % benchNCategories, "even": id%2 == 0}
+	}
+	return chunks, metadata
+}
+
+func benchSizes(b *testing.B) []int {
+	sizes := []int{}
+	for _, size := range strings.Split(*benchChunks, ",") {
+		n, err := strconv.Atoi(strings.TrimSpace(size))
+		if err != nil || n <= 0 {
+			b.Fatalf("invalid corpus size %q", size)
+		}
+		sizes = append(sizes, n)
+	}
+	return sizes
+}
+
+func benchOptions() ndb.Options {
+	options := ndb.DefaultOptions()
+	// The queries are repeated across iterations, caching their results would
+	// measure the cache instead of the engine.
+	options.QueryCacheSize = 0
+	return options
+}
+
+// The ndbs with the synthetic corpora by number of chunks. Generating large
+// corpora is slow, so each size is generated once and shared by all of the
+// benchmarks, which must not modify them.
+var (
+	benchCorporaLock sync.Mutex
+	benchCorpora     = map[int]ndb.NeuralDB{}
+	benchDir         string
+)
+
+func loadBenchCorpus(b *testing.B, nChunks int) ndb.NeuralDB {
+	benchCorporaLock.Lock()
+	defer benchCorporaLock.Unlock()
+
+	if db, ok := benchCorpora[nChunks]; ok {
+		return db
+	}
+
+	if benchDir == "" {
+		dir, err := os.MkdirTemp("", "ndb_bench_")
+		if err != nil {
+			b.Fatal(err)
+		}
+		benchDir = dir
+	}
+
+	path := filepath.Join(benchDir, fmt.Sprintf("corpus_%d", nChunks))
+	db, err := ndb.NewWithOptions(path, benchOptions())
+	if err != nil {
+		b.Fatal(err)
+	}
+
+	start := time.Now()
+	text := newBenchText(benchCorpusSeed)
+	for first := 0; first < nChunks; first += benchDocChunks {
+		chunks, metadata := text.document(first, min(benchDocChunks, nChunks-first))
+		doc := fmt.Sprintf("doc_%d", first/benchDocChunks)
+		if err := db.Insert(doc, doc, chunks, metadata, nil); err != nil {
+			b.Fatal(err)
+		}
+	}
+	b.Logf("generated corpus of %d chunks in %v", nChunks, time.Since(start))
+
+	benchCorpora[nChunks] = db
+	return db
+}
+
+func TestMain(m *testing.M) {
+	code := m.Run()
+
+	for _, db := range benchCorpora {
+		db.Free()
+	}
+	if benchDir != "" {
+		os.RemoveAll(benchDir)
+	}
+
+	os.Exit(code)
+}
+
+func benchQueries() []string {
+	text := newBenchText(benchQueriesSeed)
+	queries := make([]string, benchNQueries)
+	for i := range queries {
+		queries[i] = text.words(benchQueryWords)
+	}
+	return queries
+}
+
+// reportRSS reports the resident and peak resident memory of the process,
+// which includes the memory used by the engine and RocksDB outside of the Go
+// heap. It is only available on linux.
+func reportRSS(b *testing.B) {
+	file, err := os.Open("/proc/self/status")
+	if err != nil {
+		return
+	}
+	defer file.Close()
+
+	metrics := map[string]string{"VmRSS:": "rss_MB", "VmHWM:": "peak_rss_MB"}
+
+	scanner := bufio.NewScanner(file)
+	for scanner.Scan() {
+		fields := strings.Fields(scanner.Text())
+		if len(fields) < 2 {
+			continue
+		}
+		if unit, ok := metrics[fields[0]]; ok {
+			if kb, err := strconv.ParseFloat(fields[1], 64); err == nil {
+				b.ReportMetric(kb/1024, unit)
+			}
+		}
+	}
+}
+
+func BenchmarkQuery(b *testing.B) {
+	queries := benchQueries()
+
+	constraints := []struct {
+		name        string
+		constraints ndb.Constraints
+	}{
+		{name: "none", constraints: nil},
+		{name: "category", constraints: ndb.Constraints{"category": ndb.EqualTo(7)}},
+		{name: "category_and_even", constraints: ndb.Constraints{"category": ndb.LessThan(10), "even": ndb.EqualTo(true)}},
+	}
+
+	for _, size := range benchSizes(b) {
+		for _, constraint := range constraints {
+			for _, concurrency := range []int{1, 4, 16} {
+				name := fmt.Sprintf("chunks=%d/constraints=%s/concurrency=%d", size, constraint.name, concurrency)
+				b.Run(name, func(b *testing.B) {
+					db := loadBenchCorpus(b, size)
+
+					b.ResetTimer()
+					start := time.Now()
+
+					next := atomic.Int64{}
+					errs := make(chan error, concurrency)
+					wg := sync.WaitGroup{}
+					for w := 0; w < concurrency; w++ {
+						wg.Add(1)
+						go func() {
+							defer wg.Done()
+							for {
+								i := next.Add(1) - 1
+								if i >= int64(b.N) {
+									return
+								}
+								if _, err := db.Query(queries[i%benchNQueries], 10, constraint.constraints); err != nil {
+									errs <- err
+									return
+								}
+							}
+						}()
+					}
+					wg.Wait()
+
+					elapsed := time.Since(start)
+					b.StopTimer()
+
+					close(errs)
+					for err := range errs {
+						b.Fatal(err)
+					}
+
+					b.ReportMetric(float64(b.N)/elapsed.Seconds(), "queries/s")
+					reportRSS(b)
+				})
+			}
+		}
+	}
+}
+
+// BenchmarkQueryTopK measures how the query latency scales with top_k and the
+// size of the corpus. The lazy queries only convert the ids and scores of the
+// results, so the difference between the two is the cost of converting the
+// chunks.
+func BenchmarkQueryTopK(b *testing.B) {
+	queries := benchQueries()
+
+	for _, size := range benchSizes(b) {
+		for _, topk := range []int{10, 100, 1000} {
+			b.Run(fmt.Sprintf("chunks=%d/topk=%d", size, topk), func(b *testing.B) {
+				db := loadBenchCorpus(b, size)
+
+				nResults := 0
+				b.ResetTimer()
+				for i := 0; i < b.N; i++ {
+					results, err := db.Query(queries[i%benchNQueries], topk, nil)
+					if err != nil {
+						b.Fatal(err)
+					}
+					nResults += len(results)
+				}
+				b.StopTimer()
+
+				b.ReportMetric(float64(nResults)/float64(b.N), "results/op")
+			})
+
+			b.Run(fmt.Sprintf("chunks=%d/topk=%d/lazy", size, topk), func(b *testing.B) {
+				db := loadBenchCorpus(b, size)
+
+				b.ResetTimer()
+				for i := 0; i < b.N; i++ {
+					results, err := db.QueryLazy(queries[i%benchNQueries], topk, nil)
+					if err != nil {
+						b.Fatal(err)
+					}
+					results.Free()
+				}
+			})
+		}
+	}
+}
+
+func BenchmarkInsert(b *testing.B) {
+	db, err := ndb.NewWithOptions(b.TempDir(), benchOptions())
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer db.Free()
+
+	text := newBenchText(benchInsertDocSeed)
+
+	b.ResetTimer()
+	elapsed := time.Duration(0)
+	for i := 0; i < b.N; i++ {
+		chunks, metadata := text.document(i*benchInsertChunks, benchInsertChunks)
+		doc := fmt.Sprintf("doc_%d", i)
+
+		start := time.Now()
+		if err := db.Insert(doc, doc, chunks, metadata, nil); err != nil {
+			b.Fatal(err)
+		}
+		elapsed += time.Since(start)
+	}
+	b.StopTimer()
+
+	b.ReportMetric(float64(b.N*benchInsertChunks)/elapsed.Seconds(), "rows/s")
+	reportRSS(b)
+}
+
+func BenchmarkSave(b *testing.B) {
+	for _, size := range benchSizes(b) {
+		b.Run(fmt.Sprintf("chunks=%d", size), func(b *testing.B) {
+			db := loadBenchCorpus(b, size)
+			dir := b.TempDir()
+
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if err := db.Save(filepath.Join(dir, strconv.Itoa(i))); err != nil {
+					b.Fatal(err)
+				}
+			}
+			b.StopTimer()
+
+			reportRSS(b)
+		})
+	}
+}
+
+func BenchmarkLoad(b *testing.B) {
+	for _, size := range benchSizes(b) {
+		b.Run(fmt.Sprintf("chunks=%d", size), func(b *testing.B) {
+			db := loadBenchCorpus(b, size)
+			path := filepath.Join(b.TempDir(), "saved")
+			if err := db.Save(path); err != nil {
+				b.Fatal(err)
+			}
+
+			options := benchOptions()
+			options.ReadOnly = true
+
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				db, err := ndb.NewWithOptions(path, options)
+				if err != nil {
+					b.Fatal(err)
+				}
+				db.Free()
+			}
+			b.StopTimer()
+
+			reportRSS(b)
+		})
+	}
+}
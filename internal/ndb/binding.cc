@@ -1,18 +1,45 @@
 #include "binding.h"
 #include "OnDiskNeuralDB.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <omp.h>
 #include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using thirdai::search::ndb::AnyOf;
 using thirdai::search::ndb::Chunk;
+using thirdai::search::ndb::ChunkId;
+using thirdai::search::ndb::Constraint;
+using thirdai::search::ndb::DocId;
 using thirdai::search::ndb::EqualTo;
 using thirdai::search::ndb::GreaterThan;
+using thirdai::search::ndb::InsertMetadata;
 using thirdai::search::ndb::LessThan;
 using thirdai::search::ndb::MetadataMap;
+using thirdai::search::ndb::MetadataType;
 using thirdai::search::ndb::MetadataValue;
 using thirdai::search::ndb::OnDiskNeuralDB;
 using thirdai::search::ndb::QueryConstraints;
@@ -61,6 +88,10 @@ struct Document_t {
   std::string document;
   std::string doc_id;
   std::optional<uint32_t> doc_version;
+  // Optional, if present there is one embedding of embedding_dim floats for
+  // each chunk.
+  std::vector<float> embeddings;
+  unsigned int embedding_dim = 0;
 };
 
 Document_t *Document_new(const char *document, const char *doc_id) {
@@ -73,61 +104,244 @@ Document_t *Document_new(const char *document, const char *doc_id) {
 
 void Document_free(Document_t *doc) { delete doc; }
 
-void Document_add_chunk(Document_t *doc, const char *chunk) {
-  doc->chunks.emplace_back(chunk);
-  doc->metadata.emplace_back();
+void Document_add_chunks(Document_t *doc, const char *chunks,
+                         const unsigned long long *offsets, unsigned int n) {
+  doc->chunks.reserve(doc->chunks.size() + n);
+  for (unsigned int i = 0; i < n; i++) {
+    doc->chunks.emplace_back(chunks + offsets[i], chunks + offsets[i + 1]);
+  }
+  doc->metadata.resize(doc->chunks.size());
 }
 
 void Document_set_version(Document_t *doc, unsigned int version) {
   doc->doc_version = version;
 }
 
-void Document_add_metadata(Document_t *doc, unsigned int i, const char *key,
-                           const MetadataValue_t *value) {
-  doc->metadata.at(i)[key] = value->value;
+void Document_add_embeddings(Document_t *doc, const float *embeddings,
+                             unsigned int n, unsigned int dim) {
+  doc->embeddings.insert(doc->embeddings.end(), embeddings,
+                         embeddings + size_t(n) * dim);
+  doc->embedding_dim = dim;
 }
 
-struct MetadataList_t {
-  std::vector<std::pair<std::string, MetadataValue>> metadata;
-};
+MetadataValue cellValue(const MetadataCell_t &cell, const char *values) {
+  switch (MetadataType(cell.type)) {
+  case MetadataType::Bool:
+    return MetadataValue::Bool(cell.bool_value);
+  case MetadataType::Int:
+    return MetadataValue::Int(cell.int_value);
+  case MetadataType::Float:
+    return MetadataValue::Float(cell.float_value);
+  case MetadataType::Str:
+    return MetadataValue::Str(std::string(values + cell.str_offset,
+                                          values + cell.str_offset +
+                                              cell.str_len));
+  default:
+    throw std::invalid_argument("invalid metadata type " +
+                                std::to_string(cell.type));
+  }
+}
 
-void MetadataList_free(MetadataList_t *metadata) { delete metadata; }
+void Document_add_metadata_block(Document_t *doc, const char *keys,
+                                 const unsigned int *key_offsets,
+                                 unsigned int n_keys,
+                                 const MetadataCell_t *cells,
+                                 unsigned int n_cells, const char *values,
+                                 const char **err_ptr) {
+  try {
+    std::vector<std::string> key_dict;
+    key_dict.reserve(n_keys);
+    for (unsigned int i = 0; i < n_keys; i++) {
+      key_dict.emplace_back(keys + key_offsets[i], keys + key_offsets[i + 1]);
+    }
 
-unsigned int MetadataList_len(MetadataList_t *metadata) {
-  return metadata->metadata.size();
-}
+    // The cells are checked before any are applied so that the document is
+    // unchanged if the block is invalid.
+    for (unsigned int i = 0; i < n_cells; i++) {
+      const auto &cell = cells[i];
+      if (cell.chunk >= doc->metadata.size()) {
+        throw std::out_of_range("metadata chunk index " +
+                                std::to_string(cell.chunk) +
+                                " is out of range for document with " +
+                                std::to_string(doc->metadata.size()) +
+                                " chunks");
+      }
+      if (cell.key >= n_keys) {
+        throw std::out_of_range("metadata key index is out of range");
+      }
+    }
 
-const char *MetadataList_key(MetadataList_t *metadata, unsigned int i) {
-  return metadata->metadata.at(i).first.c_str();
+    for (unsigned int i = 0; i < n_cells; i++) {
+      const auto &cell = cells[i];
+      doc->metadata[cell.chunk][key_dict[cell.key]] = cellValue(cell, values);
+    }
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return;
+  }
 }
 
-int MetadataList_type(MetadataList_t *metadata, unsigned int i) {
-  return int(metadata->metadata.at(i).second.type());
-}
+struct Constraints_t {
+  QueryConstraints constraints;
+  // A canonical encoding of each constraint, this is used as part of the key of
+  // the query cache. This is ordered so that the key does not depend on the
+  // order the constraints are added in.
+  std::map<std::string, std::string> cache_keys;
+};
 
-bool MetadataList_bool(MetadataList_t *metadata, unsigned int i) {
-  return metadata->metadata.at(i).second.asBool();
-}
+Constraints_t *Constraints_new() { return new Constraints_t(); }
 
-int MetadataList_int(MetadataList_t *metadata, unsigned int i) {
-  return metadata->metadata.at(i).second.asInt();
-}
+void Constraints_free(Constraints_t *constraints) { delete constraints; }
 
-float MetadataList_float(MetadataList_t *metadata, unsigned int i) {
-  return metadata->metadata.at(i).second.asFloat();
+// The constraint classes in Constraints.h hold a MetadataValue and compare
+// variants for every candidate. The constraints below are specialized for the
+// type of the constraint value when the constraint is built, so that matching
+// is a type check followed by a direct comparison.
+template <typename T> decltype(auto) valueAs(const MetadataValue &value) {
+  if constexpr (std::is_same_v<T, bool>) {
+    return value.asBool();
+  } else if constexpr (std::is_same_v<T, int>) {
+    return value.asInt();
+  } else if constexpr (std::is_same_v<T, float>) {
+    return value.asFloat();
+  } else {
+    return value.asStr();
+  }
 }
 
-const char *MetadataList_str(MetadataList_t *metadata, unsigned int i) {
-  return metadata->metadata.at(i).second.asStr().c_str();
+template <typename T, typename Compare>
+class TypedCompare final : public Constraint {
+public:
+  TypedCompare(MetadataType type, T value)
+      : _type(type), _value(std::move(value)) {}
+
+  bool matches(const MetadataValue &value) const final {
+    return value.type() == _type && Compare{}(valueAs<T>(value), _value);
+  }
+
+private:
+  MetadataType _type;
+  T _value;
+};
+
+// Generic is the constraint from Constraints.h that is used for values that do
+// not have a specialization.
+template <template <typename> typename Compare, typename Generic>
+std::shared_ptr<Constraint> makeTypedCompare(const MetadataValue &value) {
+  switch (value.type()) {
+  case MetadataType::Bool:
+    return std::make_shared<TypedCompare<bool, Compare<bool>>>(
+        MetadataType::Bool, value.asBool());
+  case MetadataType::Int:
+    return std::make_shared<TypedCompare<int, Compare<int>>>(MetadataType::Int,
+                                                             value.asInt());
+  case MetadataType::Float:
+    return std::make_shared<TypedCompare<float, Compare<float>>>(
+        MetadataType::Float, value.asFloat());
+  case MetadataType::Str:
+    return std::make_shared<TypedCompare<std::string, Compare<std::string>>>(
+        MetadataType::Str, value.asStr());
+  default:
+    return Generic::make(value);
+  }
 }
 
-struct Constraints_t {
-  QueryConstraints constraints;
+class StrSubstring final : public Constraint {
+public:
+  explicit StrSubstring(std::string value) : _value(std::move(value)) {}
+
+  bool matches(const MetadataValue &value) const final {
+    return value.type() == MetadataType::Str &&
+           value.asStr().find(_value) != std::string::npos;
+  }
+
+private:
+  std::string _value;
 };
 
-Constraints_t *Constraints_new() { return new Constraints_t(); }
+// AnyOf in Constraints.h does a linear scan of the values, which is faster for
+// short lists, above this size the values are stored in hash sets instead.
+const int AnyOfHashThreshold = 16;
 
-void Constraints_free(Constraints_t *constraints) { delete constraints; }
+class AnyOfSet final : public Constraint {
+public:
+  explicit AnyOfSet(const std::vector<MetadataValue> &values) {
+    for (const auto &value : values) {
+      switch (value.type()) {
+      case MetadataType::Bool:
+        (value.asBool() ? _true : _false) = true;
+        break;
+      case MetadataType::Int:
+        _ints.insert(value.asInt());
+        break;
+      case MetadataType::Float:
+        _floats.insert(value.asFloat());
+        break;
+      case MetadataType::Str:
+        _strs.insert(value.asStr());
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  bool matches(const MetadataValue &value) const final {
+    switch (value.type()) {
+    case MetadataType::Bool:
+      return value.asBool() ? _true : _false;
+    case MetadataType::Int:
+      return _ints.count(value.asInt());
+    case MetadataType::Float:
+      return _floats.count(value.asFloat());
+    case MetadataType::Str:
+      return _strs.count(value.asStr());
+    default:
+      return false;
+    }
+  }
+
+private:
+  bool _true = false, _false = false;
+  std::unordered_set<int> _ints;
+  std::unordered_set<float> _floats;
+  std::unordered_set<std::string> _strs;
+};
+
+void appendBytes(std::string &out, const void *data, size_t len) {
+  out.append(static_cast<const char *>(data), len);
+}
+
+void appendLenPrefixed(std::string &out, const std::string &value) {
+  uint32_t len = value.size();
+  appendBytes(out, &len, sizeof(len));
+  out.append(value);
+}
+
+std::string encodeValue(const MetadataValue &value) {
+  std::string out(1, char(value.type()));
+  switch (value.type()) {
+  case MetadataType::Bool:
+    out.push_back(value.asBool());
+    break;
+  case MetadataType::Int: {
+    int v = value.asInt();
+    appendBytes(out, &v, sizeof(v));
+    break;
+  }
+  case MetadataType::Float: {
+    float v = value.asFloat();
+    appendBytes(out, &v, sizeof(v));
+    break;
+  }
+  case MetadataType::Str:
+    appendLenPrefixed(out, value.asStr());
+    break;
+  default:
+    break;
+  }
+  return out;
+}
 
 const int BinaryConstraintEq = 0;
 const int BinaryConstraintLt = 1;
@@ -137,18 +351,28 @@ const int BinaryConstraintSubstr = 3;
 void Constraints_add_binary_constraint(Constraints_t *constraints, int op,
                                        const char *key,
                                        const MetadataValue_t *value) {
+  constraints->cache_keys[key] = char(op) + encodeValue(value->value);
+
   switch (op) {
   case BinaryConstraintEq:
-    constraints->constraints[key] = EqualTo::make(value->value);
+    constraints->constraints[key] =
+        makeTypedCompare<std::equal_to, EqualTo>(value->value);
     break;
   case BinaryConstraintLt:
-    constraints->constraints[key] = LessThan::make(value->value);
+    constraints->constraints[key] =
+        makeTypedCompare<std::less, LessThan>(value->value);
     break;
   case BinaryConstraintGt:
-    constraints->constraints[key] = GreaterThan::make(value->value);
+    constraints->constraints[key] =
+        makeTypedCompare<std::greater, GreaterThan>(value->value);
     break;
   case BinaryConstraintSubstr:
-    constraints->constraints[key] = Substring::make(value->value);
+    if (value->value.type() == MetadataType::Str) {
+      constraints->constraints[key] =
+          std::make_shared<StrSubstring>(value->value.asStr());
+    } else {
+      constraints->constraints[key] = Substring::make(value->value);
+    }
     break;
   }
 }
@@ -157,53 +381,257 @@ void Constraints_add_any_of_constraint(Constraints_t *constraints,
                                        const char *key,
                                        const MetadataValue_t **values, int n) {
   std::vector<MetadataValue> value_vec;
+  std::vector<std::string> encoded(n);
   value_vec.reserve(n);
   for (int i = 0; i < n; ++i) {
     value_vec.push_back(values[i]->value);
+    encoded[i] = encodeValue(values[i]->value);
   }
 
-  constraints->constraints[key] = AnyOf::make(std::move(value_vec));
+  // The order of the values does not change which chunks match.
+  std::sort(encoded.begin(), encoded.end());
+  std::string cache_key = "a";
+  for (const auto &value : encoded) {
+    appendLenPrefixed(cache_key, value);
+  }
+  constraints->cache_keys[key] = std::move(cache_key);
+
+  if (n > AnyOfHashThreshold) {
+    constraints->constraints[key] = std::make_shared<AnyOfSet>(value_vec);
+  } else {
+    constraints->constraints[key] = AnyOf::make(std::move(value_vec));
+  }
 }
 
+// The results are serialized into entries, metadata, and data once the query
+// completes so that they can be read from Go without a cgo call per field.
 struct QueryResults_t {
-  std::vector<std::pair<Chunk, float>> results;
+  std::vector<QueryResultEntry_t> entries;
+  std::vector<MetadataEntry_t> metadata;
+  std::vector<MetadataKey_t> keys;
+  std::string data;
+  QueryTimings_t timings{};
+
+  unsigned int appendData(const std::string &value) {
+    unsigned int offset = data.size();
+    data.append(value);
+    return offset;
+  }
+
+  // The approximate memory used by the results.
+  size_t bytes() const {
+    return sizeof(QueryResults_t) + data.size() +
+           entries.size() * sizeof(QueryResultEntry_t) +
+           metadata.size() * sizeof(MetadataEntry_t) +
+           keys.size() * sizeof(MetadataKey_t);
+  }
+
+  // Returns the offset of the value in data, the document and doc_id of
+  // chunks from the same document are only stored once.
+  unsigned int appendDocString(
+      const std::string &value,
+      std::unordered_map<std::string_view, unsigned int> &doc_strings) {
+    auto [it, inserted] = doc_strings.emplace(value, 0);
+    if (inserted) {
+      it->second = appendData(value);
+    }
+    return it->second;
+  }
+
+  void serialize(const std::vector<std::pair<Chunk, float>> &results) {
+    // The key strings are owned by the chunks in results, which outlive this
+    // map.
+    std::unordered_map<std::string_view, unsigned int> key_ids;
+    // Maps document names and doc ids to their offset in data.
+    std::unordered_map<std::string_view, unsigned int> doc_strings;
+
+    size_t data_size = 0, n_metadata = 0;
+    for (const auto &[chunk, _] : results) {
+      data_size += chunk.text.size();
+      for (const auto *doc_string : {&chunk.document, &chunk.doc_id}) {
+        if (doc_strings.emplace(*doc_string, 0).second) {
+          data_size += doc_string->size();
+        }
+      }
+      for (const auto &[key, value] : chunk.metadata) {
+        if (key_ids.emplace(key, key_ids.size()).second) {
+          data_size += key.size();
+        }
+        if (value.type() == MetadataType::Str) {
+          data_size += value.asStr().size();
+        }
+      }
+      n_metadata += chunk.metadata.size();
+    }
+
+    if (data_size > std::numeric_limits<unsigned int>::max()) {
+      throw std::length_error("query results exceed maximum buffer size");
+    }
+
+    doc_strings.clear();
+
+    data.reserve(data_size);
+    entries.reserve(results.size());
+    metadata.reserve(n_metadata);
+
+    keys.resize(key_ids.size());
+    for (const auto &[key, id] : key_ids) {
+      keys[id].offset = data.size();
+      keys[id].len = key.size();
+      data.append(key);
+    }
+
+    for (const auto &[chunk, score] : results) {
+      QueryResultEntry_t entry{};
+      entry.id = chunk.id;
+      entry.score = score;
+      entry.doc_version = chunk.doc_version;
+      entry.text_offset = appendData(chunk.text);
+      entry.text_len = chunk.text.size();
+      entry.document_offset = appendDocString(chunk.document, doc_strings);
+      entry.document_len = chunk.document.size();
+      entry.doc_id_offset = appendDocString(chunk.doc_id, doc_strings);
+      entry.doc_id_len = chunk.doc_id.size();
+      entry.metadata_offset = metadata.size();
+      entry.metadata_len = chunk.metadata.size();
+
+      for (const auto &[key, value] : chunk.metadata) {
+        MetadataEntry_t meta{};
+        meta.key = key_ids.at(key);
+        meta.type = int(value.type());
+        switch (value.type()) {
+        case MetadataType::Bool:
+          meta.bool_value = value.asBool();
+          break;
+        case MetadataType::Int:
+          meta.int_value = value.asInt();
+          break;
+        case MetadataType::Float:
+          meta.float_value = value.asFloat();
+          break;
+        case MetadataType::Str:
+          meta.str_offset = appendData(value.asStr());
+          meta.str_len = value.asStr().size();
+          break;
+        default:
+          break;
+        }
+        metadata.push_back(meta);
+      }
+
+      entries.push_back(entry);
+    }
+  }
 };
 
 void QueryResults_free(QueryResults_t *results) { delete results; }
 
-unsigned int QueryResults_len(QueryResults_t *results) {
+QueryTimings_t QueryResults_timings(QueryResults_t *results) {
+  return results->timings;
+}
+
+QueryResultsView_t QueryResults_view(QueryResults_t *results) {
+  return QueryResultsView_t{
+      /*entries=*/results->entries.data(),
+      /*n_entries=*/static_cast<unsigned int>(results->entries.size()),
+      /*metadata=*/results->metadata.data(),
+      /*n_metadata=*/static_cast<unsigned int>(results->metadata.size()),
+      /*keys=*/results->keys.data(),
+      /*n_keys=*/static_cast<unsigned int>(results->keys.size()),
+      /*data=*/results->data.data(),
+      /*data_len=*/static_cast<unsigned int>(results->data.size()),
+  };
+}
+
+struct BatchQueryResults_t {
+  std::vector<QueryResults_t> results;
+  // std::vector<bool> is not used since the entries are written concurrently.
+  std::vector<char> completed;
+};
+
+void BatchQueryResults_free(BatchQueryResults_t *results) { delete results; }
+
+unsigned int BatchQueryResults_len(BatchQueryResults_t *results) {
   return results->results.size();
 }
 
-unsigned long long QueryResults_id(QueryResults_t *results, unsigned int i) {
-  return results->results.at(i).first.id;
+QueryResults_t *BatchQueryResults_get(BatchQueryResults_t *results,
+                                      unsigned int i) {
+  return &results->results.at(i);
 }
 
-const char *QueryResults_text(QueryResults_t *results, unsigned int i) {
-  return results->results.at(i).first.text.c_str();
+bool BatchQueryResults_completed(BatchQueryResults_t *results,
+                                 unsigned int i) {
+  return results->completed.at(i);
 }
 
-const char *QueryResults_document(QueryResults_t *results, unsigned int i) {
-  return results->results.at(i).first.document.c_str();
+struct QueryDeadline_t {
+  std::optional<std::chrono::steady_clock::time_point> expiry;
+  std::atomic<bool> cancelled{false};
+
+  bool expired() const {
+    return cancelled.load(std::memory_order_relaxed) ||
+           (expiry && std::chrono::steady_clock::now() >= *expiry);
+  }
+};
+
+QueryDeadline_t *QueryDeadline_new(unsigned long long timeout_ns) {
+  auto deadline = std::make_unique<QueryDeadline_t>();
+  if (timeout_ns > 0) {
+    deadline->expiry = std::chrono::steady_clock::now() +
+                       std::chrono::nanoseconds(timeout_ns);
+  }
+  return deadline.release();
 }
 
-const char *QueryResults_doc_id(QueryResults_t *results, unsigned int i) {
-  return results->results.at(i).first.doc_id.c_str();
+void QueryDeadline_free(QueryDeadline_t *deadline) { delete deadline; }
+
+void QueryDeadline_cancel(QueryDeadline_t *deadline) {
+  deadline->cancelled.store(true, std::memory_order_relaxed);
 }
 
-unsigned int QueryResults_doc_version(QueryResults_t *results, unsigned int i) {
-  return results->results.at(i).first.doc_version;
+bool QueryDeadline_expired(const QueryDeadline_t *deadline) {
+  return deadline->expired();
 }
 
-float QueryResults_score(QueryResults_t *results, unsigned int i) {
-  return results->results.at(i).second;
+class DeadlineExceeded final : public std::runtime_error {
+public:
+  DeadlineExceeded() : std::runtime_error("query deadline exceeded") {}
+};
+
+struct LazyQueryResults_t {
+  std::vector<std::pair<Chunk, float>> results;
+  std::vector<ScoredChunkId_t> ids;
+};
+
+void LazyQueryResults_free(LazyQueryResults_t *results) { delete results; }
+
+unsigned int LazyQueryResults_len(LazyQueryResults_t *results) {
+  return results->ids.size();
 }
 
-MetadataList_t *QueryResults_metadata(QueryResults_t *results, unsigned int i) {
-  const auto &metadata_map = results->results.at(i).first.metadata;
-  MetadataList_t *out = new MetadataList_t();
-  out->metadata = {metadata_map.begin(), metadata_map.end()};
-  return out;
+const ScoredChunkId_t *LazyQueryResults_ids(LazyQueryResults_t *results) {
+  return results->ids.data();
+}
+
+QueryResults_t *LazyQueryResults_materialize(LazyQueryResults_t *results,
+                                             const unsigned int *indices,
+                                             unsigned int n,
+                                             const char **err_ptr) {
+  try {
+    std::vector<std::pair<Chunk, float>> selected;
+    selected.reserve(n);
+    for (unsigned int i = 0; i < n; i++) {
+      selected.push_back(results->results.at(indices[i]));
+    }
+
+    auto out = std::make_unique<QueryResults_t>();
+    out->serialize(selected);
+    return out.release();
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return nullptr;
+  }
 }
 
 struct StringList_t {
@@ -215,6 +643,14 @@ void StringList_free(StringList_t *list) { delete list; }
 void StringList_append(StringList_t *list, const char *value) {
   list->list.emplace_back(value);
 }
+void StringList_append_packed(StringList_t *list, const char *values,
+                              const unsigned long long *offsets,
+                              unsigned int n) {
+  list->list.reserve(list->list.size() + n);
+  for (unsigned int i = 0; i < n; i++) {
+    list->list.emplace_back(values + offsets[i], values + offsets[i + 1]);
+  }
+}
 
 struct LabelList_t {
   std::vector<std::vector<uint64_t>> list;
@@ -225,38 +661,817 @@ void LabelList_free(LabelList_t *list) { delete list; }
 void LabelList_append(LabelList_t *list, unsigned long long value) {
   list->list.emplace_back(std::vector<uint64_t>{value});
 }
+void LabelList_append_packed(LabelList_t *list,
+                             const unsigned long long *labels,
+                             const unsigned long long *offsets,
+                             unsigned int n) {
+  list->list.reserve(list->list.size() + n);
+  for (unsigned int i = 0; i < n; i++) {
+    list->list.emplace_back(labels + offsets[i], labels + offsets[i + 1]);
+  }
+}
+
+using SourceList = std::shared_ptr<const std::vector<Source>>;
 
+// A range of a sorted list of sources. The list is shared with the sources
+// cache of the ndb, so creating a Sources_t does not copy the sources, and the
+// list remains valid after the ndb is modified or freed.
 struct Sources_t {
-  std::vector<Source> sources;
+  SourceList sources;
+  size_t begin;
+  size_t end;
+
+  const Source &at(unsigned int i) const {
+    if (i >= end - begin) {
+      throw std::out_of_range("source index out of range");
+    }
+    return (*sources)[begin + i];
+  }
 };
 
 void Sources_free(Sources_t *sources) { delete sources; }
 
-unsigned int Sources_len(Sources_t *sources) { return sources->sources.size(); }
+unsigned int Sources_len(Sources_t *sources) {
+  return sources->end - sources->begin;
+}
 
 const char *Sources_document(Sources_t *sources, unsigned int i) {
-  return sources->sources.at(i).document.c_str();
+  return sources->at(i).document.c_str();
 }
 
 const char *Sources_doc_id(Sources_t *sources, unsigned int i) {
-  return sources->sources.at(i).doc_id.c_str();
+  return sources->at(i).doc_id.c_str();
 }
 
 unsigned int Sources_doc_version(Sources_t *sources, unsigned int i) {
-  return sources->sources.at(i).doc_version;
+  return sources->at(i).doc_version;
+}
+
+// An LRU cache of serialized query results, bounded by the memory used by the
+// cached results. The cache has an epoch which is incremented each time the ndb
+// is modified, results are only added if the epoch has not changed since the
+// query started, so that results computed before a modification completed are
+// not cached after it completes.
+class QueryCache {
+public:
+  explicit QueryCache(size_t capacity) : _capacity(capacity) {}
+
+  uint64_t epoch() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _epoch;
+  }
+
+  std::shared_ptr<const QueryResults_t> get(const std::string &key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _index.find(key);
+    if (it == _index.end()) {
+      _misses++;
+      return nullptr;
+    }
+
+    _hits++;
+    _lru.splice(_lru.begin(), _lru, it->second);
+    return it->second->results;
+  }
+
+  bool accepts(size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return bytes <= _capacity;
+  }
+
+  void put(std::string key, uint64_t epoch,
+           std::shared_ptr<const QueryResults_t> results) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    size_t bytes = entryBytes(key, *results);
+    if (epoch != _epoch || bytes > _capacity || _index.count(key)) {
+      return;
+    }
+
+    _lru.push_front({std::move(key), std::move(results), bytes});
+    _index.emplace(_lru.front().key, _lru.begin());
+    _bytes += bytes;
+
+    evictLocked();
+  }
+
+  void invalidate() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _epoch++;
+    _index.clear();
+    _lru.clear();
+    _bytes = 0;
+  }
+
+  void setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _capacity = capacity;
+    evictLocked();
+  }
+
+  QueryCacheStats_t stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return QueryCacheStats_t{
+        /*hits=*/_hits,
+        /*misses=*/_misses,
+        /*evictions=*/_evictions,
+        /*n_entries=*/_lru.size(),
+        /*n_bytes=*/_bytes,
+        /*capacity=*/_capacity,
+    };
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const QueryResults_t> results;
+    size_t bytes;
+  };
+
+  static size_t entryBytes(const std::string &key,
+                           const QueryResults_t &results) {
+    // Includes the key stored in the entry and its copy in the index.
+    return sizeof(Entry) + 2 * key.size() + results.bytes();
+  }
+
+  void evictLocked() {
+    while (_bytes > _capacity) {
+      _bytes -= _lru.back().bytes;
+      _index.erase(_lru.back().key);
+      _lru.pop_back();
+      _evictions++;
+    }
+  }
+
+  std::mutex _mutex;
+  std::list<Entry> _lru;
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> _index;
+  size_t _bytes = 0;
+  size_t _capacity;
+  uint64_t _epoch = 0;
+  uint64_t _hits = 0, _misses = 0, _evictions = 0;
+};
+
+// Uses independent accumulators so that the loop can be vectorized without
+// reassociating a single floating point sum.
+float dotProduct(const float *a, const float *b, size_t n) {
+  constexpr size_t Lanes = 8;
+  float sums[Lanes] = {};
+  size_t i = 0;
+  for (; i + Lanes <= n; i += Lanes) {
+    for (size_t j = 0; j < Lanes; j++) {
+      sums[j] += a[i + j] * b[i + j];
+    }
+  }
+
+  float sum = 0;
+  for (; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  for (float partial : sums) {
+    sum += partial;
+  }
+  return sum;
+}
+
+void normalize(float *vec, size_t n) {
+  float norm = std::sqrt(dotProduct(vec, vec, n));
+  if (norm > 0) {
+    for (size_t i = 0; i < n; i++) {
+      vec[i] /= norm;
+    }
+  }
+}
+
+const char *DenseIndexDir = "dense";
+const char *DenseBlockExtension = ".emb";
+const char *DenseTmpExtension = ".tmp";
+const char *DenseCommitExtension = ".commit";
+const char DenseBlockMagic[8] = {'N', 'D', 'B', 'D', 'E', 'N', 'S', 'E'};
+
+// Stores the embeddings of chunks, normalized so that the dot product of two
+// embeddings is their cosine similarity. The chunks of an inserted document
+// have consecutive ids, so the embeddings of each insert are stored as a block
+// keyed by the id of its first chunk. The engine does not store embeddings, so
+// each block is also written to its own file in the dense directory of the ndb
+// as part of the insert, and its file is removed when the block is deleted. The
+// file is written under a temporary name before the engine insert, and renamed
+// to <start_id>.<doc_version>.emb once the insert assigns the chunk ids, thus a
+// failed or interrupted insert leaves at most a temporary file, which is
+// removed when the ndb is next opened for writes. If the rename fails after the
+// engine insert, a <tmp>.commit file records the chunk ids of the block, so the
+// rename is completed when the ndb is next opened. The blocks are loaded into
+// memory when the ndb is opened, since every hybrid query scores its
+// candidates against them, and the memory used can be bounded by max_bytes.
+class DenseIndex {
+public:
+  // The normalized embeddings of a document whose file has been written, but
+  // whose insert has not completed. The file is removed if the block is not
+  // committed.
+  struct PendingBlock {
+    std::string tmp_path;
+    DocId doc_id;
+    uint32_t dim;
+    std::vector<float> vectors;
+
+    ~PendingBlock() {
+      if (!tmp_path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(tmp_path, ec);
+      }
+    }
+  };
+
+  // Loads the blocks of the ndb at ndb_path, a max_bytes of 0 does not limit
+  // the memory used by the embeddings.
+  void open(const std::string &ndb_path, bool read_only, uint64_t max_bytes) {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    _dir = ndb_path + "/" + DenseIndexDir;
+    _max_bytes = max_bytes;
+
+    if (!std::filesystem::exists(_dir)) {
+      return; // The ndb has no embeddings.
+    }
+    // The paths are listed first since recovering blocks renames files.
+    std::vector<std::filesystem::path> paths;
+    for (const auto &entry : std::filesystem::directory_iterator(_dir)) {
+      if (entry.is_regular_file()) {
+        paths.push_back(entry.path());
+      }
+    }
+    for (const auto &path : paths) {
+      if (path.extension() == DenseTmpExtension) {
+        std::string commit_path = path.string() + DenseCommitExtension;
+        if (std::filesystem::exists(commit_path)) {
+          recoverBlockLocked(path.string(), commit_path, read_only);
+        } else if (!read_only) {
+          std::filesystem::remove(path);
+        }
+      } else if (path.extension() == DenseCommitExtension) {
+        // The block of the commit file was recovered, or deleted before the
+        // commit file was removed.
+        if (!read_only && !std::filesystem::exists(path.parent_path() /
+                                                   path.stem())) {
+          std::filesystem::remove(path);
+        }
+      } else if (path.extension() == DenseBlockExtension) {
+        auto [start_id, doc_version] = parseBlockName(path);
+        loadBlockLocked(path, start_id, doc_version);
+      }
+    }
+  }
+
+  // Normalizes the embeddings of the document and writes them to a temporary
+  // file. Returns null if the document has no embeddings.
+  std::unique_ptr<PendingBlock> prepare(const Document_t &doc) {
+    if (doc.embeddings.empty()) {
+      return nullptr;
+    }
+    if (doc.embedding_dim == 0 ||
+        doc.embeddings.size() != doc.chunks.size() * doc.embedding_dim) {
+      throw std::invalid_argument(
+          "number of embeddings must match the number of chunks");
+    }
+
+    uint64_t n_bytes = doc.embeddings.size() * sizeof(float);
+    {
+      std::shared_lock<std::shared_mutex> lock(_mutex);
+      checkDimLocked(doc.embedding_dim);
+      if (_max_bytes > 0 && _bytes + n_bytes > _max_bytes) {
+        throw std::length_error(
+            "inserting the embeddings would exceed the maximum embedding "
+            "memory of " +
+            std::to_string(_max_bytes) + " bytes");
+      }
+    }
+
+    auto block = std::make_unique<PendingBlock>();
+    block->doc_id = doc.doc_id;
+    block->dim = doc.embedding_dim;
+    block->vectors = doc.embeddings;
+    for (size_t i = 0; i < block->vectors.size(); i += block->dim) {
+      normalize(block->vectors.data() + i, block->dim);
+    }
+
+    std::filesystem::create_directories(_dir);
+    std::string path =
+        _dir + "/" + std::to_string(_next_tmp++) + DenseTmpExtension;
+    writeBlock(path, *block);
+    block->tmp_path = path;
+    return block;
+  }
+
+  // Renames the file of the block to the chunk ids assigned by the insert, and
+  // adds the block to the index. This is called after the engine insert, so it
+  // must not fail the insert: if the rename fails the block is still added, its
+  // file keeps its temporary name, and a commit file records its chunk ids so
+  // that the rename is retried by save or when the ndb is next opened.
+  void commit(PendingBlock &pending, const InsertMetadata &info) {
+    std::error_code ec;
+    std::filesystem::rename(pending.tmp_path,
+                            blockPath(info.start_id, info.doc_version), ec);
+    if (ec) {
+      writeCommit(pending.tmp_path + DenseCommitExtension, info.start_id,
+                  info.doc_version);
+    }
+
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    if (ec) {
+      _tmp_paths[info.start_id] = pending.tmp_path;
+    }
+    pending.tmp_path.clear();
+    addLocked(info.start_id, Block{info.doc_id, info.doc_version,
+                                   std::move(pending.vectors)},
+              pending.dim);
+  }
+
+  // Removes the embeddings of the versions of the document, except keep_version
+  // if it is set. The caller passes the latest version of the document in the
+  // engine, since the latest version with embeddings may be an older version
+  // which the engine deletes. Embeddings of chunks that the ndb no longer
+  // contains are never returned, so this only frees memory and disk.
+  void remove(const DocId &doc_id, std::optional<uint32_t> keep_version) {
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+
+    auto doc = _docs.find(doc_id);
+    if (doc == _docs.end()) {
+      return;
+    }
+
+    auto &versions = doc->second;
+    for (auto it = versions.begin(); it != versions.end();) {
+      if (keep_version && it->first == *keep_version) {
+        ++it;
+        continue;
+      }
+
+      auto block = _blocks.find(it->second);
+      _bytes -= block->second.vectors.size() * sizeof(float);
+
+      std::error_code ec;
+      std::filesystem::remove(blockFileLocked(it->second, block->second), ec);
+      if (auto tmp = _tmp_paths.find(it->second); tmp != _tmp_paths.end()) {
+        std::filesystem::remove(tmp->second + DenseCommitExtension, ec);
+        _tmp_paths.erase(tmp);
+      }
+      _blocks.erase(block);
+      it = versions.erase(it);
+    }
+    if (versions.empty()) {
+      _docs.erase(doc);
+    }
+  }
+
+  // Returns the cosine similarity of the query and each chunk, or nullopt for
+  // chunks without an embedding.
+  std::vector<std::optional<float>>
+  similarities(const std::vector<std::pair<Chunk, float>> &chunks,
+               std::vector<float> query) {
+    normalize(query.data(), query.size());
+
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    checkDimLocked(query.size());
+
+    std::vector<std::optional<float>> scores(chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++) {
+      if (const float *vec = findLocked(chunks[i].first.id)) {
+        scores[i] = dotProduct(vec, query.data(), _dim);
+      }
+    }
+    return scores;
+  }
+
+  // Adds the files of the blocks to the dense directory of the copy of the ndb
+  // at save_path. The files are never modified once written, so they are hard
+  // linked when possible, and copied otherwise. Files whose rename failed in
+  // commit are renamed first, and are saved under their final name even if the
+  // rename fails again.
+  void save(const std::string &save_path) {
+    {
+      std::unique_lock<std::shared_mutex> lock(_mutex);
+      for (auto it = _tmp_paths.begin(); it != _tmp_paths.end();) {
+        std::error_code ec;
+        std::filesystem::rename(
+            it->second,
+            blockPath(it->first, _blocks.at(it->first).doc_version), ec);
+        if (ec) {
+          ++it;
+          continue;
+        }
+        std::filesystem::remove(it->second + DenseCommitExtension, ec);
+        it = _tmp_paths.erase(it);
+      }
+    }
+
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    if (_blocks.empty()) {
+      return;
+    }
+
+    std::string dir = save_path + "/" + DenseIndexDir;
+    std::filesystem::create_directories(dir);
+    for (const auto &[start_id, block] : _blocks) {
+      std::string src = blockFileLocked(start_id, block);
+      std::string dst = dir + "/" + blockName(start_id, block.doc_version);
+      std::error_code ec;
+      std::filesystem::create_hard_link(src, dst, ec);
+      if (ec) {
+        std::filesystem::copy_file(
+            src, dst, std::filesystem::copy_options::overwrite_existing);
+      }
+    }
+  }
+
+  DenseIndexStats_t stats() {
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    uint64_t n_chunks = _dim > 0 ? _bytes / (_dim * sizeof(float)) : 0;
+    return DenseIndexStats_t{n_chunks, _bytes, _max_bytes, _dim};
+  }
+
+private:
+  struct Block {
+    DocId doc_id;
+    uint32_t doc_version;
+    std::vector<float> vectors;
+  };
+
+  static std::string blockName(ChunkId start_id, uint32_t doc_version) {
+    return std::to_string(start_id) + "." + std::to_string(doc_version) +
+           DenseBlockExtension;
+  }
+
+  std::string blockPath(ChunkId start_id, uint32_t doc_version) const {
+    return _dir + "/" + blockName(start_id, doc_version);
+  }
+
+  // Returns the path of the file of the block, which is its temporary path if
+  // its rename failed.
+  std::string blockFileLocked(ChunkId start_id, const Block &block) const {
+    auto tmp = _tmp_paths.find(start_id);
+    if (tmp != _tmp_paths.end()) {
+      return tmp->second;
+    }
+    return blockPath(start_id, block.doc_version);
+  }
+
+  static void writeBlock(const std::string &path, const PendingBlock &block) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(DenseBlockMagic, sizeof(DenseBlockMagic));
+    writeValue(out, block.dim);
+    writeValue(out, uint64_t(block.doc_id.size()));
+    out.write(block.doc_id.data(), block.doc_id.size());
+    writeValue(out, uint64_t(block.vectors.size()));
+    out.write(reinterpret_cast<const char *>(block.vectors.data()),
+              block.vectors.size() * sizeof(float));
+    out.close();
+
+    if (out.fail()) {
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+      throw std::runtime_error("failed to write embeddings to " + path);
+    }
+  }
+
+  static std::pair<ChunkId, uint32_t>
+  parseBlockName(const std::filesystem::path &path) {
+    // The stem of a block file is <start_id>.<doc_version>.
+    std::string stem = path.stem().string();
+    size_t dot = stem.find('.');
+    if (dot == std::string::npos) {
+      throw std::runtime_error("invalid embedding file name " + path.string());
+    }
+    return {std::stoull(stem.substr(0, dot)),
+            std::stoul(stem.substr(dot + 1))};
+  }
+
+  // The commit file is written with the ndb already committed, so a failure to
+  // write it is ignored: the block is then kept under its temporary path until
+  // save renames it, and is lost if the ndb is reopened first.
+  static void writeCommit(const std::string &path, ChunkId start_id,
+                          uint32_t doc_version) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(DenseBlockMagic, sizeof(DenseBlockMagic));
+    writeValue(out, uint64_t(start_id));
+    writeValue(out, doc_version);
+    out.close();
+
+    if (out.fail()) {
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+    }
+  }
+
+  // Loads a block whose rename failed after its insert, and renames it unless
+  // the ndb is read only.
+  void recoverBlockLocked(const std::string &tmp_path,
+                          const std::string &commit_path, bool read_only) {
+    std::ifstream in(commit_path, std::ios::binary);
+    char magic[sizeof(DenseBlockMagic)];
+    in.read(magic, sizeof(magic));
+    uint64_t start_id = readValue<uint64_t>(in);
+    uint32_t doc_version = readValue<uint32_t>(in);
+    if (!in.good() ||
+        !std::equal(magic, magic + sizeof(magic), DenseBlockMagic)) {
+      throw std::runtime_error("invalid embedding commit file " + commit_path);
+    }
+    in.close();
+
+    if (!read_only) {
+      std::string path = blockPath(start_id, doc_version);
+      std::error_code ec;
+      std::filesystem::rename(tmp_path, path, ec);
+      if (!ec) {
+        std::filesystem::remove(commit_path);
+        loadBlockLocked(path, start_id, doc_version);
+        return;
+      }
+    }
+
+    loadBlockLocked(tmp_path, start_id, doc_version);
+    _tmp_paths[start_id] = tmp_path;
+    // New temporary files must not overwrite the file of the block.
+    uint64_t tmp_id = std::stoull(std::filesystem::path(tmp_path).stem());
+    _next_tmp = std::max(_next_tmp, tmp_id + 1);
+  }
+
+  void loadBlockLocked(const std::filesystem::path &path, ChunkId start_id,
+                       uint32_t doc_version) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(DenseBlockMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in.good() ||
+        !std::equal(magic, magic + sizeof(magic), DenseBlockMagic)) {
+      throw std::runtime_error("invalid embedding file " + path.string());
+    }
+
+    Block block;
+    block.doc_version = doc_version;
+    uint32_t dim = readValue<uint32_t>(in);
+    block.doc_id.resize(readValue<uint64_t>(in));
+    in.read(block.doc_id.data(), block.doc_id.size());
+    block.vectors.resize(readValue<uint64_t>(in));
+    in.read(reinterpret_cast<char *>(block.vectors.data()),
+            block.vectors.size() * sizeof(float));
+    if (!in.good() || dim == 0) {
+      throw std::runtime_error("failed to read embeddings from " +
+                               path.string());
+    }
+
+    checkDimLocked(dim);
+    addLocked(start_id, std::move(block), dim);
+  }
+
+  void addLocked(ChunkId start_id, Block block, uint32_t dim) {
+    checkDimLocked(dim);
+    _dim = dim;
+    _bytes += block.vectors.size() * sizeof(float);
+    _docs[block.doc_id][block.doc_version] = start_id;
+    _blocks[start_id] = std::move(block);
+  }
+
+  void checkDimLocked(size_t dim) {
+    if (_dim != 0 && dim != _dim) {
+      throw std::invalid_argument(
+          "embedding dimension " + std::to_string(dim) +
+          " does not match the dimension of the index " +
+          std::to_string(_dim));
+    }
+  }
+
+  const float *findLocked(ChunkId id) {
+    auto it = _blocks.upper_bound(id);
+    if (it == _blocks.begin()) {
+      return nullptr;
+    }
+    --it;
+    size_t offset = (id - it->first) * _dim;
+    if (offset >= it->second.vectors.size()) {
+      return nullptr;
+    }
+    return it->second.vectors.data() + offset;
+  }
+
+  template <typename T> static void writeValue(std::ostream &out, T value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T> static T readValue(std::istream &in) {
+    T value{};
+    in.read(reinterpret_cast<char *>(&value), sizeof(T));
+    return value;
+  }
+
+  std::shared_mutex _mutex;
+  std::string _dir;
+  uint32_t _dim = 0;
+  uint64_t _bytes = 0;
+  uint64_t _max_bytes = 0;
+  // Writes are serialized by the caller, so only the index itself is locked.
+  uint64_t _next_tmp = 0;
+  std::map<ChunkId, Block> _blocks;
+  std::unordered_map<DocId, std::map<uint32_t, ChunkId>> _docs;
+  // The temporary files of blocks whose rename failed, by start id.
+  std::unordered_map<ChunkId, std::string> _tmp_paths;
+};
+
+bool sourceLess(const Source &a, const Source &b) {
+  return std::tie(a.doc_id, a.doc_version) < std::tie(b.doc_id, b.doc_version);
+}
+
+// Returns the range of the sorted sources with the doc id.
+std::pair<size_t, size_t> docRange(const std::vector<Source> &sources,
+                                   const DocId &doc_id) {
+  auto begin = std::lower_bound(
+      sources.begin(), sources.end(), doc_id,
+      [](const Source &s, const DocId &id) { return s.doc_id < id; });
+  auto end = std::upper_bound(
+      begin, sources.end(), doc_id,
+      [](const DocId &id, const Source &s) { return id < s.doc_id; });
+  return {begin - sources.begin(), end - sources.begin()};
+}
+
+// The engine only returns all of the sources at once, and in no particular
+// order. This caches the sources sorted by doc id and version so that pages and
+// counts can be served with binary searches instead of listing the sources for
+// each call. The list is built from the engine when it is first needed, and
+// then updated by inserts and deletes, which costs O(n) to shift the entries
+// after the modified position. It is only rebuilt, in O(n log n), after a
+// modification that fails or a prune. Lists returned by get are shared with the
+// cache, so an update copies the list if a caller still holds it. Like the
+// query cache it has an epoch so that a list computed before a modification
+// completed is not cached after it completes. Updates must be serialized by the
+// caller, as for the modifications of the ndb.
+class SourcesCache {
+public:
+  SourceList get(OnDiskNeuralDB &ndb) {
+    uint64_t epoch;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_sources) {
+        return _sources;
+      }
+      epoch = _epoch;
+    }
+
+    auto sources = std::make_shared<std::vector<Source>>(ndb.sources());
+    std::sort(sources->begin(), sources->end(), sourceLess);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (epoch == _epoch) {
+      _sources = sources;
+    }
+    return sources;
+  }
+
+  void inserted(const Source &source) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _epoch++;
+    if (!_sources) {
+      return;
+    }
+
+    auto &sources = mutableLocked();
+    auto it = std::upper_bound(sources.begin(), sources.end(), source,
+                               sourceLess);
+    sources.insert(it, source);
+  }
+
+  void deleted(const DocId &doc_id, bool keep_latest_version) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _epoch++;
+    if (!_sources) {
+      return;
+    }
+
+    auto [begin, end] = docRange(*_sources, doc_id);
+    if (keep_latest_version && begin < end) {
+      end--;
+    }
+    if (begin == end) {
+      return;
+    }
+
+    auto &sources = mutableLocked();
+    sources.erase(sources.begin() + begin, sources.begin() + end);
+  }
+
+  void invalidate() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _epoch++;
+    _sources.reset();
+  }
+
+private:
+  std::vector<Source> &mutableLocked() {
+    // Lists are only shared while holding the lock, so if the cache holds the
+    // only reference no caller can be reading it.
+    if (_sources.use_count() > 1) {
+      _sources = std::make_shared<std::vector<Source>>(*_sources);
+    }
+    return *_sources;
+  }
+
+  std::mutex _mutex;
+  std::shared_ptr<std::vector<Source>> _sources;
+  uint64_t _epoch = 0;
+};
+
+const size_t DefaultQueryCacheBytes = 64 * 1024 * 1024;
+
+std::shared_ptr<OnDiskNeuralDB> openNeuralDB(const std::string &save_path,
+                                             bool read_only) {
+  if (read_only) {
+    return OnDiskNeuralDB::load(save_path, /*read_only=*/true);
+  }
+  return OnDiskNeuralDB::make(save_path);
 }
 
 struct NeuralDB_t {
-  std::unique_ptr<OnDiskNeuralDB> ndb;
+  std::shared_ptr<OnDiskNeuralDB> ndb;
+  QueryCache cache;
+  SourcesCache sources;
+  DenseIndex dense;
+  // The number of OpenMP threads used to tokenize and count the tokens of the
+  // chunks in an insert, 0 uses the OpenMP default.
+  std::atomic<unsigned int> insert_threads;
+  bool read_only;
+
+  NeuralDB_t(const std::string &save_path, const NeuralDBOptions_t &options)
+      : ndb(openNeuralDB(save_path, options.read_only)),
+        cache(options.query_cache_bytes),
+        insert_threads(options.insert_threads), read_only(options.read_only) {
+    dense.open(save_path, options.read_only, options.max_embedding_bytes);
+  }
+};
+
+// OpenMP thread counts are per calling thread, and cgo calls can run on any
+// thread, so the thread count is set for the duration of each insert and the
+// previous value is restored afterwards.
+class ScopedOmpThreads {
+public:
+  explicit ScopedOmpThreads(unsigned int n_threads)
+      : _prev(omp_get_max_threads()), _set(n_threads > 0) {
+    if (_set) {
+      omp_set_num_threads(n_threads);
+    }
+  }
+
+  ~ScopedOmpThreads() {
+    if (_set) {
+      omp_set_num_threads(_prev);
+    }
+  }
 
-  NeuralDB_t(const std::string &save_path)
-      : ndb(OnDiskNeuralDB::make(save_path)) {}
+private:
+  int _prev;
+  bool _set;
 };
 
+// Invalidates the query cache when a modification of the ndb completes, this
+// includes modifications which fail since they may have been partially applied.
+// The sources cache is also invalidated unless the modification cannot change
+// the sources, such as finetuning, or the modification succeeded and updated
+// the sources cache itself.
+class InvalidateOnExit {
+public:
+  explicit InvalidateOnExit(NeuralDB_t *ndb, bool sources_changed = true)
+      : _ndb(ndb), _sources_changed(sources_changed) {}
+
+  void sourcesUpdated() { _sources_changed = false; }
+
+  ~InvalidateOnExit() {
+    _ndb->cache.invalidate();
+    if (_sources_changed) {
+      _ndb->sources.invalidate();
+    }
+  }
+
+private:
+  NeuralDB_t *_ndb;
+  bool _sources_changed;
+};
+
+NeuralDBOptions_t NeuralDB_default_options() {
+  return NeuralDBOptions_t{
+      /*read_only=*/false,
+      /*query_cache_bytes=*/DefaultQueryCacheBytes,
+      /*insert_threads=*/0,
+      /*max_embedding_bytes=*/0,
+  };
+}
+
 NeuralDB_t *NeuralDB_new(const char *save_path, const char **err_ptr) {
+  NeuralDBOptions_t options = NeuralDB_default_options();
+  return NeuralDB_new_with_options(save_path, &options, err_ptr);
+}
+
+NeuralDB_t *NeuralDB_new_with_options(const char *save_path,
+                                      const NeuralDBOptions_t *options,
+                                      const char **err_ptr) {
   try {
     std::string path(save_path);
-    return new NeuralDB_t(path);
+    return new NeuralDB_t(path, *options);
   } catch (const std::exception &e) {
     // TODO(Nicholas): have case for NeuralDBError to return better errors
     copyError(e, err_ptr);
@@ -266,34 +1481,144 @@ NeuralDB_t *NeuralDB_new(const char *save_path, const char **err_ptr) {
 
 void NeuralDB_free(NeuralDB_t *ndb) { delete ndb; }
 
-void NeuralDB_insert(NeuralDB_t *ndb, Document_t *doc, const char **err_ptr) {
+void NeuralDB_insert(NeuralDB_t *ndb, Document_t *doc, InsertInfo_t *info,
+                     const char **err_ptr) {
+  InvalidateOnExit invalidate(ndb);
+  ScopedOmpThreads threads(ndb->insert_threads);
   try {
-    ndb->ndb->insert(
+    auto embeddings = ndb->dense.prepare(*doc);
+    auto inserted = ndb->ndb->insert(
         /*chunks=*/doc->chunks,
         /*metadata*/ doc->metadata,
         /*document=*/doc->document,
         /*doc_id=*/doc->doc_id,
         /*doc_version=*/doc->doc_version);
+    if (embeddings) {
+      ndb->dense.commit(*embeddings, inserted);
+    }
+    ndb->sources.inserted(
+        Source(doc->document, inserted.doc_id, inserted.doc_version));
+    invalidate.sourcesUpdated();
+    if (info) {
+      *info = InsertInfo_t{inserted.start_id, inserted.end_id,
+                           inserted.doc_version};
+    }
   } catch (const std::exception &e) {
     copyError(e, err_ptr);
     return;
   }
 }
 
+std::vector<std::pair<Chunk, float>>
+runQuery(NeuralDB_t *ndb, const std::string &query, unsigned int topk,
+         const Constraints_t *constraints) {
+  if (constraints == nullptr) {
+    return ndb->ndb->query(query, topk);
+  }
+  return ndb->ndb->rank(query, constraints->constraints, topk);
+}
+
+unsigned long long elapsedNs(std::chrono::steady_clock::time_point start,
+                             std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+      .count();
+}
+
+std::string queryCacheKey(const std::string &query, unsigned int topk,
+                          const Constraints_t *constraints) {
+  // Unconstrained queries use query instead of rank, and so may return
+  // different results than a query with empty constraints.
+  std::string key(1, constraints == nullptr ? 'q' : 'r');
+  appendBytes(key, &topk, sizeof(topk));
+  appendLenPrefixed(key, query);
+  if (constraints != nullptr) {
+    for (const auto &[name, constraint] : constraints->cache_keys) {
+      appendLenPrefixed(key, name);
+      appendLenPrefixed(key, constraint);
+    }
+  }
+  return key;
+}
+
+void runCachedQuery(NeuralDB_t *ndb, const std::string &query,
+                    unsigned int topk, const Constraints_t *constraints,
+                    const QueryDeadline_t *deadline, QueryResults_t &out) {
+  std::string key = queryCacheKey(query, topk, constraints);
+  if (auto cached = ndb->cache.get(key)) {
+    out = *cached;
+    out.timings = QueryTimings_t{/*cached=*/true, /*engine_ns=*/0,
+                                 /*serialize_ns=*/0};
+    return;
+  }
+
+  if (deadline && deadline->expired()) {
+    throw DeadlineExceeded();
+  }
+
+  uint64_t epoch = ndb->cache.epoch();
+
+  auto start = std::chrono::steady_clock::now();
+  auto results = runQuery(ndb, query, topk, constraints);
+  auto ranked = std::chrono::steady_clock::now();
+  out.serialize(results);
+  auto serialized = std::chrono::steady_clock::now();
+
+  out.timings = QueryTimings_t{
+      /*cached=*/false,
+      /*engine_ns=*/elapsedNs(start, ranked),
+      /*serialize_ns=*/elapsedNs(ranked, serialized),
+  };
+
+  if (ndb->cache.accepts(out.bytes())) {
+    ndb->cache.put(std::move(key), epoch,
+                   std::make_shared<const QueryResults_t>(out));
+  }
+}
+
+unsigned int NeuralDB_insert_batch(NeuralDB_t *ndb, Document_t **docs,
+                                   unsigned int n, const char **err_ptr) {
+  InvalidateOnExit invalidate(ndb);
+  ScopedOmpThreads threads(ndb->insert_threads);
+  unsigned int i = 0;
+  try {
+    for (; i < n; i++) {
+      auto embeddings = ndb->dense.prepare(*docs[i]);
+      auto info = ndb->ndb->insert(
+          /*chunks=*/docs[i]->chunks,
+          /*metadata*/ docs[i]->metadata,
+          /*document=*/docs[i]->document,
+          /*doc_id=*/docs[i]->doc_id,
+          /*doc_version=*/docs[i]->doc_version);
+      if (embeddings) {
+        ndb->dense.commit(*embeddings, info);
+      }
+      ndb->sources.inserted(
+          Source(docs[i]->document, info.doc_id, info.doc_version));
+    }
+    invalidate.sourcesUpdated();
+  } catch (const std::exception &e) {
+    copyError(std::runtime_error("error inserting doc_id '" +
+                                 docs[i]->doc_id + "': " + e.what()),
+              err_ptr);
+  }
+  return i;
+}
+
 QueryResults_t *NeuralDB_query(NeuralDB_t *ndb, const char *query,
                                unsigned int topk,
                                const Constraints_t *constraints,
-                               const char **err_ptr) {
+                               const QueryDeadline_t *deadline,
+                               bool *deadline_exceeded, const char **err_ptr) {
   try {
-    std::vector<std::pair<Chunk, float>> results;
-    if (constraints == nullptr) {
-      results = ndb->ndb->query(query, topk);
-    } else {
-      results = ndb->ndb->rank(query, constraints->constraints, topk);
+    auto out = std::make_unique<QueryResults_t>();
+    runCachedQuery(ndb, query, topk, constraints, deadline, *out);
+    return out.release();
+  } catch (const DeadlineExceeded &e) {
+    if (deadline_exceeded) {
+      *deadline_exceeded = true;
     }
-    auto out = new QueryResults_t();
-    out->results = std::move(results);
-    return out;
+    copyError(e, err_ptr);
+    return nullptr;
   } catch (const std::exception &e) {
     // TODO(Nicholas): have case for NeuralDBError to return better errors
     copyError(e, err_ptr);
@@ -301,8 +1626,311 @@ QueryResults_t *NeuralDB_query(NeuralDB_t *ndb, const char *query,
   }
 }
 
+// The constant k in reciprocal rank fusion, 1/(k+rank), which limits the
+// weight of the top ranks.
+const float RrfK = 60;
+
+// Fuses the lexical scores of the candidates, which are sorted by lexical
+// score, with their dense scores. Candidates without an embedding only get the
+// lexical part of the fused score.
+std::vector<float> fuseScores(
+    const std::vector<std::pair<Chunk, float>> &candidates,
+    const std::vector<std::optional<float>> &dense,
+    const HybridOptions_t &options) {
+  float w = options.dense_weight;
+  std::vector<float> fused(candidates.size());
+
+  if (options.fusion == FusionWeighted) {
+    float max_lexical = candidates.empty() ? 0 : candidates[0].second;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      float lexical = max_lexical > 0 ? candidates[i].second / max_lexical : 0;
+      // Maps the cosine similarity from [-1, 1] to [0, 1] like the lexical
+      // score.
+      float dense_score = dense[i] ? (*dense[i] + 1) / 2 : 0;
+      fused[i] = (1 - w) * lexical + w * dense_score;
+    }
+    return fused;
+  }
+
+  std::vector<size_t> dense_order;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    fused[i] = (1 - w) / (RrfK + i + 1);
+    if (dense[i]) {
+      dense_order.push_back(i);
+    }
+  }
+  std::stable_sort(dense_order.begin(), dense_order.end(),
+                   [&](size_t a, size_t b) { return *dense[a] > *dense[b]; });
+  for (size_t rank = 0; rank < dense_order.size(); rank++) {
+    fused[dense_order[rank]] += w / (RrfK + rank + 1);
+  }
+  return fused;
+}
+
+HybridOptions_t NeuralDB_default_hybrid_options() {
+  return HybridOptions_t{
+      /*fusion=*/FusionReciprocalRank,
+      /*dense_weight=*/0.5,
+      /*n_candidates=*/0,
+  };
+}
+
+QueryResults_t *NeuralDB_query_hybrid(NeuralDB_t *ndb, const char *query,
+                                      const float *embedding,
+                                      unsigned int dim, unsigned int topk,
+                                      const Constraints_t *constraints,
+                                      const HybridOptions_t *options,
+                                      const char **err_ptr) {
+  try {
+    if (options->fusion != FusionReciprocalRank &&
+        options->fusion != FusionWeighted) {
+      throw std::invalid_argument("invalid fusion type");
+    }
+    if (options->dense_weight < 0 || options->dense_weight > 1) {
+      throw std::invalid_argument("dense weight must be between 0 and 1");
+    }
+
+    unsigned int n_candidates =
+        options->n_candidates > 0 ? options->n_candidates : 4 * topk;
+    auto candidates =
+        runQuery(ndb, query, std::max(n_candidates, topk), constraints);
+
+    auto dense = ndb->dense.similarities(
+        candidates, std::vector<float>(embedding, embedding + dim));
+    auto fused = fuseScores(candidates, dense, *options);
+
+    std::vector<size_t> order(candidates.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return fused[a] > fused[b]; });
+    order.resize(std::min<size_t>(order.size(), topk));
+
+    std::vector<std::pair<Chunk, float>> results;
+    results.reserve(order.size());
+    for (size_t i : order) {
+      results.emplace_back(std::move(candidates[i].first), fused[i]);
+    }
+
+    auto out = std::make_unique<QueryResults_t>();
+    out->serialize(results);
+    return out.release();
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return nullptr;
+  }
+}
+
+LazyQueryResults_t *NeuralDB_query_lazy(NeuralDB_t *ndb, const char *query,
+                                        unsigned int topk,
+                                        const Constraints_t *constraints,
+                                        const char **err_ptr) {
+  try {
+    auto out = std::make_unique<LazyQueryResults_t>();
+    out->results = runQuery(ndb, query, topk, constraints);
+    out->ids.reserve(out->results.size());
+    for (const auto &[chunk, score] : out->results) {
+      out->ids.push_back({chunk.id, score});
+    }
+    return out.release();
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return nullptr;
+  }
+}
+
+// WorkerPool runs the helper workers of batch queries and warmups. It is
+// shared by all ndbs, so the number of helper threads is bounded by the number
+// of cores however many batches run concurrently, and threads are not started
+// for each batch.
+class WorkerPool {
+public:
+  static WorkerPool &shared() {
+    // The pool is never destroyed, so its threads do not need to be joined
+    // during static destruction while cgo calls may still be running.
+    static WorkerPool *pool =
+        new WorkerPool(std::max(1U, std::thread::hardware_concurrency()));
+    return *pool;
+  }
+
+  size_t size() const { return _n_threads; }
+
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _tasks.push_back(std::move(task));
+    }
+    _cv.notify_one();
+  }
+
+private:
+  explicit WorkerPool(size_t n_threads) {
+    for (size_t t = 0; t < n_threads; t++) {
+      try {
+        std::thread([this]() { run(); }).detach();
+        _n_threads++;
+      } catch (const std::system_error &) {
+        // Fall back to the threads that could be started.
+        break;
+      }
+    }
+  }
+
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]() { return !_tasks.empty(); });
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<std::function<void()>> _tasks;
+  size_t _n_threads = 0;
+};
+
+// Tracks the helpers of a call to runWorkers. Helpers which have not started
+// when the calling thread finishes are skipped, since the tasks they would run
+// have been completed, and the caller waits for the helpers which have started.
+class WorkerHelpers {
+public:
+  bool start() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_done) {
+      return false;
+    }
+    _running++;
+    return true;
+  }
+
+  void finish() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running--;
+    _cv.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done = true;
+    _cv.wait(lock, [this]() { return _running == 0; });
+  }
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  size_t _running = 0;
+  bool _done = false;
+};
+
+// Runs the worker on the calling thread and on up to n_tasks - 1 threads of the
+// shared worker pool.
+template <typename Worker> void runWorkers(size_t n_tasks, Worker worker) {
+  auto &pool = WorkerPool::shared();
+  size_t n_helpers = n_tasks > 1 ? std::min(n_tasks - 1, pool.size()) : 0;
+
+  auto helpers = std::make_shared<WorkerHelpers>();
+  for (size_t t = 0; t < n_helpers; t++) {
+    pool.submit([helpers, &worker]() {
+      if (helpers->start()) {
+        worker();
+        helpers->finish();
+      }
+    });
+  }
+  worker();
+  helpers->wait();
+}
+
+BatchQueryResults_t *NeuralDB_query_batch(NeuralDB_t *ndb,
+                                          const StringList_t *queries,
+                                          const unsigned int *topks,
+                                          const Constraints_t **constraints,
+                                          const QueryDeadline_t *deadline,
+                                          const char **err_ptr) {
+  try {
+    const size_t n_queries = queries->list.size();
+
+    auto out = std::make_unique<BatchQueryResults_t>();
+    out->results.resize(n_queries);
+    out->completed.resize(n_queries, false);
+
+    std::vector<std::string> errors(n_queries);
+    std::atomic<size_t> next_query{0};
+
+    auto worker = [&]() {
+      size_t i;
+      while ((i = next_query.fetch_add(1)) < n_queries) {
+        try {
+          runCachedQuery(ndb, queries->list[i], topks[i], constraints[i],
+                         deadline, out->results[i]);
+          out->completed[i] = true;
+        } catch (const DeadlineExceeded &) {
+          // The query is skipped, the results of the queries which completed
+          // or were cached are still returned.
+        } catch (const std::exception &e) {
+          errors[i] = e.what();
+        }
+      }
+    };
+
+    runWorkers(n_queries, worker);
+
+    for (size_t i = 0; i < n_queries; i++) {
+      if (!errors[i].empty()) {
+        throw std::runtime_error("query " + std::to_string(i) + ": " +
+                                 errors[i]);
+      }
+    }
+
+    return out.release();
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return nullptr;
+  }
+}
+
+unsigned int NeuralDB_warmup(NeuralDB_t *ndb, const StringList_t *queries,
+                            const unsigned int *topks,
+                            const Constraints_t **constraints,
+                            unsigned int budget_ms) {
+  const size_t n_queries = queries->list.size();
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(budget_ms);
+
+  std::atomic<size_t> next_query{0};
+  std::atomic<unsigned int> n_completed{0};
+
+  auto worker = [&]() {
+    size_t i;
+    while (std::chrono::steady_clock::now() < deadline &&
+           (i = next_query.fetch_add(1)) < n_queries) {
+      try {
+        QueryResults_t results;
+        runCachedQuery(ndb, queries->list[i], topks[i], constraints[i],
+                       /*deadline=*/nullptr, results);
+        n_completed++;
+      } catch (const std::exception &) {
+        // The query will return the same error when it is run by a caller,
+        // there is nothing to warm up.
+      }
+    }
+  };
+
+  runWorkers(n_queries, worker);
+
+  return n_completed;
+}
+
 void NeuralDB_finetune(NeuralDB_t *ndb, const StringList_t *queries,
                        const LabelList_t *chunk_ids, const char **err_ptr) {
+  InvalidateOnExit invalidate(ndb, /*sources_changed=*/false);
   try {
     ndb->ndb->finetune(queries->list, chunk_ids->list);
   } catch (const std::exception &e) {
@@ -315,6 +1943,7 @@ void NeuralDB_finetune(NeuralDB_t *ndb, const StringList_t *queries,
 void NeuralDB_associate(NeuralDB_t *ndb, const StringList_t *sources,
                         const StringList_t *targets, unsigned int strength,
                         const char **err_ptr) {
+  InvalidateOnExit invalidate(ndb, /*sources_changed=*/false);
   try {
     ndb->ndb->associate(sources->list, targets->list, strength);
   } catch (const std::exception &e) {
@@ -324,11 +1953,36 @@ void NeuralDB_associate(NeuralDB_t *ndb, const StringList_t *sources,
   }
 }
 
+// Deletes the document and returns the number of its versions that were
+// removed, which are counted from the sources before the delete.
+unsigned int deleteDoc(NeuralDB_t *ndb, const DocId &doc_id,
+                       bool keep_latest_version) {
+  unsigned int n_versions;
+  std::optional<uint32_t> kept_version;
+  {
+    // The list must be released before the sources cache is updated, otherwise
+    // the update copies it.
+    auto sources = ndb->sources.get(*ndb->ndb);
+    auto [begin, end] = docRange(*sources, doc_id);
+    n_versions = end - begin;
+    if (keep_latest_version && n_versions > 0) {
+      kept_version = (*sources)[end - 1].doc_version;
+      n_versions--;
+    }
+  }
+
+  ndb->ndb->deleteDoc(doc_id, keep_latest_version);
+  ndb->dense.remove(doc_id, kept_version);
+  ndb->sources.deleted(doc_id, keep_latest_version);
+  return n_versions;
+}
+
 void NeuralDB_delete_doc(NeuralDB_t *ndb, const char *doc_id,
                          bool keep_latest_version, const char **err_ptr) {
-
+  InvalidateOnExit invalidate(ndb);
   try {
-    ndb->ndb->deleteDoc(doc_id, keep_latest_version);
+    deleteDoc(ndb, doc_id, keep_latest_version);
+    invalidate.sourcesUpdated();
   } catch (const std::exception &e) {
     // TODO(Nicholas): have case for NeuralDBError to return better errors
     copyError(e, err_ptr);
@@ -336,12 +1990,40 @@ void NeuralDB_delete_doc(NeuralDB_t *ndb, const char *doc_id,
   }
 }
 
+unsigned int NeuralDB_delete_docs(NeuralDB_t *ndb, const StringList_t *doc_ids,
+                                  bool keep_latest_version,
+                                  unsigned int *n_versions,
+                                  const char **err_ptr) {
+  InvalidateOnExit invalidate(ndb);
+  unsigned int i = 0;
+  *n_versions = 0;
+  try {
+    for (; i < doc_ids->list.size(); i++) {
+      *n_versions += deleteDoc(ndb, doc_ids->list[i], keep_latest_version);
+    }
+    invalidate.sourcesUpdated();
+  } catch (const std::exception &e) {
+    copyError(std::runtime_error("error deleting doc_id '" +
+                                 doc_ids->list[i] + "': " + e.what()),
+              err_ptr);
+  }
+  return i;
+}
+
+void NeuralDB_prune(NeuralDB_t *ndb, const char **err_ptr) {
+  InvalidateOnExit invalidate(ndb);
+  try {
+    ndb->ndb->prune();
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+  }
+}
+
 Sources_t *NeuralDB_sources(NeuralDB_t *ndb, const char **err_ptr) {
   try {
-    auto sources = ndb->ndb->sources();
-    auto out = new Sources_t();
-    out->sources = std::move(sources);
-    return out;
+    auto sources = ndb->sources.get(*ndb->ndb);
+    size_t n = sources->size();
+    return new Sources_t{std::move(sources), 0, n};
   } catch (const std::exception &e) {
     // TODO(Nicholas): have case for NeuralDBError to return better errors
     copyError(e, err_ptr);
@@ -349,12 +2031,86 @@ Sources_t *NeuralDB_sources(NeuralDB_t *ndb, const char **err_ptr) {
   }
 }
 
+// Returns the range of the sorted sources whose doc ids start with prefix.
+std::pair<size_t, size_t> prefixRange(const std::vector<Source> &sources,
+                                      const std::string &prefix) {
+  auto begin = std::lower_bound(
+      sources.begin(), sources.end(), prefix,
+      [](const Source &s, const std::string &p) { return s.doc_id < p; });
+
+  auto end = std::partition_point(begin, sources.end(), [&](const Source &s) {
+    return s.doc_id.compare(0, prefix.size(), prefix) == 0;
+  });
+
+  return {begin - sources.begin(), end - sources.begin()};
+}
+
+Sources_t *NeuralDB_sources_page(NeuralDB_t *ndb, const char *after_doc_id,
+                                 unsigned int after_doc_version,
+                                 const char *doc_id_prefix, unsigned int limit,
+                                 const char **err_ptr) {
+  try {
+    auto sources = ndb->sources.get(*ndb->ndb);
+    auto [begin, end] = prefixRange(*sources, doc_id_prefix);
+
+    if (after_doc_id) {
+      Source after(/*document=*/"", after_doc_id, after_doc_version);
+      auto it = std::upper_bound(sources->begin(), sources->end(), after,
+                                 sourceLess);
+      begin = std::max<size_t>(begin, it - sources->begin());
+    }
+
+    begin = std::min(begin, end);
+    end = std::min<size_t>(end, begin + limit);
+
+    return new Sources_t{std::move(sources), begin, end};
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return nullptr;
+  }
+}
+
+unsigned int NeuralDB_sources_count(NeuralDB_t *ndb, const char *doc_id_prefix,
+                                    const char **err_ptr) {
+  try {
+    auto sources = ndb->sources.get(*ndb->ndb);
+    auto [begin, end] = prefixRange(*sources, doc_id_prefix);
+    return end - begin;
+  } catch (const std::exception &e) {
+    copyError(e, err_ptr);
+    return 0;
+  }
+}
+
 void NeuralDB_save(NeuralDB_t *ndb, const char *save_path,
                    const char **err_ptr) {
   try {
     ndb->ndb->save(save_path);
+    ndb->dense.save(save_path);
   } catch (const std::exception &e) {
     copyError(e, err_ptr);
     return;
   }
 }
+
+void NeuralDB_set_query_cache_size(NeuralDB_t *ndb, unsigned long long bytes) {
+  ndb->cache.setCapacity(bytes);
+}
+
+QueryCacheStats_t NeuralDB_query_cache_stats(NeuralDB_t *ndb) {
+  return ndb->cache.stats();
+}
+
+DenseIndexStats_t NeuralDB_dense_index_stats(NeuralDB_t *ndb) {
+  return ndb->dense.stats();
+}
+
+void NeuralDB_set_insert_threads(NeuralDB_t *ndb, unsigned int n_threads) {
+  ndb->insert_threads = n_threads;
+}
+
+unsigned int NeuralDB_insert_threads(NeuralDB_t *ndb) {
+  return ndb->insert_threads;
+}
+
+unsigned int NeuralDB_max_insert_threads() { return omp_get_max_threads(); }
@@ -16,20 +16,40 @@ void MetadataValue_free(MetadataValue_t *value);
 typedef struct Document_t Document_t;
 Document_t *Document_new(const char *document, const char *doc_id);
 void Document_free(Document_t *doc);
-void Document_add_chunk(Document_t *doc, const char *chunk);
+// Adds n chunks, chunk i is the bytes chunks[offsets[i]:offsets[i+1]], thus
+// offsets must have n+1 entries.
+void Document_add_chunks(Document_t *doc, const char *chunks,
+                         const unsigned long long *offsets, unsigned int n);
 void Document_set_version(Document_t *doc, unsigned int version);
-void Document_add_metadata(Document_t *doc, unsigned int i, const char *key,
-                           const MetadataValue_t *value);
-
-typedef struct MetadataList_t MetadataList_t;
-void MetadataList_free(MetadataList_t *metadata);
-unsigned int MetadataList_len(MetadataList_t *metadata);
-const char *MetadataList_key(MetadataList_t *metadata, unsigned int i);
-int MetadataList_type(MetadataList_t *metadata, unsigned int i);
-bool MetadataList_bool(MetadataList_t *metadata, unsigned int i);
-int MetadataList_int(MetadataList_t *metadata, unsigned int i);
-float MetadataList_float(MetadataList_t *metadata, unsigned int i);
-const char *MetadataList_str(MetadataList_t *metadata, unsigned int i);
+// Adds the embeddings of the next n chunks, the embedding of chunk i is
+// embeddings[i*dim:(i+1)*dim]. If a document has embeddings it must have one
+// for each chunk, and all embeddings in an ndb must have the same dimension.
+void Document_add_embeddings(Document_t *doc, const float *embeddings,
+                             unsigned int n, unsigned int dim);
+
+// A metadata value for a single chunk. The key is an index into the key
+// dictionary passed with the cells, and only the value field corresponding to
+// type is read. String values are values[str_offset:str_offset+str_len].
+typedef struct {
+  unsigned int chunk;
+  unsigned int key;
+  int type;
+  bool bool_value;
+  int int_value;
+  float float_value;
+  unsigned long long str_offset;
+  unsigned int str_len;
+} MetadataCell_t;
+
+// Key i of the dictionary is keys[key_offsets[i]:key_offsets[i+1]], thus
+// key_offsets must have n_keys+1 entries. The chunk of each cell is the index
+// of a chunk already added to the document.
+void Document_add_metadata_block(Document_t *doc, const char *keys,
+                                 const unsigned int *key_offsets,
+                                 unsigned int n_keys,
+                                 const MetadataCell_t *cells,
+                                 unsigned int n_cells, const char *values,
+                                 const char **err_ptr);
 
 typedef struct Constraints_t Constraints_t;
 Constraints_t *Constraints_new();
@@ -42,25 +62,134 @@ void Constraints_add_any_of_constraint(Constraints_t *constraints,
                                        const MetadataValue_t **values, int n);
 
 typedef struct QueryResults_t QueryResults_t;
-unsigned int QueryResults_len(QueryResults_t *results);
-unsigned long long QueryResults_id(QueryResults_t *results, unsigned int i);
 void QueryResults_free(QueryResults_t *results);
-const char *QueryResults_text(QueryResults_t *results, unsigned int i);
-const char *QueryResults_document(QueryResults_t *results, unsigned int i);
-const char *QueryResults_doc_id(QueryResults_t *results, unsigned int i);
-unsigned int QueryResults_doc_version(QueryResults_t *results, unsigned int i);
-MetadataList_t *QueryResults_metadata(QueryResults_t *results, unsigned int i);
-float QueryResults_score(QueryResults_t *results, unsigned int i);
+
+// Offsets and lengths of strings are relative to QueryResultsView_t.data.
+// Metadata entries for a result are metadata[metadata_offset] through
+// metadata[metadata_offset + metadata_len - 1].
+// Results from the same document share the copy of the document and doc_id
+// strings in data.
+typedef struct {
+  unsigned long long id;
+  float score;
+  unsigned int doc_version;
+  unsigned int text_offset;
+  unsigned int text_len;
+  unsigned int document_offset;
+  unsigned int document_len;
+  unsigned int doc_id_offset;
+  unsigned int doc_id_len;
+  unsigned int metadata_offset;
+  unsigned int metadata_len;
+} QueryResultEntry_t;
+
+// Each distinct metadata key in the results is stored once, metadata entries
+// refer to their key by its index in QueryResultsView_t.keys.
+typedef struct {
+  unsigned int offset;
+  unsigned int len;
+} MetadataKey_t;
+
+// Only the value field corresponding to type is set.
+typedef struct {
+  unsigned int key;
+  int type;
+  bool bool_value;
+  int int_value;
+  float float_value;
+  unsigned int str_offset;
+  unsigned int str_len;
+} MetadataEntry_t;
+
+typedef struct {
+  const QueryResultEntry_t *entries;
+  unsigned int n_entries;
+  const MetadataEntry_t *metadata;
+  unsigned int n_metadata;
+  const MetadataKey_t *keys;
+  unsigned int n_keys;
+  const char *data;
+  unsigned int data_len;
+} QueryResultsView_t;
+
+// The view references memory owned by the results, and is valid until the
+// results are freed.
+QueryResultsView_t QueryResults_view(QueryResults_t *results);
+
+// The time spent in each stage of the query that produced the results, the
+// times are 0 if the results were read from the query cache.
+typedef struct {
+  bool cached;
+  // Time spent in OnDiskNeuralDB::query or rank.
+  unsigned long long engine_ns;
+  // Time spent serializing the results into the buffers read by Go.
+  unsigned long long serialize_ns;
+} QueryTimings_t;
+
+QueryTimings_t QueryResults_timings(QueryResults_t *results);
+
+typedef struct BatchQueryResults_t BatchQueryResults_t;
+void BatchQueryResults_free(BatchQueryResults_t *results);
+unsigned int BatchQueryResults_len(BatchQueryResults_t *results);
+// The returned results are owned by the batch and must not be freed directly.
+QueryResults_t *BatchQueryResults_get(BatchQueryResults_t *results,
+                                      unsigned int i);
+// Returns false if the query was not run because its deadline expired first,
+// in which case its results are empty.
+bool BatchQueryResults_completed(BatchQueryResults_t *results, unsigned int i);
+
+// A deadline stops queries from starting once it expires or is cancelled. The
+// engine cannot be interrupted once OnDiskNeuralDB::query or rank is called,
+// so the deadline is checked before each query is run.
+typedef struct QueryDeadline_t QueryDeadline_t;
+// The deadline expires after timeout_ns, or only when it is cancelled if
+// timeout_ns is 0.
+QueryDeadline_t *QueryDeadline_new(unsigned long long timeout_ns);
+void QueryDeadline_free(QueryDeadline_t *deadline);
+// Can be called concurrently with queries using the deadline.
+void QueryDeadline_cancel(QueryDeadline_t *deadline);
+bool QueryDeadline_expired(const QueryDeadline_t *deadline);
+
+// Lazy results hold the chunks returned by the query, but only the ids and
+// scores are copied out of them until the chunks are materialized.
+typedef struct LazyQueryResults_t LazyQueryResults_t;
+
+typedef struct {
+  unsigned long long id;
+  float score;
+} ScoredChunkId_t;
+
+void LazyQueryResults_free(LazyQueryResults_t *results);
+unsigned int LazyQueryResults_len(LazyQueryResults_t *results);
+// The ids are owned by the results, and are valid until the results are freed.
+const ScoredChunkId_t *LazyQueryResults_ids(LazyQueryResults_t *results);
+// Serializes the chunks at the given indices into the results, the indices must
+// be less than the number of results. The returned results must be freed.
+QueryResults_t *LazyQueryResults_materialize(LazyQueryResults_t *results,
+                                             const unsigned int *indices,
+                                             unsigned int n,
+                                             const char **err_ptr);
 
 typedef struct StringList_t StringList_t;
 StringList_t *StringList_new();
 void StringList_free(StringList_t *list);
 void StringList_append(StringList_t *list, const char *value);
+// Adds n strings, string i is the bytes values[offsets[i]:offsets[i+1]], thus
+// offsets must have n+1 entries.
+void StringList_append_packed(StringList_t *list, const char *values,
+                              const unsigned long long *offsets,
+                              unsigned int n);
 
 typedef struct LabelList_t LabelList_t;
 LabelList_t *LabelList_new();
 void LabelList_free(LabelList_t *list);
 void LabelList_append(LabelList_t *list, unsigned long long value);
+// Adds n sets of labels, the labels of set i are
+// labels[offsets[i]:offsets[i+1]], thus offsets must have n+1 entries.
+void LabelList_append_packed(LabelList_t *list,
+                             const unsigned long long *labels,
+                             const unsigned long long *offsets,
+                             unsigned int n);
 
 typedef struct Sources_t Sources_t;
 void Sources_free(Sources_t *sources);
@@ -70,13 +199,102 @@ const char *Sources_doc_id(Sources_t *sources, unsigned int i);
 unsigned int Sources_doc_version(Sources_t *sources, unsigned int i);
 
 typedef struct NeuralDB_t NeuralDB_t;
+
+typedef struct {
+  // Opens an existing ndb without write access, modifications of a read only
+  // ndb fail.
+  bool read_only;
+  // The maximum memory used by the query cache, see
+  // NeuralDB_set_query_cache_size.
+  unsigned long long query_cache_bytes;
+  // See NeuralDB_set_insert_threads.
+  unsigned int insert_threads;
+  // The maximum memory used by the embeddings of the chunks, inserts whose
+  // embeddings would exceed it fail. 0 does not limit the memory.
+  unsigned long long max_embedding_bytes;
+} NeuralDBOptions_t;
+
+NeuralDBOptions_t NeuralDB_default_options();
 NeuralDB_t *NeuralDB_new(const char *save_path, const char **err_ptr);
+NeuralDB_t *NeuralDB_new_with_options(const char *save_path,
+                                      const NeuralDBOptions_t *options,
+                                      const char **err_ptr);
 void NeuralDB_free(NeuralDB_t *ndb);
-void NeuralDB_insert(NeuralDB_t *ndb, Document_t *doc, const char **err_ptr);
+// The chunk ids and version assigned to an inserted document, as returned by
+// OnDiskNeuralDB::insert.
+typedef struct {
+  unsigned long long start_id;
+  unsigned long long end_id;
+  unsigned int doc_version;
+} InsertInfo_t;
+
+// info may be null, otherwise it is set if the insert succeeds.
+void NeuralDB_insert(NeuralDB_t *ndb, Document_t *doc, InsertInfo_t *info,
+                     const char **err_ptr);
+// Inserts the documents in order, stopping at the first error. Returns the
+// number of documents that were inserted.
+unsigned int NeuralDB_insert_batch(NeuralDB_t *ndb, Document_t **docs,
+                                   unsigned int n, const char **err_ptr);
+// The deadline may be null. Cached results are returned even if the deadline
+// has expired, otherwise the query fails without running. deadline_exceeded may
+// be null, otherwise it is set to true if the query failed because the deadline
+// had expired, so that it can be distinguished from other errors.
 QueryResults_t *NeuralDB_query(NeuralDB_t *ndb, const char *query,
                                unsigned int topk,
                                const Constraints_t *constraints,
-                               const char **err_ptr);
+                               const QueryDeadline_t *deadline,
+                               bool *deadline_exceeded, const char **err_ptr);
+
+// Fusion types for hybrid queries.
+enum { FusionReciprocalRank = 0, FusionWeighted = 1 };
+
+typedef struct {
+  // FusionReciprocalRank fuses the ranks of the candidates by their lexical and
+  // dense scores, FusionWeighted fuses the normalized scores.
+  int fusion;
+  // The weight of the dense scores in the fused score, between 0 and 1.
+  float dense_weight;
+  // The number of candidates retrieved by the ndb which are reranked, 0 uses
+  // 4*topk.
+  unsigned int n_candidates;
+} HybridOptions_t;
+
+HybridOptions_t NeuralDB_default_hybrid_options();
+
+// Retrieves candidates for the query from the ndb, computes the cosine
+// similarity of the embedding of the query with the embeddings of the
+// candidates, and returns the topk candidates by the fused scores. The scores
+// of the results are the fused scores. Hybrid queries are not cached.
+QueryResults_t *NeuralDB_query_hybrid(NeuralDB_t *ndb, const char *query,
+                                      const float *embedding, unsigned int dim,
+                                      unsigned int topk,
+                                      const Constraints_t *constraints,
+                                      const HybridOptions_t *options,
+                                      const char **err_ptr);
+// Lazy queries are not cached.
+LazyQueryResults_t *NeuralDB_query_lazy(NeuralDB_t *ndb, const char *query,
+                                        unsigned int topk,
+                                        const Constraints_t *constraints,
+                                        const char **err_ptr);
+// Runs the queries in parallel. topks and constraints must have the same length
+// as queries, entries in constraints may be null for unconstrained queries.
+// Queries are not started after the deadline expires, and the results of the
+// queries that completed are returned, see BatchQueryResults_completed. The
+// deadline may be null.
+BatchQueryResults_t *NeuralDB_query_batch(NeuralDB_t *ndb,
+                                          const StringList_t *queries,
+                                          const unsigned int *topks,
+                                          const Constraints_t **constraints,
+                                          const QueryDeadline_t *deadline,
+                                          const char **err_ptr);
+// Runs the queries on the ndb until all have completed or budget_ms has
+// elapsed, so that the RocksDB blocks they read are cached and their results
+// are in the query cache. Failed queries are skipped. Returns the number of
+// queries run.
+unsigned int NeuralDB_warmup(NeuralDB_t *ndb, const StringList_t *queries,
+                             const unsigned int *topks,
+                             const Constraints_t **constraints,
+                             unsigned int budget_ms);
 void NeuralDB_finetune(NeuralDB_t *ndb, const StringList_t *queries,
                        const LabelList_t *chunk_ids, const char **err_ptr);
 void NeuralDB_associate(NeuralDB_t *ndb, const StringList_t *sources,
@@ -84,10 +302,66 @@ void NeuralDB_associate(NeuralDB_t *ndb, const StringList_t *sources,
                         const char **err_ptr);
 void NeuralDB_delete_doc(NeuralDB_t *ndb, const char *doc_id,
                          bool keep_latest_version, const char **err_ptr);
+// Deletes the documents in order, stopping at the first error. Returns the
+// number of documents that were deleted, and sets n_versions to the number of
+// versions of those documents that were removed.
+unsigned int NeuralDB_delete_docs(NeuralDB_t *ndb, const StringList_t *doc_ids,
+                                  bool keep_latest_version,
+                                  unsigned int *n_versions,
+                                  const char **err_ptr);
+void NeuralDB_prune(NeuralDB_t *ndb, const char **err_ptr);
+// Returns the sources sorted by doc id and version.
 Sources_t *NeuralDB_sources(NeuralDB_t *ndb, const char **err_ptr);
+// Returns up to limit of the sources whose doc ids start with doc_id_prefix,
+// starting after the source with the given doc id and version, or from the
+// first source if after_doc_id is NULL. The sources are sorted by doc id and
+// version.
+Sources_t *NeuralDB_sources_page(NeuralDB_t *ndb, const char *after_doc_id,
+                                 unsigned int after_doc_version,
+                                 const char *doc_id_prefix, unsigned int limit,
+                                 const char **err_ptr);
+// Returns the number of sources whose doc ids start with doc_id_prefix.
+unsigned int NeuralDB_sources_count(NeuralDB_t *ndb, const char *doc_id_prefix,
+                                    const char **err_ptr);
 void NeuralDB_save(NeuralDB_t *ndb, const char *save_path,
                    const char **err_ptr);
 
+// Queries are cached in an LRU cache which is cleared whenever the ndb is
+// modified. The size is the maximum memory used by the cached results, a size
+// of 0 disables the cache.
+void NeuralDB_set_query_cache_size(NeuralDB_t *ndb, unsigned long long bytes);
+
+// Sets the number of threads used to tokenize and index the chunks of inserts,
+// 0 uses the default, which is the number of cores unless OMP_NUM_THREADS is
+// set.
+void NeuralDB_set_insert_threads(NeuralDB_t *ndb, unsigned int n_threads);
+unsigned int NeuralDB_insert_threads(NeuralDB_t *ndb);
+// The default number of insert threads.
+unsigned int NeuralDB_max_insert_threads();
+
+typedef struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  unsigned long long n_entries;
+  unsigned long long n_bytes;
+  unsigned long long capacity;
+} QueryCacheStats_t;
+
+QueryCacheStats_t NeuralDB_query_cache_stats(NeuralDB_t *ndb);
+
+// The embeddings used by hybrid queries, which are stored in the dense
+// directory of the ndb and loaded into memory when it is opened.
+typedef struct {
+  unsigned long long n_chunks;
+  unsigned long long n_bytes;
+  unsigned long long max_bytes;
+  // The dimension of the embeddings, 0 if the ndb has no embeddings.
+  unsigned int dim;
+} DenseIndexStats_t;
+
+DenseIndexStats_t NeuralDB_dense_index_stats(NeuralDB_t *ndb);
+
 #ifdef __cplusplus
 }
 #endif
@@ -13,6 +13,9 @@ class OnDiskNeuralDB final : public NeuralDB {
 public:
   static std::unique_ptr<OnDiskNeuralDB> make(const std::string &save_path);
 
+  static std::shared_ptr<OnDiskNeuralDB> load(const std::string &save_path,
+                                              bool read_only);
+
   explicit OnDiskNeuralDB(const std::string &save_path);
 
   InsertMetadata insert(const std::vector<std::string> &chunks,
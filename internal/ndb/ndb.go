@@ -2,28 +2,79 @@ package ndb
 
 // #cgo linux LDFLAGS: -L./lib/linux_amd64 -L./lib/linux_arm64 -lthirdai -lrocksdb -lutf8proc -lspdlog -fopenmp
 // #cgo darwin LDFLAGS: -L./lib/macos_arm64 -lthirdai -lrocksdb -lutf8proc -lspdlog -L/opt/homebrew/opt/libomp/lib/ -lomp
+// #cgo darwin CXXFLAGS: -I/opt/homebrew/opt/libomp/include
 // #cgo CFLAGS: -O3
 // #cgo CXXFLAGS: -O3 -fPIC -std=c++17 -I./include -fvisibility=hidden
 // #include "binding.h"
 // #include <stdlib.h>
 import "C"
 import (
+	"context"
 	"errors"
 	"fmt"
+	"math"
+	"sort"
+	"strconv"
 	"strings"
+	"time"
 	"unsafe"
 )
 
+// NeuralDB supports queries concurrently with inserts and finetuning, however
+// writes must be serialized, and deletes must not run concurrently with queries.
+// See the Concurrency section of Readme.md.
 type NeuralDB struct {
 	ndb *C.NeuralDB_t
 }
 
+// Options configure how an ndb is opened.
+type Options struct {
+	// ReadOnly opens an existing ndb without write access, any modifications of
+	// the ndb will fail.
+	ReadOnly bool
+	// QueryCacheSize is the maximum memory used by the query result cache, see
+	// SetQueryCacheSize.
+	QueryCacheSize uint64
+	// InsertThreads is the number of threads used by inserts, see
+	// SetInsertThreads.
+	InsertThreads int
+	// MaxEmbeddingBytes is the maximum memory used by the embeddings of the
+	// chunks, inserts whose embeddings would exceed it fail. 0 does not limit
+	// the memory.
+	MaxEmbeddingBytes uint64
+}
+
+func DefaultOptions() Options {
+	options := C.NeuralDB_default_options()
+	return Options{
+		ReadOnly:          bool(options.read_only),
+		QueryCacheSize:    uint64(options.query_cache_bytes),
+		InsertThreads:     int(options.insert_threads),
+		MaxEmbeddingBytes: uint64(options.max_embedding_bytes),
+	}
+}
+
 func New(savePath string) (NeuralDB, error) {
+	return NewWithOptions(savePath, DefaultOptions())
+}
+
+func NewWithOptions(savePath string, options Options) (NeuralDB, error) {
+	if options.InsertThreads < 0 {
+		return NeuralDB{}, errors.New("number of insert threads must be >= 0")
+	}
+
+	cOptions := C.NeuralDBOptions_t{
+		read_only:           C.bool(options.ReadOnly),
+		query_cache_bytes:   C.ulonglong(options.QueryCacheSize),
+		insert_threads:      C.uint(options.InsertThreads),
+		max_embedding_bytes: C.ulonglong(options.MaxEmbeddingBytes),
+	}
+
 	savePathCStr := C.CString(savePath)
 	defer C.free(unsafe.Pointer(savePathCStr))
 
 	var err *C.char
-	ndb := C.NeuralDB_new(savePathCStr, &err)
+	ndb := C.NeuralDB_new_with_options(savePathCStr, &cOptions, &err)
 	if err != nil {
 		defer C.free(unsafe.Pointer(err))
 		return NeuralDB{}, errors.New(C.GoString(err))
@@ -55,6 +106,20 @@ func newMetadataValue(value interface{}) (*C.MetadataValue_t, error) {
 	}
 }
 
+const (
+	metadataTypeBool C.int = iota
+	metadataTypeInt
+	metadataTypeFloat
+	metadataTypeStr
+)
+
+func bytesPtr(data []byte) *C.char {
+	if len(data) == 0 {
+		return nil
+	}
+	return (*C.char)(unsafe.Pointer(&data[0]))
+}
+
 func newDocument(document, docId string) *C.Document_t {
 	documentCStr := C.CString(document)
 	defer C.free(unsafe.Pointer(documentCStr))
@@ -66,28 +131,111 @@ func newDocument(document, docId string) *C.Document_t {
 	return doc
 }
 
-func addChunk(doc *C.Document_t, chunk string) {
-	chunkCStr := C.CString(chunk)
-	defer C.free(unsafe.Pointer(chunkCStr))
-	C.Document_add_chunk(doc, chunkCStr)
+// addChunks packs the chunks into a single buffer so that they can be added
+// with one cgo call.
+func addChunks(doc *C.Document_t, chunks []string) {
+	if len(chunks) == 0 {
+		return
+	}
+
+	data, offsets := packStrings(chunks)
+	C.Document_add_chunks(doc, bytesPtr(data), &offsets[0], C.uint(len(chunks)))
 }
 
-func addMetadata(doc *C.Document_t, i int, key string, value interface{}) error {
-	keyCStr := C.CString(key)
-	defer C.free(unsafe.Pointer(keyCStr))
+// packStrings concatenates the strings into a single buffer, string i is
+// data[offsets[i]:offsets[i+1]].
+func packStrings(values []string) ([]byte, []C.ulonglong) {
+	size := 0
+	for _, value := range values {
+		size += len(value)
+	}
 
-	metadataValue, err := newMetadataValue(value)
-	if err != nil {
-		return err
+	data := make([]byte, 0, size)
+	offsets := make([]C.ulonglong, len(values)+1)
+	for i, value := range values {
+		data = append(data, value...)
+		offsets[i+1] = C.ulonglong(len(data))
 	}
-	defer C.MetadataValue_free(metadataValue)
 
-	C.Document_add_metadata(doc, C.uint(i), keyCStr, metadataValue)
+	return data, offsets
+}
+
+// metadataBlock is metadata packed into a key dictionary and a list of typed
+// cells so that it can be added with one cgo call.
+type metadataBlock struct {
+	keys       []byte
+	keyOffsets []C.uint
+	nKeys      int
+	cells      []C.MetadataCell_t
+	values     []byte
+}
+
+// packMetadata packs the metadata, the metadata for chunk i is applied to chunk
+// firstChunk+i of the document.
+func packMetadata(firstChunk int, metadata []map[string]interface{}) (*metadataBlock, error) {
+	keyIds := make(map[string]C.uint)
+	keys := []byte{}
+	keyOffsets := []C.uint{0}
+	cells := []C.MetadataCell_t{}
+	values := []byte{}
+
+	for i, m := range metadata {
+		for key, value := range m {
+			keyId, ok := keyIds[key]
+			if !ok {
+				keyId = C.uint(len(keyIds))
+				keyIds[key] = keyId
+				keys = append(keys, key...)
+				keyOffsets = append(keyOffsets, C.uint(len(keys)))
+			}
+
+			cell := C.MetadataCell_t{chunk: C.uint(firstChunk + i), key: keyId}
+			switch value := value.(type) {
+			case bool:
+				cell._type = metadataTypeBool
+				cell.bool_value = C.bool(value)
+			case int:
+				cell._type = metadataTypeInt
+				cell.int_value = C.int(value)
+			case float32:
+				cell._type = metadataTypeFloat
+				cell.float_value = C.float(value)
+			case float64:
+				cell._type = metadataTypeFloat
+				cell.float_value = C.float(value)
+			case string:
+				cell._type = metadataTypeStr
+				cell.str_offset = C.ulonglong(len(values))
+				cell.str_len = C.uint(len(value))
+				values = append(values, value...)
+			default:
+				return nil, fmt.Errorf("unsupported metadata type %T for key %s value %v: type must be bool, int, float, or string", value, key, value)
+			}
+			cells = append(cells, cell)
+		}
+	}
+
+	return &metadataBlock{keys: keys, keyOffsets: keyOffsets, nKeys: len(keyIds), cells: cells, values: values}, nil
+}
+
+// add adds the metadata to the chunks of the document, which must already have
+// been added.
+func (m *metadataBlock) add(doc *C.Document_t) error {
+	if len(m.cells) == 0 {
+		return nil
+	}
+
+	var err *C.char
+	C.Document_add_metadata_block(doc, bytesPtr(m.keys), &m.keyOffsets[0], C.uint(m.nKeys), &m.cells[0], C.uint(len(m.cells)), bytesPtr(m.values), &err)
+	if err != nil {
+		defer C.free(unsafe.Pointer(err))
+		return errors.New(C.GoString(err))
+	}
 
 	return nil
 }
 
-func checkInsertArgs(document, docId string, chunks []string, metadata []map[string]interface{}) error {
+func checkDocumentArgs(document, docId string) error {
 	if len(document) == 0 {
 		return fmt.Errorf("document must not be empty string")
 	}
@@ -97,6 +245,10 @@ func checkInsertArgs(document, docId string, chunks []string, metadata []map[str
 	if strings.ContainsRune(docId, ';') {
 		return fmt.Errorf("doc_id cannot contain ';'")
 	}
+	return nil
+}
+
+func checkChunkArgs(chunks []string, metadata []map[string]interface{}) error {
 	if metadata != nil && len(chunks) != len(metadata) {
 		return fmt.Errorf("len of metadata must match the len of chunks if metadata is specified")
 	}
@@ -115,44 +267,229 @@ func checkInsertArgs(document, docId string, chunks []string, metadata []map[str
 	return nil
 }
 
+func checkInsertArgs(document, docId string, chunks []string, metadata []map[string]interface{}) error {
+	if err := checkDocumentArgs(document, docId); err != nil {
+		return err
+	}
+	return checkChunkArgs(chunks, metadata)
+}
+
+// DocumentBuilder allows for a document to be constructed incrementally, so
+// that the chunks can be passed to the C++ side as they are parsed, instead of
+// holding the entire document in memory before it is inserted.
+type DocumentBuilder struct {
+	doc          *C.Document_t
+	docId        string
+	nChunks      int
+	nEmbeddings  int
+	embeddingDim int
+}
+
+func NewDocumentBuilder(document, docId string) (*DocumentBuilder, error) {
+	if err := checkDocumentArgs(document, docId); err != nil {
+		return nil, err
+	}
+	return &DocumentBuilder{doc: newDocument(document, docId), docId: docId}, nil
+}
+
+func (b *DocumentBuilder) AddChunks(chunks []string, metadata []map[string]interface{}) error {
+	if err := checkChunkArgs(chunks, metadata); err != nil {
+		return err
+	}
+
+	// The metadata is converted before the document is modified, so that the
+	// document is unchanged if it is invalid.
+	block, err := packMetadata(b.nChunks, metadata) // this handles if metadata is nil
+	if err != nil {
+		return err
+	}
+
+	addChunks(b.doc, chunks)
+	b.nChunks += len(chunks)
+
+	return block.add(b.doc)
+}
+
+// AddEmbeddings adds the embeddings of the next chunks of the document, which
+// must already have been added. A document with embeddings must have an
+// embedding for each chunk, and all embeddings must have the same dimension.
+func (b *DocumentBuilder) AddEmbeddings(embeddings [][]float32) error {
+	if len(embeddings) == 0 {
+		return nil
+	}
+	if b.nEmbeddings+len(embeddings) > b.nChunks {
+		return fmt.Errorf("number of embeddings must not exceed the number of chunks")
+	}
+
+	dim := b.embeddingDim
+	if dim == 0 {
+		dim = len(embeddings[0])
+	}
+	if dim == 0 {
+		return fmt.Errorf("embeddings must not be empty")
+	}
+
+	flat := make([]float32, 0, len(embeddings)*dim)
+	for i, embedding := range embeddings {
+		if len(embedding) != dim {
+			return fmt.Errorf("embedding %d has dimension %d, expected %d", b.nEmbeddings+i, len(embedding), dim)
+		}
+		flat = append(flat, embedding...)
+	}
+
+	C.Document_add_embeddings(b.doc, (*C.float)(unsafe.Pointer(&flat[0])), C.uint(len(embeddings)), C.uint(dim))
+	b.nEmbeddings += len(embeddings)
+	b.embeddingDim = dim
+
+	return nil
+}
+
+func (b *DocumentBuilder) SetVersion(version uint) {
+	C.Document_set_version(b.doc, C.uint(version))
+}
+
+func (b *DocumentBuilder) DocId() string {
+	return b.docId
+}
+
+func (b *DocumentBuilder) NChunks() int {
+	return b.nChunks
+}
+
+// EmbeddingDim returns the dimension of the embeddings of the document, 0 if it
+// has no embeddings.
+func (b *DocumentBuilder) EmbeddingDim() int {
+	return b.embeddingDim
+}
+
+func (b *DocumentBuilder) Free() {
+	C.Document_free(b.doc)
+}
+
+type Document struct {
+	Document string
+	DocId    string
+	Chunks   []string
+	Metadata []map[string]interface{}
+	Version  *uint
+	// Embeddings are optional, if specified there must be one for each chunk,
+	// see DocumentBuilder.AddEmbeddings.
+	Embeddings [][]float32
+}
+
+func buildDocument(document Document) (*DocumentBuilder, error) {
+	builder, err := NewDocumentBuilder(document.Document, document.DocId)
+	if err != nil {
+		return nil, err
+	}
+
+	if err := builder.AddChunks(document.Chunks, document.Metadata); err != nil {
+		builder.Free()
+		return nil, err
+	}
+
+	if len(document.Embeddings) > 0 && len(document.Embeddings) != len(document.Chunks) {
+		builder.Free()
+		return nil, fmt.Errorf("len of embeddings must match the len of chunks if embeddings are specified")
+	}
+
+	if err := builder.AddEmbeddings(document.Embeddings); err != nil {
+		builder.Free()
+		return nil, err
+	}
+
+	if document.Version != nil {
+		builder.SetVersion(*document.Version)
+	}
+
+	return builder, nil
+}
+
 func (ndb *NeuralDB) Insert(document, docId string, chunks []string, metadata []map[string]interface{}, version *uint) error {
-	if err := checkInsertArgs(document, docId, chunks, metadata); err != nil {
+	builder, err := buildDocument(Document{Document: document, DocId: docId, Chunks: chunks, Metadata: metadata, Version: version})
+	if err != nil {
 		return err
 	}
+	defer builder.Free()
 
-	doc := newDocument(document, docId)
-	defer C.Document_free(doc)
-	for _, chunk := range chunks {
-		addChunk(doc, chunk)
+	_, err = ndb.InsertDocument(builder)
+	return err
+}
+
+// InsertInfo is the version and the range of chunk ids that OnDiskNeuralDB
+// assigned to an inserted document, the chunks have the ids from StartId up to
+// but not including EndId.
+type InsertInfo struct {
+	DocVersion uint
+	StartId    uint64
+	EndId      uint64
+}
+
+func (ndb *NeuralDB) InsertDocument(builder *DocumentBuilder) (InsertInfo, error) {
+	var info C.InsertInfo_t
+	var errMsg *C.char
+	C.NeuralDB_insert(ndb.ndb, builder.doc, &info, &errMsg)
+	if errMsg != nil {
+		defer C.free(unsafe.Pointer(errMsg))
+		return InsertInfo{}, errors.New(C.GoString(errMsg))
 	}
 
-	for i, m := range metadata { // this handles if metadata is nil
-		for k, v := range m {
-			err := addMetadata(doc, i, k, v)
-			if err != nil {
-				return err
-			}
+	return InsertInfo{DocVersion: uint(info.doc_version), StartId: uint64(info.start_id), EndId: uint64(info.end_id)}, nil
+}
+
+// InsertBatch inserts the documents in order with a single cgo call. The
+// arguments of all documents are validated before any are inserted, if an
+// insert fails then the documents before it will have been inserted and the
+// documents after it will not. Returns the number of documents that were
+// inserted.
+func (ndb *NeuralDB) InsertBatch(documents []Document) (int, error) {
+	for i, document := range documents {
+		if err := checkInsertArgs(document.Document, document.DocId, document.Chunks, document.Metadata); err != nil {
+			return 0, fmt.Errorf("document %d: %w", i, err)
 		}
 	}
 
-	if version != nil {
-		C.Document_set_version(doc, C.uint(*version))
+	if len(documents) == 0 {
+		return 0, nil
+	}
+
+	docs := make([]*C.Document_t, 0, len(documents))
+	defer func() {
+		for _, doc := range docs {
+			C.Document_free(doc)
+		}
+	}()
+
+	for _, document := range documents {
+		builder, err := buildDocument(document)
+		if err != nil {
+			return 0, err
+		}
+		docs = append(docs, builder.doc)
 	}
 
 	var err *C.char
-	C.NeuralDB_insert(ndb.ndb, doc, &err)
+	n := C.NeuralDB_insert_batch(ndb.ndb, &docs[0], C.uint(len(docs)), &err)
 	if err != nil {
 		defer C.free(unsafe.Pointer(err))
-		return errors.New(C.GoString(err))
+		return int(n), errors.New(C.GoString(err))
 	}
 
-	return nil
+	return int(n), nil
 }
 
 type Constraint interface {
 	addToConstraints(constraints *C.Constraints_t, key string) error
 
 	debug() string
+	// key identifies the constraint, see Constraints.Key.
+	key() string
+}
+
+// valueKey identifies a constraint value by its type and its quoted value, so
+// that keys of different values cannot be equal.
+func valueKey(value interface{}) string {
+	return fmt.Sprintf("%T:%q", value, fmt.Sprint(value))
 }
 
 type binaryConstraintOp int8
@@ -199,6 +536,10 @@ func (c binaryConstraint) debug() string {
 	}
 }
 
+func (c binaryConstraint) key() string {
+	return fmt.Sprintf("%d:%s", c.op, valueKey(c.value))
+}
+
 func EqualTo(value interface{}) Constraint {
 	return binaryConstraint{value: value, op: BinaryConstraintEq}
 }
@@ -251,27 +592,58 @@ func (c anyOfConstraint) debug() string {
 	return s.String()
 }
 
+func (c anyOfConstraint) key() string {
+	s := strings.Builder{}
+	s.WriteString("AnyOf")
+	for _, v := range c.values {
+		s.WriteString(",")
+		s.WriteString(valueKey(v))
+	}
+	return s.String()
+}
+
 func AnyOf(values []interface{}) Constraint {
 	return anyOfConstraint{values: values}
 }
 
 type Constraints map[string]Constraint
 
+func (c Constraints) sortedKeys() []string {
+	keys := make([]string, 0, len(c))
+	for k := range c {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	return keys
+}
+
 func (c *Constraints) String() string {
 	s := strings.Builder{}
 	s.WriteString("Constraints{")
-	first := true
-	for k, v := range *c {
-		if !first {
+	for i, k := range c.sortedKeys() {
+		if i > 0 {
 			s.WriteString(", ")
 		}
-		s.WriteString(fmt.Sprintf("%s: %s", k, v.debug()))
-		first = false
+		s.WriteString(fmt.Sprintf("%s: %s", k, (*c)[k].debug()))
 	}
 	s.WriteString("}")
 	return s.String()
 }
 
+// Key returns a string that identifies the constraints, equal constraints have
+// the same key regardless of the iteration order of the map. Unlike String, the
+// keys of different constraints are never equal.
+func (c Constraints) Key() string {
+	s := strings.Builder{}
+	for _, k := range c.sortedKeys() {
+		s.WriteString(strconv.Quote(k))
+		s.WriteString("=")
+		s.WriteString(c[k].key())
+		s.WriteString(";")
+	}
+	return s.String()
+}
+
 func newConstraints(constraints Constraints) (*C.Constraints_t, error) {
 	constraintsMap := C.Constraints_new()
 
@@ -295,9 +667,12 @@ type Chunk struct {
 	Score      float32
 }
 
-func (ndb *NeuralDB) Query(query string, topk int, constraints Constraints) ([]Chunk, error) {
+// withQueryArgs converts the arguments of a query to their C representation, the
+// arguments are freed once run returns.
+func withQueryArgs[T any](query string, topk int, constraints Constraints, run func(query *C.char, constraints *C.Constraints_t) (T, error)) (T, error) {
+	var zero T
 	if topk <= 0 {
-		return nil, errors.New("topk must be > 0")
+		return zero, errors.New("topk must be > 0")
 	}
 	queryCStr := C.CString(query)
 	defer C.free(unsafe.Pointer(queryCStr))
@@ -312,70 +687,487 @@ func (ndb *NeuralDB) Query(query string, topk int, constraints Constraints) ([]C
 			defer C.Constraints_free(constraintsMap)
 		}
 		if err != nil {
-			return nil, err
+			return zero, err
 		}
 	}
 
+	return run(queryCStr, constraintsMap)
+}
+
+func (ndb *NeuralDB) Query(query string, topk int, constraints Constraints) ([]Chunk, error) {
+	chunks, _, err := ndb.QueryContext(context.Background(), query, topk, constraints)
+	return chunks, err
+}
+
+// queryDeadline passes the deadline and cancellation of a context to the C++
+// side, it is nil for contexts which are never done.
+type queryDeadline struct {
+	deadline  *C.QueryDeadline_t
+	stop      func() bool
+	cancelled chan struct{}
+}
+
+// newQueryDeadline returns the error of the context if it is already done.
+func newQueryDeadline(ctx context.Context) (*queryDeadline, error) {
+	if err := ctx.Err(); err != nil {
+		return nil, err
+	}
+	if ctx.Done() == nil {
+		return nil, nil
+	}
+
+	timeout := time.Duration(0)
+	if deadline, ok := ctx.Deadline(); ok {
+		timeout = time.Until(deadline)
+		if timeout <= 0 {
+			return nil, context.DeadlineExceeded
+		}
+	}
+
+	d := &queryDeadline{
+		deadline:  C.QueryDeadline_new(C.ulonglong(timeout)),
+		cancelled: make(chan struct{}),
+	}
+	d.stop = context.AfterFunc(ctx, func() {
+		C.QueryDeadline_cancel(d.deadline)
+		close(d.cancelled)
+	})
+	return d, nil
+}
+
+func (d *queryDeadline) ptr() *C.QueryDeadline_t {
+	if d == nil {
+		return nil
+	}
+	return d.deadline
+}
+
+// err returns the error of the context if the deadline has expired.
+func (d *queryDeadline) err(ctx context.Context) error {
+	if d == nil || !bool(C.QueryDeadline_expired(d.deadline)) {
+		return nil
+	}
+	if err := ctx.Err(); err != nil {
+		return err
+	}
+	return context.DeadlineExceeded
+}
+
+func (d *queryDeadline) free() {
+	if d == nil {
+		return
+	}
+	if !d.stop() {
+		// The context is done, so the deadline cannot be freed until it has been
+		// cancelled.
+		<-d.cancelled
+	}
+	C.QueryDeadline_free(d.deadline)
+}
+
+// QueryTimings is the time spent in each stage of a query.
+type QueryTimings struct {
+	// Cached indicates the results were read from the query cache, in which case
+	// Engine and Serialize are 0.
+	Cached bool
+	// Args is the time spent converting the query and constraints to their C
+	// representation.
+	Args time.Duration
+	// Engine is the time spent in OnDiskNeuralDB::query or rank, which includes
+	// scoring the candidates, evaluating constraints, and reading the chunks.
+	Engine time.Duration
+	// Serialize is the time spent serializing the results in C++.
+	Serialize time.Duration
+	// Convert is the time spent converting the results to Go.
+	Convert time.Duration
+}
+
+// QueryContext runs the query in the same way as Query, and also returns the
+// time spent in each stage of the query. If the context is done before the query
+// is run by the engine the error of the context is returned. The engine cannot be
+// interrupted once the query is running, so the query may complete after the
+// deadline of the context.
+func (ndb *NeuralDB) QueryContext(ctx context.Context, query string, topk int, constraints Constraints) ([]Chunk, QueryTimings, error) {
+	var timings QueryTimings
+	start := time.Now()
+
+	deadline, err := newQueryDeadline(ctx)
+	if err != nil {
+		return nil, timings, err
+	}
+	defer deadline.free()
+
+	chunks, err := withQueryArgs(query, topk, constraints, func(queryCStr *C.char, constraintsMap *C.Constraints_t) ([]Chunk, error) {
+		timings.Args = time.Since(start)
+
+		var err *C.char
+		var deadlineExceeded C.bool
+		results := C.NeuralDB_query(ndb.ndb, queryCStr, C.uint(topk), constraintsMap, deadline.ptr(), &deadlineExceeded, &err)
+		if err != nil {
+			defer C.free(unsafe.Pointer(err))
+			// Errors from the engine are returned even if the deadline has also
+			// expired, so that they are not reported as timeouts.
+			if bool(deadlineExceeded) {
+				return nil, deadline.err(ctx)
+			}
+			return nil, errors.New(C.GoString(err))
+		}
+		defer C.QueryResults_free(results)
+
+		cTimings := C.QueryResults_timings(results)
+		timings.Cached = bool(cTimings.cached)
+		timings.Engine = time.Duration(cTimings.engine_ns)
+		timings.Serialize = time.Duration(cTimings.serialize_ns)
+
+		convertStart := time.Now()
+		chunks := convertResults(results)
+		timings.Convert = time.Since(convertStart)
+
+		return chunks, nil
+	})
+
+	return chunks, timings, err
+}
+
+type Fusion int
+
+const (
+	// ReciprocalRankFusion scores results by the weighted sum of 1/(60+rank)
+	// of their lexical and dense ranks.
+	ReciprocalRankFusion Fusion = C.FusionReciprocalRank
+	// WeightedFusion scores results by the weighted sum of their lexical score,
+	// normalized by the top lexical score, and their cosine similarity mapped to
+	// [0, 1].
+	WeightedFusion Fusion = C.FusionWeighted
+)
+
+type HybridOptions struct {
+	Fusion Fusion
+	// DenseWeight is the weight of the dense score, between 0 and 1.
+	DenseWeight float32
+	// Candidates is the number of results retrieved by the ndb that are
+	// reranked, 0 uses 4*topk.
+	Candidates int
+}
+
+func DefaultHybridOptions() HybridOptions {
+	options := C.NeuralDB_default_hybrid_options()
+	return HybridOptions{
+		Fusion:      Fusion(options.fusion),
+		DenseWeight: float32(options.dense_weight),
+		Candidates:  int(options.n_candidates),
+	}
+}
+
+// QueryHybrid reranks the candidates retrieved for the query by fusing their
+// scores with the cosine similarity of the embedding of the query and the
+// embeddings of the candidates, which are specified when documents are
+// inserted. Candidates without embeddings are ranked by their lexical score
+// only. The scores of the results are the fused scores.
+func (ndb *NeuralDB) QueryHybrid(query string, embedding []float32, topk int, constraints Constraints, options HybridOptions) ([]Chunk, error) {
+	if len(embedding) == 0 {
+		return nil, errors.New("embedding must not be empty")
+	}
+	if options.Candidates < 0 {
+		return nil, errors.New("candidates must be >= 0")
+	}
+
+	cOptions := C.HybridOptions_t{
+		fusion:       C.int(options.Fusion),
+		dense_weight: C.float(options.DenseWeight),
+		n_candidates: C.uint(options.Candidates),
+	}
+
+	return withQueryArgs(query, topk, constraints, func(queryCStr *C.char, constraintsMap *C.Constraints_t) ([]Chunk, error) {
+		var err *C.char
+		results := C.NeuralDB_query_hybrid(ndb.ndb, queryCStr, (*C.float)(unsafe.Pointer(&embedding[0])), C.uint(len(embedding)), C.uint(topk), constraintsMap, &cOptions, &err)
+		if err != nil {
+			defer C.free(unsafe.Pointer(err))
+			return nil, errors.New(C.GoString(err))
+		}
+		defer C.QueryResults_free(results)
+
+		return convertResults(results), nil
+	})
+}
+
+type ScoredId struct {
+	Id    uint64
+	Score float32
+}
+
+// LazyResults are the results of a query for which only the ids and scores have
+// been copied from the ndb, the text and metadata of the chunks are only copied
+// for the results requested with Chunks. Free must be called once the results
+// are no longer needed.
+type LazyResults struct {
+	results *C.LazyQueryResults_t
+	ids     []ScoredId
+}
+
+// QueryLazy runs a query and returns the ids and scores of the results, in order
+// of score. This is for callers such as re-rankers which only need the text and
+// metadata for some of the results. Lazy queries do not use the query cache.
+func (ndb *NeuralDB) QueryLazy(query string, topk int, constraints Constraints) (*LazyResults, error) {
+	return withQueryArgs(query, topk, constraints, func(queryCStr *C.char, constraintsMap *C.Constraints_t) (*LazyResults, error) {
+		var err *C.char
+		results := C.NeuralDB_query_lazy(ndb.ndb, queryCStr, C.uint(topk), constraintsMap, &err)
+		if err != nil {
+			defer C.free(unsafe.Pointer(err))
+			return nil, errors.New(C.GoString(err))
+		}
+
+		n := C.LazyQueryResults_len(results)
+		ids := make([]ScoredId, n)
+		for i, id := range unsafe.Slice(C.LazyQueryResults_ids(results), n) {
+			ids[i] = ScoredId{Id: uint64(id.id), Score: float32(id.score)}
+		}
+
+		return &LazyResults{results: results, ids: ids}, nil
+	})
+}
+
+func (r *LazyResults) Ids() []ScoredId {
+	return r.ids
+}
+
+// Chunks returns the chunks for the given indices into the results.
+func (r *LazyResults) Chunks(indices []int) ([]Chunk, error) {
+	if len(indices) == 0 {
+		return []Chunk{}, nil
+	}
+
+	cIndices := make([]C.uint, len(indices))
+	for i, idx := range indices {
+		if idx < 0 || idx >= len(r.ids) {
+			return nil, fmt.Errorf("result index %d is out of range for %d results", idx, len(r.ids))
+		}
+		cIndices[i] = C.uint(idx)
+	}
+
 	var err *C.char
-	results := C.NeuralDB_query(ndb.ndb, queryCStr, C.uint(topk), constraintsMap, &err)
+	results := C.LazyQueryResults_materialize(r.results, &cIndices[0], C.uint(len(cIndices)), &err)
 	if err != nil {
 		defer C.free(unsafe.Pointer(err))
 		return nil, errors.New(C.GoString(err))
 	}
 	defer C.QueryResults_free(results)
 
-	nResults := C.QueryResults_len(results)
-	chunks := make([]Chunk, nResults)
+	return convertResults(results), nil
+}
+
+func (r *LazyResults) Free() {
+	C.LazyQueryResults_free(r.results)
+}
+
+type BatchQuery struct {
+	Query       string
+	TopK        int
+	Constraints Constraints
+}
+
+// batchQueryArgs are the arguments of the queries in a batch converted for the
+// C++ side, free must be called once they are no longer needed.
+type batchQueryArgs struct {
+	queries     *C.StringList_t
+	topks       []C.uint
+	constraints []*C.Constraints_t
+}
+
+func newBatchQueryArgs(queries []BatchQuery) (*batchQueryArgs, error) {
+	texts := make([]string, len(queries))
+	for i, query := range queries {
+		if query.TopK <= 0 {
+			return nil, fmt.Errorf("query %d: topk must be > 0", i)
+		}
+		texts[i] = query.Query
+	}
+
+	args := &batchQueryArgs{
+		queries:     newStringList(texts),
+		topks:       make([]C.uint, len(queries)),
+		constraints: make([]*C.Constraints_t, len(queries)),
+	}
+
+	for i, query := range queries {
+		args.topks[i] = C.uint(query.TopK)
+
+		if len(query.Constraints) > 0 {
+			var err error
+			// The map is stored before checking the error so that partially converted
+			// constraints are still freed.
+			args.constraints[i], err = newConstraints(query.Constraints)
+			if err != nil {
+				args.free()
+				return nil, fmt.Errorf("query %d: %w", i, err)
+			}
+		}
+	}
+
+	return args, nil
+}
+
+func (args *batchQueryArgs) free() {
+	C.StringList_free(args.queries)
+	for _, constraintsMap := range args.constraints {
+		if constraintsMap != nil {
+			C.Constraints_free(constraintsMap)
+		}
+	}
+}
+
+func (ndb *NeuralDB) QueryBatch(queries []BatchQuery) ([][]Chunk, error) {
+	return ndb.QueryBatchContext(context.Background(), queries)
+}
+
+// QueryBatchContext runs the queries in the same way as QueryBatch, but queries
+// are not started once the context is done. In that case the results of the
+// queries that completed are returned along with the error of the context, and
+// the results of the other queries are nil.
+func (ndb *NeuralDB) QueryBatchContext(ctx context.Context, queries []BatchQuery) ([][]Chunk, error) {
+	if len(queries) == 0 {
+		return [][]Chunk{}, nil
+	}
+
+	args, err := newBatchQueryArgs(queries)
+	if err != nil {
+		return nil, err
+	}
+	defer args.free()
+
+	deadline, err := newQueryDeadline(ctx)
+	if err != nil {
+		return nil, err
+	}
+	defer deadline.free()
+
+	var cErr *C.char
+	results := C.NeuralDB_query_batch(ndb.ndb, args.queries, &args.topks[0], &args.constraints[0], deadline.ptr(), &cErr)
+	if cErr != nil {
+		defer C.free(unsafe.Pointer(cErr))
+		return nil, errors.New(C.GoString(cErr))
+	}
+	defer C.BatchQueryResults_free(results)
+
+	nResults := C.BatchQueryResults_len(results)
+	output := make([][]Chunk, nResults)
+	var incomplete error
 	for i := C.uint(0); i < nResults; i++ {
-		chunks[i].Id = uint64(C.QueryResults_id(results, i))
-		chunks[i].Text = C.GoString(C.QueryResults_text(results, i))
-		chunks[i].Document = C.GoString(C.QueryResults_document(results, i))
-		chunks[i].DocId = C.GoString(C.QueryResults_doc_id(results, i))
-		chunks[i].DocVersion = uint32(C.QueryResults_doc_version(results, i))
-		chunks[i].Score = float32(C.QueryResults_score(results, i))
-		chunks[i].Metadata = convertMetadata(C.QueryResults_metadata(results, i))
-	}
-
-	return chunks, nil
-}
-
-func convertMetadata(metadata *C.MetadataList_t) map[string]interface{} {
-	defer C.MetadataList_free(metadata)
-
-	len := C.MetadataList_len(metadata)
-	out := make(map[string]interface{})
-
-	for i := C.uint(0); i < len; i++ {
-		key := C.GoString(C.MetadataList_key(metadata, i))
-		switch C.MetadataList_type(metadata, i) {
-		case 0:
-			out[key] = bool(C.MetadataList_bool(metadata, i))
-		case 1:
-			out[key] = int(C.MetadataList_int(metadata, i))
-		case 2:
-			out[key] = float32(C.MetadataList_float(metadata, i))
-		case 3:
-			out[key] = C.GoString(C.MetadataList_str(metadata, i))
+		if !bool(C.BatchQueryResults_completed(results, i)) {
+			incomplete = deadline.err(ctx)
+			continue
+		}
+		output[i] = convertResults(C.BatchQueryResults_get(results, i))
+	}
+
+	return output, incomplete
+}
+
+// Warmup runs the queries on the ndb until they have all completed or the budget
+// has elapsed, so that the data they read is cached before the ndb serves
+// queries. The results are added to the query cache. Queries are started in
+// order, so the most important queries should be first. Returns the number of
+// queries that were run.
+func (ndb *NeuralDB) Warmup(queries []BatchQuery, budget time.Duration) (int, error) {
+	if len(queries) == 0 || budget <= 0 {
+		return 0, nil
+	}
+
+	args, err := newBatchQueryArgs(queries)
+	if err != nil {
+		return 0, err
+	}
+	defer args.free()
+
+	budgetMs := min(budget.Milliseconds(), math.MaxUint32)
+	n := C.NeuralDB_warmup(ndb.ndb, args.queries, &args.topks[0], &args.constraints[0], C.uint(budgetMs))
+	return int(n), nil
+}
+
+func convertResults(results *C.QueryResults_t) []Chunk {
+	view := C.QueryResults_view(results)
+
+	entries := unsafe.Slice(view.entries, view.n_entries)
+	metadata := unsafe.Slice(view.metadata, view.n_metadata)
+	// All strings in the results are substrings of this copy of the buffer, so
+	// decoding the results only requires a single allocation for string data.
+	// C.GoStringN is not used since its length is a C int, while the buffer can
+	// be up to UINT_MAX bytes.
+	data := string(unsafe.Slice((*byte)(unsafe.Pointer(view.data)), view.data_len))
+
+	substr := func(offset, len C.uint) string {
+		return data[offset : offset+len]
+	}
+
+	keys := make([]string, view.n_keys)
+	for i, key := range unsafe.Slice(view.keys, view.n_keys) {
+		keys[i] = substr(key.offset, key.len)
+	}
+
+	chunks := make([]Chunk, len(entries))
+	for i, entry := range entries {
+		chunks[i].Id = uint64(entry.id)
+		chunks[i].Text = substr(entry.text_offset, entry.text_len)
+		chunks[i].Document = substr(entry.document_offset, entry.document_len)
+		chunks[i].DocId = substr(entry.doc_id_offset, entry.doc_id_len)
+		chunks[i].DocVersion = uint32(entry.doc_version)
+		chunks[i].Score = float32(entry.score)
+		chunks[i].Metadata = convertMetadata(metadata[entry.metadata_offset:entry.metadata_offset+entry.metadata_len], keys, substr)
+	}
+	return chunks
+}
+
+func convertMetadata(metadata []C.MetadataEntry_t, keys []string, substr func(offset, len C.uint) string) map[string]interface{} {
+	out := make(map[string]interface{}, len(metadata))
+
+	for _, entry := range metadata {
+		key := keys[entry.key]
+		switch entry._type {
+		case metadataTypeBool:
+			out[key] = bool(entry.bool_value)
+		case metadataTypeInt:
+			out[key] = int(entry.int_value)
+		case metadataTypeFloat:
+			out[key] = float32(entry.float_value)
+		case metadataTypeStr:
+			out[key] = substr(entry.str_offset, entry.str_len)
 		}
 	}
 	return out
 }
 
+// newStringList and newLabelList pack the values so that the list is created
+// with a single cgo call.
 func newStringList(values []string) *C.StringList_t {
 	list := C.StringList_new()
-	for _, v := range values {
-		vCStr := C.CString(v)
-		C.StringList_append(list, vCStr)
-		C.free(unsafe.Pointer(vCStr))
+	if len(values) > 0 {
+		data, offsets := packStrings(values)
+		C.StringList_append_packed(list, bytesPtr(data), &offsets[0], C.uint(len(values)))
 	}
 	return list
 }
 
-func newLabelList(values []uint64) *C.LabelList_t {
+func newLabelList(labels [][]uint64) *C.LabelList_t {
 	list := C.LabelList_new()
-	for _, v := range values {
-		C.LabelList_append(list, C.ulonglong(v))
+	if len(labels) == 0 {
+		return list
+	}
+
+	size := 0
+	for _, set := range labels {
+		size += len(set)
 	}
+
+	packed := make([]C.ulonglong, 0, size)
+	offsets := make([]C.ulonglong, len(labels)+1)
+	for i, set := range labels {
+		for _, label := range set {
+			packed = append(packed, C.ulonglong(label))
+		}
+		offsets[i+1] = C.ulonglong(len(packed))
+	}
+
+	C.LabelList_append_packed(list, &packed[0], &offsets[0], C.uint(len(labels)))
 	return list
 }
 
@@ -386,11 +1178,42 @@ func CheckFinetuneArgs(queries []string, labels []uint64) error {
 	return nil
 }
 
+func CheckMultiLabelFinetuneArgs(queries []string, labels [][]uint64) error {
+	if len(queries) != len(labels) {
+		return fmt.Errorf("len of queries must match len of labels")
+	}
+	for i, set := range labels {
+		if len(set) == 0 {
+			return fmt.Errorf("query %d must have at least one label", i)
+		}
+	}
+	return nil
+}
+
 func (ndb *NeuralDB) Finetune(queries []string, labels []uint64) error {
 	if err := CheckFinetuneArgs(queries, labels); err != nil {
 		return err
 	}
 
+	sets := make([][]uint64, len(labels))
+	for i := range labels {
+		sets[i] = labels[i : i+1]
+	}
+
+	return ndb.finetune(queries, sets)
+}
+
+// FinetuneMultiLabel finetunes the ndb so that each query is associated with all
+// of its labels.
+func (ndb *NeuralDB) FinetuneMultiLabel(queries []string, labels [][]uint64) error {
+	if err := CheckMultiLabelFinetuneArgs(queries, labels); err != nil {
+		return err
+	}
+
+	return ndb.finetune(queries, labels)
+}
+
+func (ndb *NeuralDB) finetune(queries []string, labels [][]uint64) error {
 	queryList := newStringList(queries)
 	defer C.StringList_free(queryList)
 
@@ -453,30 +1276,153 @@ func (ndb *NeuralDB) Delete(docId string, keepLatestVersion bool) error {
 	return nil
 }
 
+func (ndb *NeuralDB) Prune() error {
+	var err *C.char
+	C.NeuralDB_prune(ndb.ndb, &err)
+	if err != nil {
+		defer C.free(unsafe.Pointer(err))
+		return errors.New(C.GoString(err))
+	}
+
+	return nil
+}
+
+// DeleteBatch deletes the documents in order with a single cgo call, stopping
+// at the first error. Returns the number of documents that were deleted, and
+// the number of versions of those documents that were removed.
+func (ndb *NeuralDB) DeleteBatch(docIds []string, keepLatestVersion bool) (int, int, error) {
+	if len(docIds) == 0 {
+		return 0, 0, nil
+	}
+
+	docIdList := newStringList(docIds)
+	defer C.StringList_free(docIdList)
+
+	var nVersions C.uint
+	var err *C.char
+	n := C.NeuralDB_delete_docs(ndb.ndb, docIdList, C.bool(keepLatestVersion), &nVersions, &err)
+	if err != nil {
+		defer C.free(unsafe.Pointer(err))
+		return int(n), int(nVersions), errors.New(C.GoString(err))
+	}
+
+	return int(n), int(nVersions), nil
+}
+
 type Source struct {
 	Document   string
 	DocId      string
 	DocVersion uint32
 }
 
-func (ndb *NeuralDB) Sources() ([]Source, error) {
+// SourceList is a list of sources which is stored by the ndb, so that the
+// sources can be iterated over without copying all of them. The list is not
+// changed by later modifications of the ndb and remains valid after the ndb is
+// freed. It must be freed with Free.
+type SourceList struct {
+	sources *C.Sources_t
+}
+
+func (l *SourceList) Len() int {
+	return int(C.Sources_len(l.sources))
+}
+
+func (l *SourceList) At(i int) Source {
+	return Source{
+		Document:   C.GoString(C.Sources_document(l.sources, C.uint(i))),
+		DocId:      C.GoString(C.Sources_doc_id(l.sources, C.uint(i))),
+		DocVersion: uint32(C.Sources_doc_version(l.sources, C.uint(i))),
+	}
+}
+
+func (l *SourceList) Slice() []Source {
+	output := make([]Source, l.Len())
+	for i := range output {
+		output[i] = l.At(i)
+	}
+	return output
+}
+
+func (l *SourceList) Free() {
+	C.Sources_free(l.sources)
+}
+
+// SourceList returns the sources in the ndb sorted by doc id and version. The
+// sorted sources are cached by the ndb until a modification changes them, so
+// this does not copy the sources.
+func (ndb *NeuralDB) SourceList() (*SourceList, error) {
 	var err *C.char
 	sources := C.NeuralDB_sources(ndb.ndb, &err)
 	if err != nil {
 		defer C.free(unsafe.Pointer(err))
 		return nil, errors.New(C.GoString(err))
 	}
-	defer C.Sources_free(sources)
+	return &SourceList{sources: sources}, nil
+}
 
-	nResults := C.Sources_len(sources)
-	output := make([]Source, nResults)
-	for i := C.uint(0); i < nResults; i++ {
-		output[i].Document = C.GoString(C.Sources_document(sources, i))
-		output[i].DocId = C.GoString(C.Sources_doc_id(sources, i))
-		output[i].DocVersion = uint32(C.Sources_doc_version(sources, i))
+// Sources returns the sources in the ndb sorted by doc id and version.
+func (ndb *NeuralDB) Sources() ([]Source, error) {
+	sources, err := ndb.SourceList()
+	if err != nil {
+		return nil, err
+	}
+	defer sources.Free()
+
+	return sources.Slice(), nil
+}
+
+// SourcesCursor identifies the last source of a page of sources.
+type SourcesCursor struct {
+	DocId      string
+	DocVersion uint32
+}
+
+// SourcesPage returns up to limit of the sources whose doc ids start with
+// prefix, sorted by doc id and version. If after is not nil the page starts
+// after the source it identifies, otherwise the page starts from the first
+// source.
+func (ndb *NeuralDB) SourcesPage(after *SourcesCursor, prefix string, limit int) ([]Source, error) {
+	if limit < 0 {
+		return nil, fmt.Errorf("limit must be >= 0")
+	}
+
+	var afterDocId *C.char
+	var afterDocVersion C.uint
+	if after != nil {
+		afterDocId = C.CString(after.DocId)
+		defer C.free(unsafe.Pointer(afterDocId))
+		afterDocVersion = C.uint(after.DocVersion)
+	}
+
+	prefixCStr := C.CString(prefix)
+	defer C.free(unsafe.Pointer(prefixCStr))
+
+	var err *C.char
+	sources := C.NeuralDB_sources_page(ndb.ndb, afterDocId, afterDocVersion, prefixCStr, C.uint(min(limit, math.MaxUint32)), &err)
+	if err != nil {
+		defer C.free(unsafe.Pointer(err))
+		return nil, errors.New(C.GoString(err))
+	}
+
+	list := SourceList{sources: sources}
+	defer list.Free()
+
+	return list.Slice(), nil
+}
+
+// SourcesCount returns the number of sources whose doc ids start with prefix.
+func (ndb *NeuralDB) SourcesCount(prefix string) (int, error) {
+	prefixCStr := C.CString(prefix)
+	defer C.free(unsafe.Pointer(prefixCStr))
+
+	var err *C.char
+	n := C.NeuralDB_sources_count(ndb.ndb, prefixCStr, &err)
+	if err != nil {
+		defer C.free(unsafe.Pointer(err))
+		return 0, errors.New(C.GoString(err))
 	}
 
-	return output, nil
+	return int(n), nil
 }
 
 func (ndb *NeuralDB) Save(savePath string) error {
@@ -492,3 +1438,70 @@ func (ndb *NeuralDB) Save(savePath string) error {
 
 	return nil
 }
+
+// SetQueryCacheSize sets the maximum memory used by the query result cache, a
+// size of 0 disables the cache. The cache is cleared whenever the ndb is modified.
+func (ndb *NeuralDB) SetQueryCacheSize(bytes uint64) {
+	C.NeuralDB_set_query_cache_size(ndb.ndb, C.ulonglong(bytes))
+}
+
+// SetInsertThreads sets the number of threads used to tokenize and index the
+// chunks of each insert, 0 uses the default, see DefaultInsertThreads.
+func (ndb *NeuralDB) SetInsertThreads(nThreads int) error {
+	if nThreads < 0 {
+		return errors.New("number of insert threads must be >= 0")
+	}
+	C.NeuralDB_set_insert_threads(ndb.ndb, C.uint(nThreads))
+	return nil
+}
+
+func (ndb *NeuralDB) InsertThreads() int {
+	return int(C.NeuralDB_insert_threads(ndb.ndb))
+}
+
+// DefaultInsertThreads is the number of threads used by inserts if the number
+// is not set, this is the number of cores unless OMP_NUM_THREADS is set.
+func DefaultInsertThreads() int {
+	return int(C.NeuralDB_max_insert_threads())
+}
+
+type QueryCacheStats struct {
+	Hits      uint64
+	Misses    uint64
+	Evictions uint64
+	Entries   uint64
+	Bytes     uint64
+	Capacity  uint64
+}
+
+func (ndb *NeuralDB) QueryCacheStats() QueryCacheStats {
+	stats := C.NeuralDB_query_cache_stats(ndb.ndb)
+	return QueryCacheStats{
+		Hits:      uint64(stats.hits),
+		Misses:    uint64(stats.misses),
+		Evictions: uint64(stats.evictions),
+		Entries:   uint64(stats.n_entries),
+		Bytes:     uint64(stats.n_bytes),
+		Capacity:  uint64(stats.capacity),
+	}
+}
+
+type DenseIndexStats struct {
+	Chunks   uint64
+	Bytes    uint64
+	MaxBytes uint64
+	// Dim is the dimension of the embeddings, 0 if the ndb has no embeddings.
+	Dim int
+}
+
+// DenseIndexStats returns the number of chunks with embeddings, the memory used
+// by their embeddings, and their dimension.
+func (ndb *NeuralDB) DenseIndexStats() DenseIndexStats {
+	stats := C.NeuralDB_dense_index_stats(ndb.ndb)
+	return DenseIndexStats{
+		Chunks:   uint64(stats.n_chunks),
+		Bytes:    uint64(stats.n_bytes),
+		MaxBytes: uint64(stats.max_bytes),
+		Dim:      int(stats.dim),
+	}
+}
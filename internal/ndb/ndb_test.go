@@ -1,12 +1,20 @@
 package ndb_test
 
 import (
+	"context"
+	"errors"
 	"fmt"
 	"ndb-server/internal/ndb"
+	"os"
+	"path/filepath"
+	"reflect"
+	"runtime"
 	"slices"
 	"strconv"
 	"strings"
 	"testing"
+	"time"
+	"unsafe"
 )
 
 func checkQuery(t *testing.T, ndb ndb.NeuralDB, query string, constraints ndb.Constraints, expectedIds []uint64) {
@@ -67,6 +75,77 @@ func TestBasicRetrieval(t *testing.T) {
 	checkQuery(t, db, "f g", ndb.Constraints{"q2": ndb.EqualTo(true)}, []uint64{6, 5, 7})
 }
 
+func TestQueryBatch(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	err = db.Insert(
+		"doc_1", "id_1",
+		[]string{"a b c d e g", "a b c d", "1 2 3", "x y z", "2 3", "c f", "f g d g", "c d e f"},
+		[]map[string]interface{}{{"q1": true}, {"q2": true}, {"q1": true}, {}, {"q2": true}, {"q2": true}, {"q2": true}, {"q1": true, "q2": true}},
+		nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	queries := []ndb.BatchQuery{
+		{Query: "a & b c", TopK: 4},
+		{Query: "a & b c", TopK: 2, Constraints: ndb.Constraints{"q1": ndb.EqualTo(true)}},
+		{Query: "f g", TopK: 5},
+		{Query: "f g", TopK: 3, Constraints: ndb.Constraints{"q2": ndb.EqualTo(true)}},
+		{Query: "no matching tokens", TopK: 5},
+	}
+
+	results, err := db.QueryBatch(queries)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	if len(results) != len(queries) {
+		t.Fatalf("expected %d results, got %d", len(queries), len(results))
+	}
+
+	for i, q := range queries {
+		expected, err := db.Query(q.Query, q.TopK, q.Constraints)
+		if err != nil {
+			t.Fatal(err)
+		}
+
+		if len(results[i]) != len(expected) {
+			t.Fatalf("query %d: expected %d results, got %d", i, len(expected), len(results[i]))
+		}
+		for j := range expected {
+			if results[i][j].Id != expected[j].Id || results[i][j].Score != expected[j].Score ||
+				results[i][j].Text != expected[j].Text || len(results[i][j].Metadata) != len(expected[j].Metadata) {
+				t.Fatalf("query %d: result %d does not match: expected %v got %v", i, j, expected[j], results[i][j])
+			}
+		}
+	}
+
+	if _, err := db.QueryBatch([]ndb.BatchQuery{{Query: "a", TopK: 1}, {Query: "b", TopK: 0}}); err == nil {
+		t.Fatal("expected error for invalid topk")
+	}
+
+	// Concurrent batches share the worker pool.
+	errs := make(chan error, 16)
+	for i := 0; i < 16; i++ {
+		go func() {
+			batch, err := db.QueryBatch(queries)
+			if err == nil && !reflect.DeepEqual(batch, results) {
+				err = fmt.Errorf("concurrent batch results do not match")
+			}
+			errs <- err
+		}()
+	}
+	for i := 0; i < 16; i++ {
+		if err := <-errs; err != nil {
+			t.Fatal(err)
+		}
+	}
+}
+
 func TestLessFrequentTokensScoreHigher(t *testing.T) {
 	db, err := ndb.New(t.TempDir())
 	if err != nil {
@@ -268,6 +347,289 @@ func TestReturnsCorrectChunkData(t *testing.T) {
 	}
 }
 
+func TestResultMetadataTypes(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	metadata := []map[string]interface{}{
+		{"bool": true, "int": -7, "float": 2.5, "str": "héllo wörld", "empty": ""},
+		{},
+		{"str": "second"},
+	}
+	err = db.Insert("dóc", "id", []string{"a b c ü", "a b", "a"}, metadata, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	results, err := db.Query("a b c ü", 3, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 3 {
+		t.Fatalf("expected 3 results, got %d", len(results))
+	}
+
+	expected := []map[string]interface{}{
+		{"bool": true, "int": -7, "float": float32(2.5), "str": "héllo wörld", "empty": ""},
+		{},
+		{"str": "second"},
+	}
+	expectedText := []string{"a b c ü", "a b", "a"}
+
+	for i, res := range results {
+		if res.Id != uint64(i) || res.Text != expectedText[i] || res.Document != "dóc" || res.DocId != "id" {
+			t.Fatalf("invalid result %d: %v", i, res)
+		}
+		if len(res.Metadata) != len(expected[i]) {
+			t.Fatalf("invalid metadata for result %d: %v", i, res.Metadata)
+		}
+		for k, v := range expected[i] {
+			if res.Metadata[k] != v {
+				t.Fatalf("invalid metadata for result %d key %s: expected %T:%v got %T:%v", i, k, v, v, res.Metadata[k], res.Metadata[k])
+			}
+		}
+	}
+}
+
+func TestInsertBatch(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	version := uint(3)
+	n, err := db.InsertBatch([]ndb.Document{
+		{Document: "doc_1", DocId: "id_1", Chunks: []string{"a b c d e g", "a b c d", "1 2 3"},
+			Metadata: []map[string]interface{}{{"q1": true}, {"q2": true, "k": "v"}, {"q1": true}}},
+		{Document: "doc_2", DocId: "id_2", Chunks: []string{"x y z", "2 3", "c f", "f g d g", "c d e f"}},
+		{Document: "doc_3", DocId: "id_3", Chunks: []string{"f t q v w", ""}, Version: &version},
+	})
+	if err != nil || n != 3 {
+		t.Fatalf("expected 3 docs to be inserted, got %d, %v", n, err)
+	}
+
+	checkQuery(t, db, "a & b c", nil, []uint64{1, 0, 5, 7})
+	checkQuery(t, db, "a & b c", ndb.Constraints{"q1": ndb.EqualTo(true)}, []uint64{0})
+
+	results, err := db.Query("a b c d", 1, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 1 || results[0].Document != "doc_1" || results[0].DocId != "id_1" ||
+		len(results[0].Metadata) != 2 || results[0].Metadata["k"] != "v" {
+		t.Fatalf("invalid results: %v", results)
+	}
+
+	sources, err := db.Sources()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(sources) != 3 {
+		t.Fatalf("expected 3 sources, got %v", sources)
+	}
+	for _, source := range sources {
+		if source.DocId == "id_3" && source.DocVersion != 3 {
+			t.Fatalf("expected doc version 3, got %v", source)
+		}
+	}
+
+	n, err = db.InsertBatch([]ndb.Document{
+		{Document: "doc_4", DocId: "id_4", Chunks: []string{"a"}},
+		{Document: "doc_5", DocId: "", Chunks: []string{"a"}},
+	})
+	if err == nil || n != 0 {
+		t.Fatalf("expected error for empty doc_id, got %d, %v", n, err)
+	}
+
+	sources, err = db.Sources()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(sources) != 3 {
+		t.Fatalf("no documents should be inserted if any are invalid, got %v", sources)
+	}
+
+	// The dimension of the embeddings is only checked against the index by the
+	// insert, so the batch fails after inserting the first document.
+	n, err = db.InsertBatch([]ndb.Document{
+		{Document: "doc_4", DocId: "id_4", Chunks: []string{"a"}, Embeddings: [][]float32{{1, 0}}},
+		{Document: "doc_5", DocId: "id_5", Chunks: []string{"a"}, Embeddings: [][]float32{{1, 0, 0}}},
+		{Document: "doc_6", DocId: "id_6", Chunks: []string{"a"}},
+	})
+	if err == nil || n != 1 || !strings.Contains(err.Error(), "id_5") {
+		t.Fatalf("expected error inserting the second document, got %d, %v", n, err)
+	}
+
+	if count, err := db.SourcesCount(""); err != nil || count != 4 {
+		t.Fatalf("expected the documents before the error to be inserted, got %d, %v", count, err)
+	}
+}
+
+func TestDocumentBuilder(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	doc, err := ndb.NewDocumentBuilder("doc_1", "id_1")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer doc.Free()
+
+	if err := doc.AddChunks([]string{"a b c d e g", "a b c d"}, []map[string]interface{}{{"q1": true}, {"q2": true}}); err != nil {
+		t.Fatal(err)
+	}
+	if err := doc.AddChunks([]string{"1 2 3"}, nil); err != nil {
+		t.Fatal(err)
+	}
+	if err := doc.AddChunks([]string{"a b"}, []map[string]interface{}{{"q1": true}}); err != nil {
+		t.Fatal(err)
+	}
+	if err := doc.AddChunks([]string{"a"}, []map[string]interface{}{}); err == nil {
+		t.Fatal("expected error for mismatched metadata")
+	}
+	if err := doc.AddChunks([]string{"a"}, []map[string]interface{}{{"q1": []int{1}}}); err == nil {
+		t.Fatal("expected error for invalid metadata type")
+	}
+
+	if doc.NChunks() != 4 {
+		t.Fatalf("expected 4 chunks, got %d", doc.NChunks())
+	}
+
+	info, err := db.InsertDocument(doc)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if info != (ndb.InsertInfo{DocVersion: 1, StartId: 0, EndId: 4}) {
+		t.Fatalf("unexpected insert info %+v", info)
+	}
+
+	checkQuery(t, db, "a b c d", nil, []uint64{1, 0, 3})
+	checkQuery(t, db, "a b c d", ndb.Constraints{"q1": ndb.EqualTo(true)}, []uint64{0, 3})
+	checkQuery(t, db, "1 2 3", nil, []uint64{2})
+
+	if _, err := ndb.NewDocumentBuilder("doc_2", ""); err == nil {
+		t.Fatal("expected error for empty doc_id")
+	}
+}
+
+func TestConstraintsKey(t *testing.T) {
+	newConstraints := func() ndb.Constraints {
+		c := ndb.Constraints{}
+		for i := 0; i < 10; i++ {
+			c[fmt.Sprintf("k%d", i)] = ndb.EqualTo(i)
+		}
+		c["any"] = ndb.AnyOf([]interface{}{"a", "b"})
+		return c
+	}
+
+	// The iteration order of the maps is random, so the keys and strings of
+	// equal constraints must not depend on it.
+	first := newConstraints()
+	key, str := first.Key(), first.String()
+	for i := 0; i < 20; i++ {
+		c := newConstraints()
+		if c.Key() != key || c.String() != str {
+			t.Fatalf("equal constraints have different keys: %s, %s", c.Key(), key)
+		}
+	}
+
+	distinct := []ndb.Constraints{
+		nil,
+		{"k": ndb.EqualTo(1)},
+		{"k": ndb.EqualTo("1")},
+		{"k": ndb.EqualTo(1.0)},
+		{"k": ndb.LessThan(1)},
+		{"k": ndb.AnyOf([]interface{}{"a,b"})},
+		{"k": ndb.AnyOf([]interface{}{"a", "b"})},
+		{"k=": ndb.EqualTo(1)},
+		{"k": ndb.EqualTo(1), "j": ndb.EqualTo(1)},
+	}
+	keys := map[string]bool{}
+	for _, c := range distinct {
+		keys[c.Key()] = true
+	}
+	if len(keys) != len(distinct) {
+		t.Fatalf("expected %d distinct keys, got %v", len(distinct), keys)
+	}
+}
+
+func TestSelectiveConstraint(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// The chunks matching the constraint are the lowest scoring chunks for the
+	// query, the constraint should still be able to fill top_k.
+	chunks := []string{}
+	metadata := []map[string]interface{}{}
+	for i := 0; i < 5000; i++ {
+		if i%500 == 7 {
+			chunks = append(chunks, "target a b c d e f g h i j k l m n o p")
+		} else if i%50 == 0 {
+			chunks = append(chunks, "target")
+		} else {
+			chunks = append(chunks, "other")
+		}
+		metadata = append(metadata, map[string]interface{}{"tenant": i % 500})
+	}
+
+	if err := db.Insert("doc", "id", chunks, metadata, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	results, err := db.Query("target", 5, ndb.Constraints{"tenant": ndb.EqualTo(7)})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 5 {
+		t.Fatalf("expected 5 results, got %d", len(results))
+	}
+	for _, res := range results {
+		if res.Id%500 != 7 {
+			t.Fatalf("result %d does not match constraint", res.Id)
+		}
+	}
+}
+
+func TestLargeAnyOf(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	chunks := []string{}
+	metadata := []map[string]interface{}{}
+	for i := 0; i < 10; i++ {
+		chunks = append(chunks, strings.Repeat("a ", 10-i))
+		metadata = append(metadata, map[string]interface{}{"int": i, "str": fmt.Sprintf("v%d", i), "float": float32(i) + 0.5})
+	}
+
+	if err := db.Insert("doc", "id", chunks, metadata, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	ints, strs, mixed := []interface{}{}, []interface{}{}, []interface{}{}
+	for i := 100; i < 200; i++ {
+		ints = append(ints, i)
+		strs = append(strs, fmt.Sprintf("v%d", i))
+		mixed = append(mixed, i, fmt.Sprintf("v%d", i), float32(i)+0.5)
+	}
+	ints = append(ints, 3, 7)
+	strs = append(strs, "v2", "v5")
+	mixed = append(mixed, 4, "v8", float32(6.5), true)
+
+	checkQuery(t, db, "a", ndb.Constraints{"int": ndb.AnyOf(ints)}, []uint64{3, 7})
+	checkQuery(t, db, "a", ndb.Constraints{"str": ndb.AnyOf(strs)}, []uint64{2, 5})
+	checkQuery(t, db, "a", ndb.Constraints{"int": ndb.AnyOf(mixed)}, []uint64{4})
+	checkQuery(t, db, "a", ndb.Constraints{"str": ndb.AnyOf(mixed)}, []uint64{8})
+	checkQuery(t, db, "a", ndb.Constraints{"float": ndb.AnyOf(mixed)}, []uint64{6})
+}
+
 func TestFinetuning(t *testing.T) {
 	db, err := ndb.New(t.TempDir())
 	if err != nil {
@@ -300,6 +662,39 @@ func TestFinetuning(t *testing.T) {
 	checkQuery(t, db, query, constraints, []uint64{2, 1})
 }
 
+func TestFinetuningMultiLabel(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	err = db.Insert(
+		"doc", "id",
+		[]string{intString(0, 10), intString(0, 9), intString(0, 8),
+			intString(10, 20), intString(20, 30), intString(30, 40)},
+		nil, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	query := intString(0, 10) + " x y z"
+
+	checkQuery(t, db, query, nil, []uint64{0, 1, 2})
+
+	if err := db.FinetuneMultiLabel([]string{"x y z"}, [][]uint64{{}}); err == nil {
+		t.Fatal("expected error for query without labels")
+	}
+
+	err = db.FinetuneMultiLabel([]string{"x y z", "o p"}, [][]uint64{{2, 1}, {4}})
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	checkQuery(t, db, query, nil, []uint64{1, 2, 0})
+	checkQuery(t, db, "o p", nil, []uint64{4})
+}
+
 func TestDeletionWithFinetuning(t *testing.T) {
 	db, err := ndb.New(t.TempDir())
 	if err != nil {
@@ -477,3 +872,1055 @@ func TestDocVersioning(t *testing.T) {
 		}
 	}
 }
+
+func TestConcurrentQueriesAndInserts(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	words := []string{"apple", "banana", "cherry", "delta", "echo", "fox", "golf", "hotel"}
+	makeChunks := func(n, seed int) ([]string, []map[string]interface{}) {
+		chunks := make([]string, n)
+		metadata := make([]map[string]interface{}, n)
+		for i := range chunks {
+			chunks[i] = fmt.Sprintf("%s %s w%d", words[(i+seed)%len(words)], words[(3*i+seed)%len(words)], i%50)
+			metadata[i] = map[string]interface{}{"group": i % 10}
+		}
+		return chunks, metadata
+	}
+
+	chunks, metadata := makeChunks(1000, 0)
+	if err := db.Insert("doc", "base", chunks, metadata, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	done := make(chan struct{})
+	errs := make(chan error, 8)
+	for g := 0; g < 4; g++ {
+		go func(g int) {
+			for {
+				select {
+				case <-done:
+					errs <- nil
+					return
+				default:
+				}
+
+				var constraints ndb.Constraints
+				if g%2 == 0 {
+					constraints = ndb.Constraints{"group": ndb.EqualTo(g)}
+				}
+				results, err := db.Query(fmt.Sprintf("%s w%d", words[g], g), 10, constraints)
+				if err != nil {
+					errs <- err
+					return
+				}
+				if len(results) == 0 {
+					errs <- fmt.Errorf("query returned no results")
+					return
+				}
+				if _, err := db.Sources(); err != nil {
+					errs <- err
+					return
+				}
+			}
+		}(g)
+	}
+
+	for i := 0; i < 20; i++ {
+		chunks, metadata := makeChunks(200, i)
+		if err := db.Insert("doc", fmt.Sprintf("doc_%d", i), chunks, metadata, nil); err != nil {
+			t.Fatal(err)
+		}
+		if err := db.Finetune([]string{"apple w1"}, []uint64{uint64(i)}); err != nil {
+			t.Fatal(err)
+		}
+	}
+	close(done)
+
+	for g := 0; g < 4; g++ {
+		if err := <-errs; err != nil {
+			t.Fatalf("concurrent query failed: %v", err)
+		}
+	}
+}
+
+func TestQueryCache(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	err = db.Insert(
+		"doc_1", "id_1",
+		[]string{"a b c", "a b d", "c d e", "x y z"},
+		[]map[string]interface{}{{"k": 1}, {"k": 2}, {"k": 3}, {"k": 4}},
+		nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	checkStats := func(hits, misses uint64) {
+		stats := db.QueryCacheStats()
+		if stats.Hits != hits || stats.Misses != misses {
+			t.Fatalf("expected %d hits and %d misses, got %+v", hits, misses, stats)
+		}
+	}
+
+	checkQuery(t, db, "a b c", nil, []uint64{0, 1})
+	checkStats(0, 1)
+	checkQuery(t, db, "a b c", nil, []uint64{0, 1})
+	checkStats(1, 1)
+
+	// Different top_k and constraints are different entries.
+	checkQuery(t, db, "a b c", nil, []uint64{0})
+	checkStats(1, 2)
+	checkQuery(t, db, "a b c", ndb.Constraints{"k": ndb.AnyOf([]interface{}{2, 3})}, []uint64{1})
+	checkStats(1, 3)
+	checkQuery(t, db, "a b c", ndb.Constraints{"k": ndb.AnyOf([]interface{}{3, 2})}, []uint64{1})
+	checkStats(2, 3)
+	checkQuery(t, db, "a b c", ndb.Constraints{"k": ndb.EqualTo(1)}, []uint64{0})
+	checkStats(2, 4)
+
+	// Modifications invalidate the cache.
+	err = db.Insert("doc_2", "id_2", []string{"a b a b"}, nil, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if stats := db.QueryCacheStats(); stats.Entries != 0 || stats.Bytes != 0 {
+		t.Fatalf("cache should be empty after insert: %+v", stats)
+	}
+	checkQuery(t, db, "a b c", nil, []uint64{0, 4})
+	checkStats(2, 5)
+
+	if err := db.Delete("id_2", false); err != nil {
+		t.Fatal(err)
+	}
+	checkQuery(t, db, "a b c", nil, []uint64{0, 1})
+	checkStats(2, 6)
+
+	// The cache is bounded by the size of the cached results.
+	db.SetQueryCacheSize(1024)
+	for i := 0; i < 20; i++ {
+		if _, err := db.Query(fmt.Sprintf("a b c %d", i), 4, nil); err != nil {
+			t.Fatal(err)
+		}
+	}
+	stats := db.QueryCacheStats()
+	if stats.Evictions == 0 || stats.Bytes > 1024 || stats.Capacity != 1024 {
+		t.Fatalf("cache should be bounded by its capacity: %+v", stats)
+	}
+
+	db.SetQueryCacheSize(0)
+	checkQuery(t, db, "a b c", nil, []uint64{0, 1})
+	checkQuery(t, db, "a b c", nil, []uint64{0, 1})
+	if stats := db.QueryCacheStats(); stats.Entries != 0 || stats.Hits != 2 {
+		t.Fatalf("cache should be disabled: %+v", stats)
+	}
+}
+
+func TestLazyQuery(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	err = db.Insert(
+		"doc_1", "id_1",
+		[]string{"a b c", "a b d", "c d e", "x y z"},
+		[]map[string]interface{}{{"k": 1}, {"k": "v"}, {"k": 3.5}, {"k": true}},
+		nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	expected, err := db.Query("a b c", 3, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	results, err := db.QueryLazy("a b c", 3, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer results.Free()
+
+	ids := results.Ids()
+	if len(ids) != len(expected) {
+		t.Fatalf("expected %d results, got %d", len(expected), len(ids))
+	}
+	for i, id := range ids {
+		if id.Id != expected[i].Id || id.Score != expected[i].Score {
+			t.Fatalf("result %d: expected %d (%f) got %d (%f)", i, expected[i].Id, expected[i].Score, id.Id, id.Score)
+		}
+	}
+
+	chunks, err := results.Chunks([]int{2, 0})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(chunks) != 2 || chunks[0].Text != expected[2].Text || chunks[1].Text != expected[0].Text {
+		t.Fatalf("incorrect chunks: %+v", chunks)
+	}
+	if chunks[0].Id != expected[2].Id || chunks[0].Metadata["k"] != expected[2].Metadata["k"] || chunks[0].DocId != "id_1" {
+		t.Fatalf("incorrect chunk fields: %+v", chunks[0])
+	}
+
+	if _, err := results.Chunks([]int{3}); err == nil {
+		t.Fatal("expected error for out of range index")
+	}
+}
+
+func TestResultsShareDocumentStrings(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	if err := db.Insert("doc_1.csv", "id_1", []string{"a b c", "a b d", "a c e"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+	if err := db.Insert("doc_2.csv", "id_2", []string{"a b f"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	results, err := db.Query("a b c d e f", 4, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 4 {
+		t.Fatalf("expected 4 results, got %d", len(results))
+	}
+
+	docStrings := map[string]*byte{}
+	for _, chunk := range results {
+		for _, value := range []string{chunk.Document, chunk.DocId} {
+			// Strings from the same document should share the same bytes in the
+			// result buffer.
+			if ptr, ok := docStrings[value]; ok && ptr != unsafe.StringData(value) {
+				t.Fatalf("string '%s' is not shared between results", value)
+			}
+			docStrings[value] = unsafe.StringData(value)
+		}
+	}
+	if len(docStrings) != 4 {
+		t.Fatalf("expected 4 distinct document strings, got %v", docStrings)
+	}
+}
+
+func TestInsertThreads(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+
+	defaultThreads := ndb.DefaultInsertThreads()
+	if db.InsertThreads() != 0 || defaultThreads < 1 {
+		t.Fatalf("invalid default insert threads %d, %d", db.InsertThreads(), defaultThreads)
+	}
+
+	if err := db.SetInsertThreads(-1); err == nil {
+		t.Fatal("expected error for negative insert threads")
+	}
+
+	for i, nThreads := range []int{1, 3} {
+		if err := db.SetInsertThreads(nThreads); err != nil {
+			t.Fatal(err)
+		}
+		if db.InsertThreads() != nThreads {
+			t.Fatalf("expected %d insert threads, got %d", nThreads, db.InsertThreads())
+		}
+
+		chunks := make([]string, 1000)
+		for j := range chunks {
+			chunks[j] = fmt.Sprintf("thread%d chunk%d", nThreads, j)
+		}
+		if err := db.Insert("doc", fmt.Sprintf("id_%d", i), chunks, nil, nil); err != nil {
+			t.Fatal(err)
+		}
+
+		checkQuery(t, db, fmt.Sprintf("thread%d chunk17", nThreads), nil, []uint64{uint64(1000*i + 17)})
+	}
+
+	// The thread count is restored after each insert, since it is per OS thread
+	// the test must stay on the same thread to check this.
+	if ndb.DefaultInsertThreads() != defaultThreads {
+		t.Fatalf("default insert threads changed from %d to %d", defaultThreads, ndb.DefaultInsertThreads())
+	}
+}
+
+func TestReadOnly(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "ndb")
+
+	db, err := ndb.New(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := db.Insert("doc", "id", []string{"a b c", "d e f"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+	db.Free()
+
+	options := ndb.DefaultOptions()
+	options.ReadOnly = true
+	options.QueryCacheSize = 1024
+	options.InsertThreads = 2
+
+	readOnly, err := ndb.NewWithOptions(path, options)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer readOnly.Free()
+
+	checkQuery(t, readOnly, "d e", nil, []uint64{1})
+
+	if readOnly.QueryCacheStats().Capacity != 1024 || readOnly.InsertThreads() != 2 {
+		t.Fatal("options were not applied")
+	}
+
+	if err := readOnly.Insert("doc", "id2", []string{"g h i"}, nil, nil); err == nil {
+		t.Fatal("expected insert to fail in read only mode")
+	}
+	if err := readOnly.Finetune([]string{"g"}, []uint64{0}); err == nil {
+		t.Fatal("expected finetune to fail in read only mode")
+	}
+	if err := readOnly.Delete("id", false); err == nil {
+		t.Fatal("expected delete to fail in read only mode")
+	}
+
+	checkQuery(t, readOnly, "d e", nil, []uint64{1})
+
+	if _, err := ndb.NewWithOptions(filepath.Join(t.TempDir(), "missing"), options); err == nil {
+		t.Fatal("expected read only open of missing ndb to fail")
+	}
+}
+
+func TestWarmup(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	if err := db.Insert("doc", "id", []string{"a b c", "d e f", "g h i"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	queries := []ndb.BatchQuery{
+		{Query: "a b", TopK: 1},
+		{Query: "d e", TopK: 2},
+		{Query: "g h", TopK: 1, Constraints: ndb.Constraints{"k": ndb.EqualTo("v")}},
+	}
+
+	if n, err := db.Warmup(queries, 0); err != nil || n != 0 {
+		t.Fatalf("expected no queries to run without a budget, got %d, %v", n, err)
+	}
+
+	if _, err := db.Warmup([]ndb.BatchQuery{{Query: "a", TopK: 0}}, time.Second); err == nil {
+		t.Fatal("expected error for invalid topk")
+	}
+
+	n, err := db.Warmup(queries, time.Minute)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if n != len(queries) {
+		t.Fatalf("expected %d queries to run, got %d", len(queries), n)
+	}
+
+	stats := db.QueryCacheStats()
+	if stats.Entries != uint64(len(queries)) || stats.Hits != 0 {
+		t.Fatalf("expected warmup results to be cached, got %+v", stats)
+	}
+
+	results, err := db.Query("d e", 2, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 1 || results[0].Id != 1 {
+		t.Fatalf("unexpected results %v", results)
+	}
+
+	if stats := db.QueryCacheStats(); stats.Hits != 1 {
+		t.Fatalf("expected query to use warmup result, got %+v", stats)
+	}
+}
+
+func TestSaveHardLinksTableFiles(t *testing.T) {
+	dir := t.TempDir()
+
+	db, err := ndb.New(filepath.Join(dir, "live"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	for i := 0; i < 3; i++ {
+		chunks := make([]string, 500)
+		for j := range chunks {
+			chunks[j] = fmt.Sprintf("doc%d chunk%d", i, j)
+		}
+		if err := db.Insert("doc", fmt.Sprintf("id_%d", i), chunks, nil, nil); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	if err := db.Save(filepath.Join(dir, "snapshot")); err != nil {
+		t.Fatal(err)
+	}
+
+	tableFiles, err := filepath.Glob(filepath.Join(dir, "snapshot", "*", "*.sst"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(tableFiles) == 0 {
+		t.Fatal("expected snapshot to contain table files")
+	}
+
+	for _, snapshotFile := range tableFiles {
+		rel, err := filepath.Rel(filepath.Join(dir, "snapshot"), snapshotFile)
+		if err != nil {
+			t.Fatal(err)
+		}
+		snapshotInfo, err := os.Stat(snapshotFile)
+		if err != nil {
+			t.Fatal(err)
+		}
+		liveInfo, err := os.Stat(filepath.Join(dir, "live", rel))
+		if err != nil {
+			t.Fatal(err)
+		}
+		if !os.SameFile(snapshotInfo, liveInfo) {
+			t.Fatalf("expected %s to be a hard link to the live table file", rel)
+		}
+	}
+}
+
+func TestDeleteBatch(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	for i := 0; i < 5; i++ {
+		for j := 0; j < 2; j++ {
+			err := db.Insert(fmt.Sprintf("%d_%d", i, j+1), fmt.Sprintf("%d", i), []string{fmt.Sprintf("chunk%d", i)}, nil, nil)
+			if err != nil {
+				t.Fatal(err)
+			}
+		}
+	}
+
+	checkSources := func(expected []string) {
+		t.Helper()
+		sources, err := db.Sources()
+		if err != nil {
+			t.Fatal(err)
+		}
+		documents := make([]string, len(sources))
+		for i, source := range sources {
+			documents[i] = source.Document
+		}
+		slices.Sort(documents)
+		if !slices.Equal(documents, expected) {
+			t.Fatalf("expected sources %v, got %v", expected, documents)
+		}
+	}
+
+	if n, _, err := db.DeleteBatch(nil, false); n != 0 || err != nil {
+		t.Fatalf("expected empty batch to be a no-op, got %d, %v", n, err)
+	}
+
+	n, nVersions, err := db.DeleteBatch([]string{"0", "1"}, true)
+	if err != nil || n != 2 || nVersions != 2 {
+		t.Fatalf("expected 2 docs and 2 versions to be deleted, got %d, %d, %v", n, nVersions, err)
+	}
+	checkSources([]string{"0_2", "1_2", "2_1", "2_2", "3_1", "3_2", "4_1", "4_2"})
+
+	n, nVersions, err = db.DeleteBatch([]string{"2", "3", "4"}, false)
+	if err != nil || n != 3 || nVersions != 6 {
+		t.Fatalf("expected 3 docs and 6 versions to be deleted, got %d, %d, %v", n, nVersions, err)
+	}
+	checkSources([]string{"0_2", "1_2"})
+
+	// Deleting documents that do not exist removes no versions.
+	n, nVersions, err = db.DeleteBatch([]string{"2", "5"}, false)
+	if err != nil || n != 2 || nVersions != 0 {
+		t.Fatalf("expected 2 docs and no versions to be deleted, got %d, %d, %v", n, nVersions, err)
+	}
+
+	results, err := db.Query("chunk3", 5, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 0 {
+		t.Fatalf("expected no results for deleted doc, got %v", results)
+	}
+	checkQuery(t, db, "chunk1", nil, []uint64{3})
+}
+
+func TestPrune(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	docIds := make([]string, 10)
+	for i := range docIds {
+		docIds[i] = fmt.Sprintf("id_%d", i)
+		if err := db.Insert("doc", docIds[i], []string{fmt.Sprintf("chunk%d a b", i)}, nil, nil); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	if _, _, err := db.DeleteBatch(docIds[:5], false); err != nil {
+		t.Fatal(err)
+	}
+
+	if err := db.Prune(); err != nil {
+		t.Fatal(err)
+	}
+
+	for i := range docIds {
+		results, err := db.Query(fmt.Sprintf("chunk%d", i), 1, nil)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if i < 5 && len(results) != 0 {
+			t.Fatalf("expected no results for deleted doc %d, got %v", i, results)
+		}
+		if i >= 5 && (len(results) != 1 || results[0].DocId != docIds[i]) {
+			t.Fatalf("expected result for doc %d, got %v", i, results)
+		}
+	}
+}
+
+func TestSourcesPage(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	for _, docId := range []string{"b1", "a2", "b2", "a1", "c"} {
+		if err := db.Insert(docId+"_doc", docId, []string{"chunk " + docId}, nil, nil); err != nil {
+			t.Fatal(err)
+		}
+	}
+	if err := db.Insert("a1_doc_v2", "a1", []string{"chunk a1 v2"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	listPages := func(prefix string, limit int) [][]string {
+		t.Helper()
+		var pages [][]string
+		var cursor *ndb.SourcesCursor
+		for {
+			sources, err := db.SourcesPage(cursor, prefix, limit)
+			if err != nil {
+				t.Fatal(err)
+			}
+			if len(sources) == 0 {
+				return pages
+			}
+			page := make([]string, len(sources))
+			for i, source := range sources {
+				page[i] = source.Document
+			}
+			pages = append(pages, page)
+			last := sources[len(sources)-1]
+			cursor = &ndb.SourcesCursor{DocId: last.DocId, DocVersion: last.DocVersion}
+		}
+	}
+
+	if pages := listPages("", 2); !reflect.DeepEqual(pages, [][]string{{"a1_doc", "a1_doc_v2"}, {"a2_doc", "b1_doc"}, {"b2_doc", "c_doc"}}) {
+		t.Fatalf("incorrect pages: %v", pages)
+	}
+	if pages := listPages("b", 10); !reflect.DeepEqual(pages, [][]string{{"b1_doc", "b2_doc"}}) {
+		t.Fatalf("incorrect pages with prefix: %v", pages)
+	}
+	if pages := listPages("d", 10); len(pages) != 0 {
+		t.Fatalf("expected no pages, got %v", pages)
+	}
+
+	for prefix, expected := range map[string]int{"": 6, "a": 3, "a1": 2, "b2": 1, "d": 0} {
+		n, err := db.SourcesCount(prefix)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if n != expected {
+			t.Fatalf("expected %d sources with prefix %q, got %d", expected, prefix, n)
+		}
+	}
+
+	list, err := db.SourceList()
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer list.Free()
+
+	// The list is not changed by later modifications.
+	if err := db.Delete("a1", false); err != nil {
+		t.Fatal(err)
+	}
+	if list.Len() != 6 || list.At(0).Document != "a1_doc" {
+		t.Fatalf("source list should not change after delete, got %v", list.Slice())
+	}
+
+	if n, err := db.SourcesCount("a"); err != nil || n != 1 {
+		t.Fatalf("expected 1 source after delete, got %d, %v", n, err)
+	}
+	if pages := listPages("", 10); !reflect.DeepEqual(pages, [][]string{{"a2_doc", "b1_doc", "b2_doc", "c_doc"}}) {
+		t.Fatalf("incorrect pages after delete: %v", pages)
+	}
+
+	// Inserts and deletes update the cached sources in place, the pages must match
+	// the sources listed from the engine after a prune.
+	if err := db.Insert("b1_doc_v2", "b1", []string{"chunk b1 v2"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+	if err := db.Insert("a3_doc", "a3", []string{"chunk a3"}, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+	if _, _, err := db.DeleteBatch([]string{"b1", "c"}, true); err != nil {
+		t.Fatal(err)
+	}
+	expected := [][]string{{"a2_doc", "a3_doc", "b1_doc_v2", "b2_doc", "c_doc"}}
+	if pages := listPages("", 10); !reflect.DeepEqual(pages, expected) {
+		t.Fatalf("incorrect pages after updates: %v", pages)
+	}
+	if err := db.Prune(); err != nil {
+		t.Fatal(err)
+	}
+	if pages := listPages("", 10); !reflect.DeepEqual(pages, expected) {
+		t.Fatalf("incorrect pages after prune: %v", pages)
+	}
+}
+
+func TestHybridQuery(t *testing.T) {
+	dir := t.TempDir()
+	db, err := ndb.New(dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	_, err = db.InsertBatch([]ndb.Document{
+		{
+			Document:   "fruits",
+			DocId:      "fruits",
+			Chunks:     []string{"fruit apple", "fruit banana", "fruit cherry"},
+			Embeddings: [][]float32{{1, 0, 0}, {0, 1, 0}, {0, 0, 2}},
+		},
+		{
+			Document: "no_embeddings",
+			DocId:    "no_embeddings",
+			Chunks:   []string{"fruit durian"},
+		},
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	hybridIds := func(db *ndb.NeuralDB, embedding []float32, options ndb.HybridOptions) []uint64 {
+		t.Helper()
+		results, err := db.QueryHybrid("fruit", embedding, 4, nil, options)
+		if err != nil {
+			t.Fatal(err)
+		}
+		ids := make([]uint64, len(results))
+		for i, result := range results {
+			ids[i] = result.Id
+		}
+		return ids
+	}
+
+	denseOnly := ndb.HybridOptions{Fusion: ndb.ReciprocalRankFusion, DenseWeight: 1}
+	if ids := hybridIds(&db, []float32{0.1, 0.2, 1}, denseOnly); !slices.Equal(ids[:3], []uint64{2, 1, 0}) || ids[3] != 3 {
+		t.Fatalf("incorrect dense ranking: %v", ids)
+	}
+	if ids := hybridIds(&db, []float32{1, 0.5, 0}, ndb.HybridOptions{Fusion: ndb.WeightedFusion, DenseWeight: 0.9}); !slices.Equal(ids[:2], []uint64{0, 1}) {
+		t.Fatalf("incorrect weighted ranking: %v", ids)
+	}
+
+	results, err := db.QueryHybrid("durian", []float32{1, 0, 0}, 1, nil, ndb.DefaultHybridOptions())
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 1 || results[0].Id != 3 {
+		t.Fatalf("lexical results without embeddings should be returned: %v", results)
+	}
+
+	if _, err := db.QueryHybrid("fruit", []float32{1, 0}, 4, nil, ndb.DefaultHybridOptions()); err == nil {
+		t.Fatal("expected error for embedding with wrong dimension")
+	}
+	if _, err := db.QueryHybrid("fruit", []float32{1, 0, 0}, 4, nil, ndb.HybridOptions{DenseWeight: 2}); err == nil {
+		t.Fatal("expected error for invalid dense weight")
+	}
+
+	_, err = db.InsertBatch([]ndb.Document{{Document: "bad", DocId: "bad", Chunks: []string{"a", "b"}, Embeddings: [][]float32{{1, 0}, {0, 1}}}})
+	if err == nil {
+		t.Fatal("expected error for embeddings with wrong dimension")
+	}
+	_, err = db.InsertBatch([]ndb.Document{{Document: "bad", DocId: "bad", Chunks: []string{"a", "b"}, Embeddings: [][]float32{{1, 0, 0}}}})
+	if err == nil {
+		t.Fatal("expected error for missing embeddings")
+	}
+
+	saveDir := filepath.Join(t.TempDir(), "saved")
+	if err := db.Save(saveDir); err != nil {
+		t.Fatal(err)
+	}
+
+	loaded, err := ndb.NewWithOptions(saveDir, ndb.Options{ReadOnly: true})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer loaded.Free()
+
+	if ids := hybridIds(&loaded, []float32{0.1, 0.2, 1}, denseOnly); !slices.Equal(ids[:3], []uint64{2, 1, 0}) {
+		t.Fatalf("incorrect dense ranking after load: %v", ids)
+	}
+}
+
+func TestDenseIndexPersistence(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "ndb")
+
+	options := ndb.DefaultOptions()
+	options.MaxEmbeddingBytes = 6 * 4
+	db, err := ndb.NewWithOptions(path, options)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	insert := func(docId string, embeddings [][]float32) error {
+		chunks := make([]string, len(embeddings))
+		for i := range chunks {
+			chunks[i] = "fruit " + docId
+		}
+		_, err := db.InsertBatch([]ndb.Document{{Document: docId, DocId: docId, Chunks: chunks, Embeddings: embeddings}})
+		return err
+	}
+
+	if err := insert("a", [][]float32{{1, 0}, {0, 1}}); err != nil {
+		t.Fatal(err)
+	}
+	if err := insert("b", [][]float32{{1, 1}}); err != nil {
+		t.Fatal(err)
+	}
+	if err := insert("c", [][]float32{{1, 0}, {0, 1}}); err == nil {
+		t.Fatal("expected error for embeddings exceeding the maximum memory")
+	}
+	if stats := db.DenseIndexStats(); stats != (ndb.DenseIndexStats{Chunks: 3, Bytes: 24, MaxBytes: 24, Dim: 2}) {
+		t.Fatalf("incorrect dense index stats: %+v", stats)
+	}
+
+	if err := db.Delete("b", false); err != nil {
+		t.Fatal(err)
+	}
+	files, err := os.ReadDir(filepath.Join(path, "dense"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(files) != 1 || files[0].Name() != "0.1.emb" {
+		t.Fatalf("incorrect embedding files: %v", files)
+	}
+	db.Free()
+
+	// The embeddings are loaded from the ndb directory without saving it.
+	readOnly, err := ndb.NewWithOptions(path, ndb.Options{ReadOnly: true})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer readOnly.Free()
+
+	if stats := readOnly.DenseIndexStats(); stats.Chunks != 2 || stats.Bytes != 16 {
+		t.Fatalf("incorrect dense index stats after reopen: %+v", stats)
+	}
+	results, err := readOnly.QueryHybrid("fruit", []float32{0, 1}, 2, nil, ndb.HybridOptions{Fusion: ndb.ReciprocalRankFusion, DenseWeight: 1})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 2 || results[0].Id != 1 || results[1].Id != 0 {
+		t.Fatalf("incorrect dense ranking after reopen: %v", results)
+	}
+}
+
+func TestDenseIndexUpsertWithoutEmbeddings(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "ndb")
+
+	db, err := ndb.New(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	v1 := ndb.Document{Document: "a", DocId: "a", Chunks: []string{"fruit a", "fruit b"}, Embeddings: [][]float32{{1, 0}, {0, 1}}}
+	v2 := ndb.Document{Document: "a", DocId: "a", Chunks: []string{"fruit c"}}
+	if _, err := db.InsertBatch([]ndb.Document{v1, v2}); err != nil {
+		t.Fatal(err)
+	}
+	if stats := db.DenseIndexStats(); stats.Chunks != 2 || stats.Bytes != 16 {
+		t.Fatalf("incorrect dense index stats: %+v", stats)
+	}
+
+	// The latest version has no embeddings, so the embeddings of the version
+	// that the upsert deletes must be removed.
+	if err := db.Delete("a", true); err != nil {
+		t.Fatal(err)
+	}
+	if stats := db.DenseIndexStats(); stats.Chunks != 0 || stats.Bytes != 0 {
+		t.Fatalf("expected embeddings of deleted version to be removed: %+v", stats)
+	}
+	files, err := os.ReadDir(filepath.Join(path, "dense"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(files) != 0 {
+		t.Fatalf("expected no embedding files, got %v", files)
+	}
+
+	if sources, err := db.Sources(); err != nil || len(sources) != 1 || sources[0].DocVersion != 2 {
+		t.Fatalf("incorrect sources after delete: %v, %v", sources, err)
+	}
+}
+
+// copyDir copies an ndb that has been freed, so that it can be opened for
+// writes again in the same process.
+func copyDir(t *testing.T, src, dst string) {
+	err := filepath.Walk(src, func(path string, info os.FileInfo, err error) error {
+		if err != nil {
+			return err
+		}
+		rel, err := filepath.Rel(src, path)
+		if err != nil {
+			return err
+		}
+		if info.IsDir() {
+			return os.MkdirAll(filepath.Join(dst, rel), 0755)
+		}
+		data, err := os.ReadFile(path)
+		if err != nil {
+			return err
+		}
+		return os.WriteFile(filepath.Join(dst, rel), data, info.Mode())
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+}
+
+func denseFiles(t *testing.T, path string) []string {
+	entries, err := os.ReadDir(filepath.Join(path, "dense"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	names := make([]string, len(entries))
+	for i, entry := range entries {
+		names[i] = entry.Name()
+	}
+	return names
+}
+
+func TestDenseIndexRenameFailure(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "ndb")
+
+	db, err := ndb.New(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// A non empty directory at the final path of the block makes its rename fail.
+	blocker := "0.1.emb"
+	if err := os.MkdirAll(filepath.Join(path, "dense", blocker, "file"), 0755); err != nil {
+		t.Fatal(err)
+	}
+
+	builder, err := ndb.NewDocumentBuilder("a", "a")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer builder.Free()
+	if err := builder.AddChunks([]string{"fruit a", "fruit b"}, nil); err != nil {
+		t.Fatal(err)
+	}
+	if err := builder.AddEmbeddings([][]float32{{1, 0}, {0, 1}}); err != nil {
+		t.Fatal(err)
+	}
+
+	// The engine has inserted the document, so the insert must succeed.
+	info, err := db.InsertDocument(builder)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if info.DocVersion != 1 || info.StartId != 0 || info.EndId != 2 {
+		t.Fatalf("incorrect insert info: %+v", info)
+	}
+	if stats := db.DenseIndexStats(); stats.Chunks != 2 {
+		t.Fatalf("expected embeddings to be indexed: %+v", stats)
+	}
+	checkDense := func(db *ndb.NeuralDB) {
+		results, err := db.QueryHybrid("fruit", []float32{0, 1}, 1, nil, ndb.HybridOptions{Fusion: ndb.ReciprocalRankFusion, DenseWeight: 1})
+		if err != nil || len(results) != 1 || results[0].Id != 1 {
+			t.Fatalf("incorrect dense ranking: %v, %v", results, err)
+		}
+	}
+	checkDense(&db)
+	if files := denseFiles(t, path); !slices.Equal(files, []string{"0.1.emb", "0.tmp", "0.tmp.commit"}) {
+		t.Fatalf("incorrect embedding files: %v", files)
+	}
+
+	// The rename still fails on save, the file is saved under its final name.
+	saveDir := filepath.Join(t.TempDir(), "saved")
+	if err := db.Save(saveDir); err != nil {
+		t.Fatal(err)
+	}
+	loaded, err := ndb.NewWithOptions(saveDir, ndb.Options{ReadOnly: true})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer loaded.Free()
+	if stats := loaded.DenseIndexStats(); stats.Chunks != 2 {
+		t.Fatalf("expected embeddings to be saved: %+v", stats)
+	}
+	db.Free()
+
+	// Opening the ndb for reads loads the block from its temporary file.
+	readOnly, err := ndb.NewWithOptions(path, ndb.Options{ReadOnly: true})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer readOnly.Free()
+	checkDense(&readOnly)
+
+	// Opening the ndb for writes completes the rename.
+	recovered := filepath.Join(t.TempDir(), "recovered")
+	copyDir(t, path, recovered)
+	if err := os.RemoveAll(filepath.Join(recovered, "dense", blocker)); err != nil {
+		t.Fatal(err)
+	}
+	recoveredDb, err := ndb.New(recovered)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer recoveredDb.Free()
+	checkDense(&recoveredDb)
+	if files := denseFiles(t, recovered); !slices.Equal(files, []string{"0.1.emb"}) {
+		t.Fatalf("incorrect embedding files after recovery: %v", files)
+	}
+
+	// If the rename fails again when the ndb is opened, the block is kept under
+	// its temporary name until a save can rename it, and new inserts do not
+	// overwrite its file.
+	blocked := filepath.Join(t.TempDir(), "blocked")
+	copyDir(t, path, blocked)
+	blockedDb, err := ndb.New(blocked)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer blockedDb.Free()
+	checkDense(&blockedDb)
+	if _, err := blockedDb.InsertBatch([]ndb.Document{{Document: "b", DocId: "b", Chunks: []string{"other"}, Embeddings: [][]float32{{1, 1}}}}); err != nil {
+		t.Fatal(err)
+	}
+	checkDense(&blockedDb)
+
+	if err := os.RemoveAll(filepath.Join(blocked, "dense", blocker)); err != nil {
+		t.Fatal(err)
+	}
+	if err := blockedDb.Save(filepath.Join(t.TempDir(), "saved")); err != nil {
+		t.Fatal(err)
+	}
+	if files := denseFiles(t, blocked); !slices.Equal(files, []string{"0.1.emb", "2.1.emb"}) {
+		t.Fatalf("incorrect embedding files after save: %v", files)
+	}
+
+	if err := blockedDb.Delete("a", false); err != nil {
+		t.Fatal(err)
+	}
+	if files := denseFiles(t, blocked); !slices.Equal(files, []string{"2.1.emb"}) {
+		t.Fatalf("incorrect embedding files after delete: %v", files)
+	}
+}
+
+func TestQueryDeadline(t *testing.T) {
+	db, err := ndb.New(t.TempDir())
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer db.Free()
+
+	chunks := make([]string, 2000)
+	for i := range chunks {
+		chunks[i] = fmt.Sprintf("chunk %d token%d token%d", i, i%7, i%13)
+	}
+	if err := db.Insert("doc", "doc", chunks, nil, nil); err != nil {
+		t.Fatal(err)
+	}
+
+	cancelled, cancel := context.WithCancel(context.Background())
+	cancel()
+
+	if _, _, err := db.QueryContext(cancelled, "token1", 5, nil); !errors.Is(err, context.Canceled) {
+		t.Fatalf("expected canceled error, got %v", err)
+	}
+	if _, err := db.QueryBatchContext(cancelled, []ndb.BatchQuery{{Query: "token1", TopK: 5}}); !errors.Is(err, context.Canceled) {
+		t.Fatalf("expected canceled error, got %v", err)
+	}
+
+	ctx, cancel := context.WithTimeout(context.Background(), time.Minute)
+	defer cancel()
+	results, _, err := db.QueryContext(ctx, "token1 token2", 5, nil)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(results) != 5 {
+		t.Fatalf("expected 5 results, got %d", len(results))
+	}
+
+	// The queries match many chunks so that the batch takes much longer than the
+	// timeout to run.
+	queries := make([]ndb.BatchQuery, 5000)
+	for i := range queries {
+		queries[i] = ndb.BatchQuery{Query: fmt.Sprintf("chunk %d token%d token%d", i, i%7, i%13), TopK: 3}
+	}
+
+	ctx, cancel = context.WithTimeout(context.Background(), 10*time.Millisecond)
+	defer cancel()
+	batch, err := db.QueryBatchContext(ctx, queries)
+	if !errors.Is(err, context.DeadlineExceeded) {
+		t.Fatalf("expected deadline exceeded error, got %v", err)
+	}
+	if len(batch) != len(queries) {
+		t.Fatalf("expected %d results, got %d", len(queries), len(batch))
+	}
+
+	skipped := 0
+	for i, chunks := range batch {
+		if chunks == nil {
+			skipped++
+			continue
+		}
+		expected, err := db.Query(queries[i].Query, queries[i].TopK, nil)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if !reflect.DeepEqual(chunks, expected) {
+			t.Fatalf("query %d: partial results do not match query results", i)
+		}
+	}
+	if skipped == 0 {
+		t.Fatal("expected queries to be skipped after the deadline")
+	}
+}
@@ -40,6 +40,10 @@ class SearchParams(BaseModel):
     constraints: Dict[str, Union[AnyOf, EqualTo, Substring, LessThan, GreaterThan]] = {}
 
 
+class BatchSearchParams(BaseModel):
+    queries: List[SearchParams]
+
+
 class Reference(BaseModel):
     id: int
     text: str
@@ -54,6 +58,10 @@ class SearchResponse(BaseModel):
     references: List[Reference]
 
 
+class BatchSearchResponse(BaseModel):
+    results: List[SearchResponse]
+
+
 class DocumentMetadata(BaseModel):
     filename: str
     source_id: Optional[str] = None
@@ -102,6 +110,20 @@ class NDBClient:
         except requests.RequestException as e:
             raise RuntimeError(f"Search request failed: {e}")
 
+    def search_batch(self, params: BatchSearchParams) -> BatchSearchResponse:
+        """
+        Perform multiple search queries in a single request.
+        """
+        url = f"{self.base_url}/api/v1/search/batch"
+        try:
+            response = requests.post(url, json=params.model_dump())
+            response.raise_for_status()
+            return BatchSearchResponse(**response.json())
+        except ValidationError as e:
+            raise ValueError(f"Invalid response format: {e}")
+        except requests.RequestException as e:
+            raise RuntimeError(f"Batch search request failed: {e}")
+
     def insert(self, metadata: DocumentMetadata):
         """
         Insert a document into the database.
@@ -109,9 +131,10 @@ class NDBClient:
         url = f"{self.base_url}/api/v1/insert"
         try:
             with open(metadata.filename, "rb") as file:
+                # metadata is sent first so that the server can stream the file
                 files = {
-                    "file": file,
                     "metadata": (None, metadata.model_dump_json(), "application/json"),
+                    "file": file,
                 }
                 response = requests.post(url, files=files)
                 response.raise_for_status()